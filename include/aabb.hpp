@@ -1,7 +1,30 @@
+#ifndef INCLUDE_AABB_HPP_
+#define INCLUDE_AABB_HPP_
 #include "./load_model.hpp"
 #include <algorithm>
 #include <vector>
 
+// BVH build strategies, selected with `bvh=<median|sah|lbvh|sbvh>` on the
+// command line. BVH_SBVH goes through triangles_to_indexed_aabb
+enum {
+    BVH_MEDIAN = 0,
+    BVH_SAH = 1,
+    BVH_LBVH = 2,
+    BVH_SBVH = 3,
+};
+
+// Node layouts that can be uploaded to binding 4, selected with
+// `nodes=<binary|bvh4|bvh8|compressed8|compressed16|depth_first>` on the
+// command line
+enum {
+    NODES_BINARY = 0,
+    NODES_BVH4 = 1,
+    NODES_BVH8 = 2,
+    NODES_COMPRESSED8 = 3,
+    NODES_COMPRESSED16 = 4,
+    NODES_DEPTH_FIRST = 5,
+};
+
 struct Box {
     Box(PaddedVec3ForGLSL min, PaddedVec3ForGLSL max, int left_id, int right_id, int start,
         int end)
@@ -19,19 +42,47 @@ struct AABB {
     int root_id;
 };
 
-void print_triangle(const Triangle &t);
+void print_triangle(const TriangleForGLSL &t);
+
+PaddedVec3ForGLSL get_min(const std::vector<TriangleForGLSL *> &triangles,
+                          int start, int end);
+
+PaddedVec3ForGLSL get_max(const std::vector<TriangleForGLSL *> &triangles,
+                          int start, int end);
+
+PaddedVec3ForGLSL empty_min();
+
+PaddedVec3ForGLSL empty_max();
+
+void grow(PaddedVec3ForGLSL &min, PaddedVec3ForGLSL &max,
+          const PaddedVec3ForGLSL &other_min,
+          const PaddedVec3ForGLSL &other_max);
+
+float surface_area(const PaddedVec3ForGLSL &min, const PaddedVec3ForGLSL &max);
 
 int get_next_coord(int coord);
 
 float get_coord(int coord, const PaddedVec3ForGLSL &v);
 
-Box triangles_to_box(std::vector<Box> &boxes,
-                     std::vector<TriangleForGLSL *> &triangles, int start,
-                     int end, int coord);
+float get_centroid(int coord, const TriangleForGLSL *triangle);
 
 AABB *triangles_to_aabb(std::vector<Box> &boxes,
                         std::vector<TriangleForGLSL *> &triangles, int start,
-                        int end, int coord);
+                        int end, int coord, int strategy = BVH_SAH);
+
+// Builds a split BVH whose leaves index triangle_indices instead of the
+// triangles themselves, see sbvh.hpp
+AABB *triangles_to_indexed_aabb(std::vector<Box> &boxes,
+                                const std::vector<TriangleForGLSL *> &triangles,
+                                std::vector<int> &triangle_indices,
+                                float budget);
+
+// Surface area heuristic cost of the tree, relative to the root's area:
+// inner nodes count once and leaves once per triangle, weighted by the
+// probability of a random ray through the root hitting them
+float get_sah_cost(const std::vector<Box> &boxes, int root_id);
 
 void print_box(std::vector<Box> boxes, int box_id, size_t depth,
                std::vector<TriangleForGLSL *> &triangles);
+
+#endif // INCLUDE_AABB_HPP_
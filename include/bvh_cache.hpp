@@ -0,0 +1,81 @@
+#ifndef INCLUDE_BVH_CACHE_HPP_
+#define INCLUDE_BVH_CACHE_HPP_
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./mapped_file.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Bumped whenever the file layout or any uploaded struct changes, so old
+// caches are rebuilt instead of misread
+const uint32_t BVH_CACHE_VERSION = 1;
+
+// The file starts with this header, followed by the triangles, the boxes,
+// the triangle indices and the textures, each starting on a 16 byte
+// boundary. Every texture is a CachedTextureHeader followed by its pixels
+struct BvhCacheHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t root_id;
+    uint64_t key;
+    uint64_t triangle_count;
+    uint64_t box_count;
+    uint64_t index_count;
+    uint64_t texture_count;
+};
+
+struct CachedTextureHeader {
+    int32_t width;
+    int32_t height;
+    int32_t component;
+    int32_t bits;
+    int32_t pixel_type;
+    int32_t padding;
+    uint64_t byte_count;
+};
+
+// A cache file mapped into memory. triangles, boxes and triangle_indices
+// point straight into the mapping, so they can be handed to the SSBOs
+// without a copy
+struct BvhCache {
+    explicit BvhCache(const std::string &path) : file(path) {}
+    MappedFile file;
+    int root_id;
+    size_t triangle_count;
+    const TriangleForGLSL *triangles;
+    size_t box_count;
+    const Box *boxes;
+    size_t index_count;
+    const int *triangle_indices;
+    std::vector<tinygltf::Image> textures;
+};
+
+// Hash of the model files (and the buffers and images a .gltf points to)
+// together with everything else that changes the result
+uint64_t hash_scene(const std::vector<std::string> &model_paths,
+                    const std::string &settings);
+
+// nullptr when there is no cache at path, or it is damaged, from another
+// version or for another key
+std::unique_ptr<BvhCache> open_bvh_cache(const std::string &path,
+                                         uint64_t key);
+
+// Writes to a temporary file first, so a crash never leaves half a cache
+void write_bvh_cache(const std::string &path, uint64_t key,
+                     const std::vector<TriangleForGLSL *> &triangles,
+                     const std::vector<Box> &boxes, int root_id,
+                     const std::vector<int> &triangle_indices,
+                     const std::vector<tinygltf::Image> &textures);
+
+// The same file, with the triangles and boxes copied from files that hold
+// nothing else, so that neither has to fit into memory
+void write_bvh_cache_from_files(const std::string &path, uint64_t key,
+                                const std::string &triangles_path,
+                                size_t triangle_count,
+                                const std::string &boxes_path,
+                                size_t box_count, int root_id,
+                                const std::vector<tinygltf::Image> &textures);
+
+#endif // INCLUDE_BVH_CACHE_HPP_
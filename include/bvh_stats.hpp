@@ -0,0 +1,37 @@
+#ifndef INCLUDE_BVH_STATS_HPP_
+#define INCLUDE_BVH_STATS_HPP_
+#include "./aabb.hpp"
+#include <ostream>
+#include <vector>
+
+// Numbers that tell a slow tree apart from heavy geometry, printed with
+// --bvh-stats
+struct BvhStats {
+    int node_count;
+    int inner_count;
+    int leaf_count;
+    // Triangles referenced by leaves, more than the triangle count when the
+    // split BVH put some of them in several leaves
+    int leaf_references;
+    int max_depth;
+    float average_leaf_depth;
+    float sah_cost;
+    // leaf_histogram[n] is the number of leaves with n triangles
+    std::vector<int> leaf_histogram;
+    // Surface area shared by siblings over the surface area of their
+    // parents, summed over every inner node
+    float sibling_overlap;
+    // Volume of inner nodes that neither child covers over their whole
+    // volume, summed over every inner node
+    float empty_space;
+    size_t node_bytes;
+    size_t triangle_bytes;
+    size_t index_bytes;
+};
+
+BvhStats get_bvh_stats(const std::vector<Box> &boxes, int root_id,
+                       int triangle_count, int index_count);
+
+void write_bvh_stats_json(std::ostream &out, const BvhStats &stats);
+
+#endif // INCLUDE_BVH_STATS_HPP_
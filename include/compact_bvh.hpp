@@ -0,0 +1,44 @@
+#ifndef INCLUDE_COMPACT_BVH_HPP_
+#define INCLUDE_COMPACT_BVH_HPP_
+#include "./aabb.hpp"
+#include "./thread_pool.hpp"
+#include <cstdint>
+#include <vector>
+
+// What the builder needs to know about a triangle, 32 bytes so that two
+// fit in a cache line. The index of the triangle it stands for sits in the
+// padding of min
+struct BuildRecord {
+    float min[3];
+    uint32_t index;
+    float max[3];
+    float padding;
+};
+
+static_assert(sizeof(BuildRecord) == 32, "BuildRecord must stay compact");
+
+// One record per triangle in [start, end), filled on pool. records[i]
+// stands for triangles[start + i]
+std::vector<BuildRecord>
+get_build_records(ThreadPool &pool,
+                  const std::vector<TriangleForGLSL *> &triangles, int start,
+                  int end);
+
+// Puts the triangles the records stand for into the order the records were
+// sorted into, starting at start
+void apply_build_records(ThreadPool &pool,
+                         std::vector<TriangleForGLSL *> &triangles, int start,
+                         const std::vector<BuildRecord> &records);
+
+void get_record_bounds(const std::vector<BuildRecord> &records, int start,
+                       int end, PaddedVec3ForGLSL &min,
+                       PaddedVec3ForGLSL &max);
+
+// Median split tree over the records, with its work on a fixed stack
+// instead of recursing. The triangles in [start, end) are put in the final
+// order once, at the end
+Box triangles_to_box_compact(std::vector<Box> &boxes,
+                             std::vector<TriangleForGLSL *> &triangles,
+                             int start, int end, int coord);
+
+#endif // INCLUDE_COMPACT_BVH_HPP_
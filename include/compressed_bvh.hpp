@@ -0,0 +1,77 @@
+#ifndef INCLUDE_COMPRESSED_BVH_HPP_
+#define INCLUDE_COMPRESSED_BVH_HPP_
+#include "./aabb.hpp"
+#include "./ray.hpp"
+#include "./wide_bvh.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// 4-wide node whose child bounds are quantized relative to the node's own
+// box. The box is stored as an origin and one power-of-two step per axis, so
+// a child bound decodes as origin + q * 2^exponent, which is exact apart
+// from the final addition and gives the same result on the CPU and the GPU.
+// Child bounds are rounded outwards, so a decoded box always contains the
+// real one.
+//
+// Slots follow the Bvh4Node convention: count > 0 is a leaf covering
+// triangles [child, child + count), count == 0 with child >= 0 is an inner
+// node and child == -1 is unused (decoded with min above max). Leaves can
+// hold at most 255 triangles. The root is node 0.
+//
+// With nodes=compressed8 binding 4 holds, in std430 (64 bytes):
+//   struct CompressedNode8 {
+//       vec3 origin; uint exponents; // 3 signed bytes, x first
+//       uint q_min_x; uint q_min_y; uint q_min_z; // one byte per child
+//       uint q_max_x; uint q_max_y; uint q_max_z;
+//       int child[4]; uint counts; // one byte per child
+//   };
+// child has to be an array, an ivec4 would be aligned to 16 bytes. With
+// nodes=compressed16 (96 bytes) every q_* member is a uvec2 holding four 16
+// bit values. The step is best built as
+// intBitsToFloat((exponent + 127) << 23) to keep it exact.
+template <typename Quantized> struct alignas(16) CompressedNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t padding0;
+    Quantized q_min_x[4];
+    Quantized q_min_y[4];
+    Quantized q_min_z[4];
+    Quantized q_max_x[4];
+    Quantized q_max_y[4];
+    Quantized q_max_z[4];
+    int32_t child[4];
+    uint8_t count[4];
+};
+
+using CompressedNode8 = CompressedNode<uint8_t>;
+using CompressedNode16 = CompressedNode<uint16_t>;
+
+static_assert(sizeof(CompressedNode8) == 64,
+              "CompressedNode8 must match std430");
+static_assert(offsetof(CompressedNode8, child) == 40 &&
+                  offsetof(CompressedNode8, count) == 56,
+              "CompressedNode8 must match std430");
+static_assert(sizeof(CompressedNode16) == 96,
+              "CompressedNode16 must match std430");
+static_assert(offsetof(CompressedNode16, child) == 64 &&
+                  offsetof(CompressedNode16, count) == 80,
+              "CompressedNode16 must match std430");
+
+// Collapses the tree to BVH4 and quantizes it. Throws if a leaf has more than
+// 255 triangles
+std::vector<CompressedNode8> compress_to_bvh4q8(const std::vector<Box> &boxes,
+                                                int root_id);
+
+std::vector<CompressedNode16>
+compress_to_bvh4q16(const std::vector<Box> &boxes, int root_id);
+
+Hit trace_compressed8(const std::vector<CompressedNode8> &nodes,
+                      const TriangleForGLSL *triangles,
+                      const int *triangle_indices, const Ray &ray);
+
+Hit trace_compressed16(const std::vector<CompressedNode16> &nodes,
+                       const TriangleForGLSL *triangles,
+                       const int *triangle_indices, const Ray &ray);
+
+#endif // INCLUDE_COMPRESSED_BVH_HPP_
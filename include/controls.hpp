@@ -14,5 +14,6 @@ void update_movement(GLFWwindow *window, int mode);
 glm::vec2 get_rotation();
 glm::vec3 get_position();
 int get_render_mode();
+bool get_stackless();
 
 #endif
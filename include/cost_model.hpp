@@ -0,0 +1,45 @@
+#ifndef INCLUDE_COST_MODEL_HPP_
+#define INCLUDE_COST_MODEL_HPP_
+#include "./load_model.hpp"
+#include <vector>
+
+// Where the tree is going to be traversed, selected with
+// `cost=<gpu|cpu|calibrate>` on the command line
+enum {
+    COST_GPU = 0,
+    COST_CPU = 1,
+};
+
+// Relative cost of visiting an inner node and of testing one triangle. The
+// builders make a node a leaf once testing all of its triangles is no more
+// expensive than visiting it and then its children, and never put more
+// than max_leaf_size triangles in one leaf
+struct CostModel {
+    float traversal;
+    float intersection;
+    int max_leaf_size;
+};
+
+CostModel get_default_cost_model(int backend);
+
+// Times box and triangle tests of the reference traversal in ray.cpp on
+// this machine, with traversal normalized to 1
+CostModel calibrate_cost_model();
+
+// Must be called before building to have any effect; the GPU constants are
+// used otherwise
+void set_cost_model(const CostModel &model);
+
+const CostModel &get_cost_model();
+
+// split_cost is the surface area of each child times its triangle count,
+// summed over both children, as pick_sah_split computes it
+bool should_make_leaf(int count, const PaddedVec3ForGLSL &min,
+                      const PaddedVec3ForGLSL &max, float split_cost);
+
+// For builders that pick the split without looking at costs: weighs a leaf
+// over [start, end) against splitting it at mid
+bool should_make_leaf(const std::vector<TriangleForGLSL *> &triangles,
+                      int start, int mid, int end);
+
+#endif // INCLUDE_COST_MODEL_HPP_
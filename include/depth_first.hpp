@@ -0,0 +1,37 @@
+#ifndef INCLUDE_DEPTH_FIRST_HPP_
+#define INCLUDE_DEPTH_FIRST_HPP_
+#include "./aabb.hpp"
+#include "./ray.hpp"
+#include <vector>
+
+// Binary node in depth-first order: the first child of an inner node is
+// always the node right after it, so only the second one is stored.
+// An inner node has count == 0 and offset is the id of its second child,
+// a leaf covers triangles [offset, offset + count). Empty leaves get empty
+// bounds, so they are never entered.
+//
+// Matches this std430 layout at binding 4 when uploaded with
+// nodes=depth_first:
+//   struct DepthFirstNode { vec3 min; int offset; vec3 max; int count; };
+// The root is always node 0
+struct DepthFirstNode {
+    float min[3];
+    int offset;
+    float max[3];
+    int count;
+};
+
+static_assert(sizeof(DepthFirstNode) == 32,
+              "DepthFirstNode must match std430");
+
+// Lays the tree out in pre-order, going into the child with the larger box
+// first. Rays enter that one more often, so the path they usually take from
+// the root is packed into the first cache lines
+std::vector<DepthFirstNode> to_depth_first(const std::vector<Box> &boxes,
+                                           int root_id);
+
+Hit trace_depth_first(const std::vector<DepthFirstNode> &nodes,
+                      const TriangleForGLSL *triangles,
+                      const int *triangle_indices, const Ray &ray);
+
+#endif // INCLUDE_DEPTH_FIRST_HPP_
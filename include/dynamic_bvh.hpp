@@ -0,0 +1,54 @@
+#ifndef INCLUDE_DYNAMIC_BVH_HPP_
+#define INCLUDE_DYNAMIC_BVH_HPP_
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include <vector>
+
+// [start, end) of an array that changed and has to be uploaded again
+struct DirtyRange {
+    int start;
+    int end;
+};
+
+// A built scene that models can be added to and removed from while it is
+// being rendered. Unlike the builders' output, boxes are in no particular
+// order and the root can be anywhere. Unused boxes are empty leaves, and
+// triangles of removed models stay in the array unreferenced until the
+// next full build
+struct DynamicScene {
+    std::vector<TriangleForGLSL> triangles;
+    std::vector<Box> boxes;
+    int root_id;
+
+    std::vector<int> parents;
+    // Per triangle slot, -1 once the triangle was removed
+    std::vector<int> triangle_models;
+    std::vector<int> triangle_leaves;
+    std::vector<int> free_boxes;
+    int model_count;
+    int removed_triangles;
+
+    std::vector<DirtyRange> dirty_boxes;
+    std::vector<DirtyRange> dirty_triangles;
+};
+
+// triangles and boxes as they came out of the builder, triangle_models
+// gives the model of every triangle in that order
+DynamicScene make_dynamic_scene(const std::vector<TriangleForGLSL *> &triangles,
+                                const std::vector<int> &triangle_models,
+                                const std::vector<Box> &boxes, int root_id,
+                                int model_count);
+
+// Builds a SAH tree over the model and hangs it where it adds the least
+// surface area, rotating the nodes above it. Returns the new model's id
+int insert_model(DynamicScene &scene,
+                 std::vector<TriangleForGLSL *> &triangles);
+
+// Returns true when so many triangles were removed that a full rebuild
+// would be worth it
+bool remove_model(DynamicScene &scene, int model);
+
+// Sorted, merged ranges changed since the last call, and forgets them
+std::vector<DirtyRange> take_dirty_ranges(std::vector<DirtyRange> &dirty);
+
+#endif // INCLUDE_DYNAMIC_BVH_HPP_
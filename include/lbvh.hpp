@@ -0,0 +1,24 @@
+#ifndef INCLUDE_LBVH_HPP_
+#define INCLUDE_LBVH_HPP_
+#include "./aabb.hpp"
+#include "./thread_pool.hpp"
+#include <cstdint>
+#include <vector>
+
+// Scenes with more triangles than this get 63-bit Morton codes (21 bits per
+// axis) instead of 30-bit ones, so that fewer centroids end up with equal
+// codes and have to be split blindly
+const int LBVH_MORTON64_THRESHOLD = 1 << 20;
+
+uint32_t morton_code30(float x, float y, float z);
+
+uint64_t morton_code63(float x, float y, float z);
+
+// Linear BVH: sorts the triangles along a Morton curve through their
+// centroids and splits every node at the highest bit where the codes of its
+// triangles differ. Much faster to build than SAH, at the cost of worse trees
+Box triangles_to_box_lbvh(ThreadPool &pool, std::vector<Box> &boxes,
+                          std::vector<TriangleForGLSL *> &triangles, int start,
+                          int end);
+
+#endif // INCLUDE_LBVH_HPP_
@@ -0,0 +1,46 @@
+#ifndef INCLUDE_LEAF_TRIANGLES_HPP_
+#define INCLUDE_LEAF_TRIANGLES_HPP_
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./ray.hpp"
+#include <vector>
+
+// What the shaders need to test a ray against a triangle, precomputed at
+// build time (Woop's unit triangle test): the rows of the affine transform
+// that takes the triangle to (0, 0, 0), (1, 0, 0), (0, 1, 0). A ray moved
+// into that space hits where it crosses z = 0 with x, y >= 0 and
+// x + y <= 1. Degenerate triangles get a transform no ray ever hits.
+//
+// Record i belongs to slot i of the leaves, so it is the triangle
+// triangle_indices[i] for the split BVH and triangle i otherwise. Matches
+// this std430 layout at binding 10 when uploaded with triangles=woop:
+//   struct LeafTriangle { vec4 rows[3]; };
+// The full TriangleForGLSL is only needed for the closest hit
+struct LeafTriangle {
+    Vec4ForGLSL rows[3];
+};
+
+static_assert(sizeof(LeafTriangle) == 48, "LeafTriangle must match std430");
+
+// Leaf triangle formats, selected with `triangles=<full|woop>`
+enum {
+    LEAF_TRIANGLES_FULL = 0,
+    LEAF_TRIANGLES_WOOP = 1,
+};
+
+LeafTriangle to_leaf_triangle(const TriangleForGLSL &triangle);
+
+// triangle_indices may be empty when the leaves reference the triangles
+std::vector<LeafTriangle>
+to_leaf_triangles(const TriangleForGLSL *triangles, size_t triangle_count,
+                  const std::vector<int> &triangle_indices);
+
+bool intersect_leaf_triangle(const Ray &ray, const LeafTriangle &triangle,
+                             float &t);
+
+// Like trace_boxes, only triangle_indices is read for the closest hit
+Hit trace_leaf_triangles(const std::vector<Box> &boxes, int root_id,
+                         const std::vector<LeafTriangle> &leaf_triangles,
+                         const int *triangle_indices, const Ray &ray);
+
+#endif // INCLUDE_LEAF_TRIANGLES_HPP_
@@ -1,16 +1,14 @@
 #ifndef INCLUDE_LOAD_MODEL_HPP_
 #define INCLUDE_LOAD_MODEL_HPP_
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "./thread_pool.hpp"
 #include "./tiny_gltf.h"
 
-struct Vec2 {
-    double x;
-    double y;
-};
-
 struct Vec3 {
     double x;
     double y;
@@ -24,14 +22,6 @@ struct Vec4 {
     double w;
 };
 
-struct Vertex {
-    double x;
-    double y;
-    double z;
-    double uv_x;
-    double uv_y;
-};
-
 struct Matrix4 {
     Vec4 v1;
     Vec4 v2;
@@ -39,23 +29,6 @@ struct Matrix4 {
     Vec4 v4;
 };
 
-struct Triangle {
-    Vec3 v1;
-    Vec3 v2;
-    Vec3 v3;
-    Vec2 uv1;
-    Vec2 uv2;
-    Vec2 uv3;
-    uint32_t texture_id;
-    uint32_t metallic_roughness_texture_id;
-    double metallic_factor;
-    double roughness_factor;
-    double alpha_cutoff;
-    bool double_sided;
-    Vec3 emissive_factor;
-    Vec4 base_color_factor;
-};
-
 struct Vec2ForGLSL {
     float x;
     float y;
@@ -107,37 +80,124 @@ struct TriangleForGLSL {
 
 
 struct OurNode {
+    // glTF mesh the primitives were decoded from, -1 if there is none. When
+    // meshes are shared only the first node that draws a mesh holds its
+    // primitives, the others just name it
+    int mesh = -1;
     Vec3 translation;
     Vec4 rotation;
     Vec3 scale;
     Matrix4 matrix;
     std::vector<OurNode> children;
-    std::vector<Triangle> primitives;
+    // In the node's own space
+    std::vector<TriangleForGLSL> primitives;
     std::vector<tinygltf::Image> images;
 };
 
 Vec3 make_vec3(const std::vector<double> &vec);
 
-Vec3 make_vec3(const float *vec);
-
 Vec4 make_vec4(const std::vector<double> &vec);
 
 Vec4 make_vec4(const Vec3 &vec, double w);
 
 Matrix4 make_matrix4(const std::vector<double> &vec);
 
+Matrix4 mul_matrixes(const Matrix4 &m1, const Matrix4 &m2);
+
 Matrix4 compose_matrix(const Vec3 &translation, const Vec4 &rotation,
                        const Vec3 &scale);
 
+PaddedVec3ForGLSL transform4(const Matrix4 &matrix, const Vec3 &vector3);
+
+PaddedVec3ForGLSL transform4(const Matrix4 &matrix,
+                             const PaddedVec3ForGLSL &vector);
+
+PaddedVec3ForGLSL v3_min(const PaddedVec3ForGLSL &v1,
+                         const PaddedVec3ForGLSL &v2,
+                         const PaddedVec3ForGLSL &v3);
+
+PaddedVec3ForGLSL v3_max(const PaddedVec3ForGLSL &v1,
+                         const PaddedVec3ForGLSL &v2,
+                         const PaddedVec3ForGLSL &v3);
+
 void print_json_node(const OurNode &node);
 
 void print_node(const OurNode &node, size_t depth = 0);
 
+// Triangles decoded by one task of decode_primitives
+const size_t LOAD_CHUNK_TRIANGLES = 1 << 15;
+
+// Adds node and its children to parent, with the primitives of every node
+// sized but not decoded yet. With sized_meshes (one flag per glTF mesh),
+// only the first node that draws a mesh gets its primitives
 void load_node(OurNode *parent, const tinygltf::Node &node,
-               const tinygltf::Model &model, float global_scale);
+               const tinygltf::Model &model, float global_scale,
+               std::vector<bool> *sized_meshes = nullptr);
+
+// Decodes the primitives of every node under root that load_node sized, in
+// chunks of LOAD_CHUNK_TRIANGLES on pool. buffers holds where the bytes of
+// each of model's buffers start, see get_buffer_data
+void decode_primitives(ThreadPool &pool, OurNode &root,
+                       const tinygltf::Model &model,
+                       const std::vector<const unsigned char *> &buffers);
+
+// With share_meshes every glTF mesh is decoded once, see OurNode::mesh
+OurNode load_model(std::string filename, bool share_meshes = false);
+
+// Receives count world space triangles from load_model_chunks
+using TriangleSink =
+    std::function<void(const TriangleForGLSL *triangles, size_t count)>;
+
+// Gives the same triangles as load_model followed by flatten_model, in the
+// same order, but decodes only LOAD_CHUNK_TRIANGLES of them at a time and
+// hands each chunk to sink instead of keeping them. The model's images are
+// appended to images. Returns how many bytes of the file were held in
+// memory meanwhile: its images and any buffers that weren't mapped
+size_t load_model_chunks(const std::string &filename,
+                         std::vector<tinygltf::Image> &images,
+                         const TriangleSink &sink);
+
+TriangleForGLSL transform_triangle(const TriangleForGLSL &triangle,
+                                   const Matrix4 &matrix);
+
+// The world space triangles of a scene in one block, allocated once and
+// freed in one go. The builders sort pointers into it, reorder then moves
+// the triangles themselves into that order so the block can be uploaded
+class TriangleArena {
+  public:
+    TriangleArena() = default;
+    explicit TriangleArena(size_t count);
+
+    TriangleForGLSL *data() { return triangles.get(); }
+    const TriangleForGLSL *data() const { return triangles.get(); }
+    size_t size() const { return count; }
+
+    // One pointer to every triangle, in the order they are stored
+    std::vector<TriangleForGLSL *> get_pointers();
+    // Moves the triangles in [start, end) into the order of
+    // pointers[start, end), which must point to each of them once.
+    // Afterwards pointers[i] points to the i-th triangle
+    void reorder(std::vector<TriangleForGLSL *> &pointers, size_t start,
+                 size_t end);
+
+  private:
+    std::unique_ptr<TriangleForGLSL[]> triangles;
+    size_t count = 0;
+};
+
+TriangleArena flatten_model(const OurNode &model);
 
-OurNode load_model(std::string filename);
+// Flattens every model into its own slice of one arena, in order and as
+// its own task on pool. model_starts gets the index of every model's first
+// triangle. The models' primitives are freed once they are flattened
+TriangleArena flatten_models(ThreadPool &pool, std::vector<OurNode> &models,
+                             std::vector<size_t> &model_starts);
 
-std::vector<TriangleForGLSL*> node_to_triangles(const OurNode &node);
+// Loads every file as its own task on pool. The models come back in the
+// order of paths; if any file fails, the error of the first failing one in
+// that order is thrown
+std::vector<OurNode> load_models(ThreadPool &pool,
+                                 const std::vector<std::string> &paths,
+                                 bool share_meshes = false);
 
 #endif // INCLUDE_LOAD_MODEL_HPP_
@@ -0,0 +1,32 @@
+#ifndef INCLUDE_MAPPED_FILE_HPP_
+#define INCLUDE_MAPPED_FILE_HPP_
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file. Memory-mapped where the platform allows
+// it, read into memory otherwise. Throws std::runtime_error when the file
+// can't be opened
+class MappedFile {
+  public:
+    explicit MappedFile(const std::string &path);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const unsigned char *data() const { return bytes; }
+    size_t size() const { return byte_count; }
+    // Hints that the file is read front to back once, so the kernel reads
+    // ahead and drops the pages behind. Does nothing when it isn't mapped
+    void advise_sequential() const;
+
+  private:
+    const unsigned char *bytes = nullptr;
+    size_t byte_count = 0;
+    bool mapped = false;
+    std::vector<unsigned char> buffer;
+};
+
+bool file_exists(const std::string &path);
+
+#endif // INCLUDE_MAPPED_FILE_HPP_
@@ -0,0 +1,28 @@
+#ifndef INCLUDE_MAPPED_GLB_HPP_
+#define INCLUDE_MAPPED_GLB_HPP_
+#include "./mapped_file.hpp"
+#include "./tiny_gltf.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// The BIN chunk of a .glb, read in place from a mapping of the file
+struct MappedGlb {
+    std::unique_ptr<MappedFile> file;
+    const unsigned char *bin = nullptr;
+};
+
+// Loads a .glb like TinyGLTF::LoadBinaryFromFile, but tinygltf only gets
+// the JSON chunk and the images stored in the BIN chunk, so the geometry
+// is never copied into model->buffers. Files that don't look like a plain
+// .glb are handed to tinygltf from the mapping as they are
+bool load_mapped_glb(tinygltf::TinyGLTF &loader, tinygltf::Model *model,
+                     MappedGlb &glb, std::string *err, std::string *warn,
+                     const std::string &filename);
+
+// Start of every buffer of model, the first one from glb.bin when it was
+// left in the file
+std::vector<const unsigned char *>
+get_buffer_data(const tinygltf::Model &model, const MappedGlb &glb);
+
+#endif // INCLUDE_MAPPED_GLB_HPP_
@@ -0,0 +1,36 @@
+#ifndef INCLUDE_OUT_OF_CORE_HPP_
+#define INCLUDE_OUT_OF_CORE_HPP_
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What one triangle costs while its bucket is built: the triangle, the
+// pointer the builders sort and, generously, two boxes
+const size_t OUT_OF_CORE_BYTES_PER_TRIANGLE =
+    sizeof(TriangleForGLSL) + sizeof(TriangleForGLSL *) + 2 * sizeof(Box);
+
+// Triangles are read back from the bucket files this many at a time
+const size_t OUT_OF_CORE_CHUNK = 1 << 16;
+
+// Builds the tree over the models without ever holding more than about
+// memory_budget bytes of triangles and boxes, and writes it as a cache
+// file (see bvh_cache.hpp) that can be mapped afterwards.
+//
+// The triangles of every model are written to a file chunk by chunk as
+// they are decoded. That file is split at the middle of its centroids' longest
+// axis, again and again, until every part fits into the budget. Each part
+// is then built in memory with strategy and its triangles and boxes are
+// appended to spill files. The splits become the top of the tree. Only the
+// textures, and the buffers of one model at a time unless it is a .glb,
+// are held in memory as a whole; a warning is printed when they alone take
+// more than the budget.
+// Throws std::runtime_error when a file can't be written
+void build_out_of_core(const std::vector<std::string> &model_paths,
+                       const std::string &path, uint64_t key,
+                       size_t memory_budget, int strategy,
+                       std::vector<tinygltf::Image> &textures);
+
+#endif // INCLUDE_OUT_OF_CORE_HPP_
@@ -0,0 +1,37 @@
+#ifndef INCLUDE_PARALLEL_BVH_HPP_
+#define INCLUDE_PARALLEL_BVH_HPP_
+#include "./aabb.hpp"
+#include "./thread_pool.hpp"
+#include <functional>
+#include <vector>
+
+// Subtrees with fewer triangles than this are built by a single task
+const int PARALLEL_BUILD_GRAIN = 16384;
+
+// Number of triangles binned or partitioned by one task at the top levels.
+// Fixed, so that the tree does not depend on the number of threads
+const int PARALLEL_CHUNK = 65536;
+
+// Splits [start, end) in two and returns where the right half starts
+using SplitFunction = std::function<int(int start, int end)>;
+
+// Builds the whole subtree over [start, end) into arena, root last
+using SubtreeFunction =
+    std::function<void(std::vector<Box> &arena, int start, int end)>;
+
+// Splits the range with `split` down to the grain and hands every piece to
+// `build_sequential` as its own task. Nodes are emitted in the order of the
+// recursive builders, and the root is returned instead of appended
+Box build_in_parallel(ThreadPool &pool, std::vector<Box> &boxes, int start,
+                      int end, const SplitFunction &split,
+                      const SubtreeFunction &build_sequential);
+
+// Builds the same kind of tree as records_to_box_sah over BuildRecords for
+// the triangles, splitting the work across the pool, then puts the
+// triangles in order once. Nodes come out in the same order as the
+// recursive build would emit them, so the result is deterministic
+Box triangles_to_box_parallel(ThreadPool &pool, std::vector<Box> &boxes,
+                              std::vector<TriangleForGLSL *> &triangles,
+                              int start, int end);
+
+#endif // INCLUDE_PARALLEL_BVH_HPP_
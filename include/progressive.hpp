@@ -0,0 +1,61 @@
+#ifndef INCLUDE_PROGRESSIVE_HPP_
+#define INCLUDE_PROGRESSIVE_HPP_
+#include "./aabb.hpp"
+#include "./dynamic_bvh.hpp"
+#include "./load_model.hpp"
+#include "./thread_pool.hpp"
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// The coarse tree sorts the triangles into the cells of this many bits of
+// a Morton curve, up to a few cells per worker for the refinement
+const int PROGRESSIVE_COARSE_BITS = 9;
+
+// Buckets the triangles by the top bits of their centroids' Morton codes
+// and makes every non-empty bucket a leaf. Only a few passes over the
+// triangles, it gives a valid, if slow, tree to render while the real one
+// is built
+AABB *build_coarse_bvh(std::vector<Box> &boxes,
+                       std::vector<TriangleForGLSL *> &triangles);
+
+// A coarse leaf built properly. boxes use their own ids, their triangle
+// ranges are the ones in the shared array
+struct RefinedLeaf {
+    int leaf_id;
+    int root_id;
+    std::vector<Box> boxes;
+};
+
+// Builds a tree with strategy over every leaf of a coarse tree in the
+// background. Every task only reorders the triangles of its own leaf, so
+// until finished() the triangles outside those ranges may be read, but
+// none of them may be touched
+class ProgressiveBuild {
+  public:
+    ProgressiveBuild(ThreadPool &pool,
+                     std::vector<TriangleForGLSL *> &triangles,
+                     const std::vector<Box> &boxes, int strategy);
+    // Waits for the subtrees that are still being built
+    ~ProgressiveBuild();
+    ProgressiveBuild(const ProgressiveBuild &) = delete;
+    ProgressiveBuild &operator=(const ProgressiveBuild &) = delete;
+
+    // Puts every subtree finished since the last call in place of its
+    // coarse leaf: the leaf's box becomes the subtree's root and the rest
+    // is appended, so the tree is valid after every call. Adds what changed
+    // to the dirty ranges and returns the number of subtrees swapped in
+    int swap_in_finished(std::vector<Box> &boxes,
+                         std::vector<DirtyRange> &dirty_boxes,
+                         std::vector<DirtyRange> &dirty_triangles);
+    bool finished() const { return remaining == 0; }
+
+  private:
+    ThreadPool &pool;
+    TaskGroup group;
+    std::mutex mutex;
+    std::vector<RefinedLeaf> done;
+    std::atomic<int> remaining{0};
+};
+
+#endif // INCLUDE_PROGRESSIVE_HPP_
@@ -0,0 +1,43 @@
+#ifndef INCLUDE_RAY_HPP_
+#define INCLUDE_RAY_HPP_
+#include "./aabb.hpp"
+#include <vector>
+
+// CPU reference versions of what the shaders do with the SSBOs, for checking
+// and measuring the acceleration structures without a GPU
+
+// Deep enough for the most unbalanced trees the builders produce
+const int TRAVERSAL_STACK_SIZE = 128;
+
+struct Ray {
+    PaddedVec3ForGLSL origin;
+    PaddedVec3ForGLSL direction;
+    PaddedVec3ForGLSL inv_direction;
+};
+
+// triangle is -1 when nothing was hit
+struct Hit {
+    int triangle;
+    float t;
+};
+
+Ray make_ray(const PaddedVec3ForGLSL &origin,
+             const PaddedVec3ForGLSL &direction);
+
+bool intersect_box(const Ray &ray, const PaddedVec3ForGLSL &min,
+                   const PaddedVec3ForGLSL &max, float t_max, float &t_near);
+
+bool intersect_triangle(const Ray &ray, const TriangleForGLSL &triangle,
+                        float &t);
+
+// Tests the triangles [start, end), going through triangle_indices when it
+// is not null, and updates hit if one of them is closer
+void intersect_leaf(const Ray &ray, const TriangleForGLSL *triangles,
+                    const int *triangle_indices, int start, int end, Hit &hit);
+
+// Closest hit through the Box array, the way the shaders walk binding 4
+Hit trace_boxes(const std::vector<Box> &boxes, int root_id,
+                const TriangleForGLSL *triangles, const int *triangle_indices,
+                const Ray &ray);
+
+#endif // INCLUDE_RAY_HPP_
@@ -0,0 +1,53 @@
+#ifndef INCLUDE_REFIT_HPP_
+#define INCLUDE_REFIT_HPP_
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./thread_pool.hpp"
+#include <vector>
+
+// Rebuild once the SAH cost grows past this multiple of the cost right
+// after the build
+const float REFIT_DEFAULT_REBUILD_THRESHOLD = 1.5f;
+
+// Everything needed to move glTF nodes after the BVH has been built without
+// loading and building again. Nodes are numbered in the order
+// flatten_model visits them, models one after another
+struct MovableScene {
+    std::vector<int> node_parents;
+    std::vector<Matrix4> node_matrices;
+    std::vector<bool> node_moved;
+
+    // Per triangle, in the order of the uploaded triangle array
+    std::vector<int> triangle_nodes;
+    std::vector<PaddedVec3ForGLSL> local_vertices;
+
+    // Box ids grouped by depth, so every level can be refit in parallel
+    std::vector<std::vector<int>> levels;
+    float built_cost;
+};
+
+// Call once per model, in the order their triangles were appended
+void add_movable_model(MovableScene &scene, const OurNode &model);
+
+// Maps the original triangle of every position of `after` back to its place
+// in `before`, for builders that reorder the triangle pointers
+std::vector<int>
+get_triangle_order(const std::vector<TriangleForGLSL *> &before,
+                   const std::vector<TriangleForGLSL *> &after);
+
+// Applies the order the builder put the triangles in (order[i] is the
+// original index of the triangle now at i) and remembers the tree shape
+void prepare_refit(MovableScene &scene, const std::vector<int> &order,
+                   const std::vector<Box> &boxes, int root_id);
+
+void set_node_matrix(MovableScene &scene, int node, const Matrix4 &matrix);
+
+// Re-transforms the triangles of the moved nodes and their descendants and
+// recomputes every box bottom-up, keeping the topology. Returns true when
+// the tree got worse than rebuild_threshold times its built cost and should
+// be rebuilt
+bool refit(ThreadPool &pool, MovableScene &scene,
+           TriangleForGLSL *triangles, const int *triangle_indices,
+           std::vector<Box> &boxes, float rebuild_threshold);
+
+#endif // INCLUDE_REFIT_HPP_
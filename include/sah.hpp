@@ -0,0 +1,58 @@
+#ifndef INCLUDE_SAH_HPP_
+#define INCLUDE_SAH_HPP_
+#include "./aabb.hpp"
+#include "./compact_bvh.hpp"
+#include <vector>
+
+// Number of centroid bins tried per axis when looking for the cheapest split
+const int SAH_BIN_COUNT = 16;
+
+struct Bin {
+    PaddedVec3ForGLSL min;
+    PaddedVec3ForGLSL max;
+    int count;
+};
+
+// Bins for all three axes, laid out over the centroid bounds of a node
+struct SahBins {
+    PaddedVec3ForGLSL centroid_min;
+    PaddedVec3ForGLSL centroid_max;
+    Bin bins[3][SAH_BIN_COUNT];
+};
+
+// coord is -1 when there is no plane that separates the triangles. cost is
+// the area of each side times its triangle count, summed
+struct SahSplit {
+    int coord;
+    int bin;
+    float centroid_min;
+    float scale;
+    float cost;
+};
+
+void get_centroid_bounds(const std::vector<TriangleForGLSL *> &triangles,
+                         int start, int end, PaddedVec3ForGLSL &min,
+                         PaddedVec3ForGLSL &max);
+
+void get_centroid_bounds(const std::vector<BuildRecord> &records, int start,
+                         int end, PaddedVec3ForGLSL &min,
+                         PaddedVec3ForGLSL &max);
+
+void clear_bins(SahBins &bins, const PaddedVec3ForGLSL &centroid_min,
+                const PaddedVec3ForGLSL &centroid_max);
+
+void fill_bins(SahBins &bins, const std::vector<BuildRecord> &records,
+               int start, int end);
+
+void merge_bins(SahBins &bins, const SahBins &other);
+
+SahSplit pick_sah_split(const SahBins &bins);
+
+bool goes_left(const SahSplit &split, const BuildRecord &record);
+
+// Sorts the records instead of the triangles they stand for. The boxes'
+// triangle ranges are positions in records
+Box records_to_box_sah(std::vector<Box> &boxes,
+                       std::vector<BuildRecord> &records, int start, int end);
+
+#endif // INCLUDE_SAH_HPP_
@@ -0,0 +1,27 @@
+#ifndef INCLUDE_SBVH_HPP_
+#define INCLUDE_SBVH_HPP_
+#include "./aabb.hpp"
+#include <vector>
+
+// Spatial splits are only tried when the children of the best object split
+// overlap by more than this fraction of the root's surface area
+const float SBVH_ALPHA = 1e-5f;
+
+// Default cap on extra triangle references, as a fraction of the triangle
+// count, selected with `sbvh_budget=<fraction>` on the command line
+const float SBVH_DEFAULT_BUDGET = 0.3f;
+
+// Largest budget accepted, every triangle may then be referenced five times
+const float SBVH_MAX_BUDGET = 4.0f;
+
+// Split BVH: like the SAH builder, but may also split space itself and clip
+// the triangles that straddle the plane into both children. A triangle can
+// then be referenced by several leaves, so Box::start/end index
+// triangle_indices, which in turn indexes the triangles.
+// At most budget * triangle count references are added by clipping, budget
+// is clamped to [0, SBVH_MAX_BUDGET]
+Box triangles_to_box_sbvh(std::vector<Box> &boxes,
+                          const std::vector<TriangleForGLSL *> &triangles,
+                          std::vector<int> &triangle_indices, float budget);
+
+#endif // INCLUDE_SBVH_HPP_
@@ -0,0 +1,102 @@
+#ifndef INCLUDE_THREAD_POOL_HPP_
+#define INCLUDE_THREAD_POOL_HPP_
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts the tasks of one fork/join step that have not finished yet, and
+// keeps the first exception one of them threw
+struct TaskGroup {
+    std::atomic<int> pending{0};
+    std::mutex mutex;
+    std::exception_ptr exception;
+};
+
+// Work-stealing pool: every worker pops its own newest task first and steals
+// the oldest task of another worker when it runs dry. Threads waiting on a
+// group run queued tasks meanwhile, so tasks may safely fork and wait.
+// A task that throws still counts as finished, wait() rethrows the first
+// exception of the group once all of its tasks are done
+class ThreadPool {
+  public:
+    explicit ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    void submit(TaskGroup &group, std::function<void()> task);
+    void wait(TaskGroup &group);
+    size_t size() const { return workers.size(); }
+
+  private:
+    struct Task {
+        TaskGroup *group;
+        std::function<void()> function;
+    };
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool run_one(size_t self);
+    void worker_loop(size_t self);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> queued{0};
+    std::atomic<size_t> next_worker{0};
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+// Waits for group when it goes out of scope, so tasks that use the
+// submitting frame are done before an exception unwinds it. Exceptions of
+// the tasks are dropped there, pool.wait(group) still has to be called to
+// get them
+class TaskGroupGuard {
+  public:
+    TaskGroupGuard(ThreadPool &pool, TaskGroup &group)
+        : pool(pool), group(group) {}
+    ~TaskGroupGuard() {
+        try {
+            pool.wait(group);
+        } catch (...) {
+        }
+    }
+    TaskGroupGuard(const TaskGroupGuard &) = delete;
+    TaskGroupGuard &operator=(const TaskGroupGuard &) = delete;
+
+  private:
+    ThreadPool &pool;
+    TaskGroup &group;
+};
+
+// Must be called before the first get_thread_pool() to have any effect;
+// 0 means one worker per hardware thread
+void set_thread_count(size_t thread_count);
+
+ThreadPool &get_thread_pool();
+
+// Calls function(chunk_start, chunk_end) for every `grain`-sized chunk of
+// [start, end) on the pool and returns once all chunks are done
+template <typename Function>
+void parallel_for(ThreadPool &pool, int start, int end, int grain,
+                  const Function &function) {
+    TaskGroup group;
+    TaskGroupGuard guard(pool, group);
+    for (int chunk = start; chunk < end; chunk += grain) {
+        int chunk_end = std::min(end, chunk + grain);
+        pool.submit(group,
+                    [&function, chunk, chunk_end] { function(chunk, chunk_end); });
+    }
+    pool.wait(group);
+}
+
+#endif // INCLUDE_THREAD_POOL_HPP_
@@ -0,0 +1,40 @@
+#ifndef INCLUDE_THREADED_BVH_HPP_
+#define INCLUDE_THREADED_BVH_HPP_
+#include "./aabb.hpp"
+#include "./ray.hpp"
+#include <vector>
+
+// Binary node of a threaded BVH, traversed without a stack: when a ray
+// hits the node's box it continues at hit, otherwise at miss, until a link
+// is -1. For an inner node hit is its first child, for a leaf it is the
+// same as miss. A leaf covers triangles [start, start + count), inner nodes
+// have count == 0. Empty leaves get empty bounds, so they are never entered.
+//
+// Matches this std430 layout at binding 9 when uploaded with --threaded:
+//   struct ThreadedNode {
+//       vec3 min; int hit; vec3 max; int miss; int start; int count;
+//   };
+// The root is always node 0
+struct ThreadedNode {
+    float min[3];
+    int hit;
+    float max[3];
+    int miss;
+    int start;
+    int count;
+    int padding[2];
+};
+
+static_assert(sizeof(ThreadedNode) == 48, "ThreadedNode must match std430");
+
+// Lays the tree out in pre-order with the child with the larger box first,
+// like to_depth_first. Without a stack the children can't be visited
+// nearest first, so that order is fixed for every ray
+std::vector<ThreadedNode> to_threaded(const std::vector<Box> &boxes,
+                                      int root_id);
+
+Hit trace_threaded(const std::vector<ThreadedNode> &nodes,
+                   const TriangleForGLSL *triangles,
+                   const int *triangle_indices, const Ray &ray);
+
+#endif // INCLUDE_THREADED_BVH_HPP_
@@ -0,0 +1,30 @@
+#ifndef INCLUDE_TREELET_HPP_
+#define INCLUDE_TREELET_HPP_
+#include "./aabb.hpp"
+#include "./thread_pool.hpp"
+#include <vector>
+
+// Leaves of the small subtrees that get rearranged for the lowest SAH cost.
+// The search tries every split of them, so it grows as 3^TREELET_LEAVES
+const int TREELET_LEAVES = 7;
+
+// Bottom-up passes over the whole tree, later ones find less and less
+const int TREELET_PASSES = 3;
+
+struct TreeletReport {
+    float cost_before;
+    float cost_after;
+    int passes;
+    // False when the time budget ran out before the last pass was done
+    bool finished;
+};
+
+// Rearranges every node's treelet for the lowest SAH cost, deepest nodes
+// first, keeping the leaves as they are. Afterwards boxes is written back
+// in the builders' order, children before parents and the root last, and
+// root_id is updated. Stops once budget_ms is used up, the tree is valid
+// either way
+TreeletReport optimize_treelets(ThreadPool &pool, std::vector<Box> &boxes,
+                                int &root_id, double budget_ms);
+
+#endif // INCLUDE_TREELET_HPP_
@@ -0,0 +1,56 @@
+#ifndef INCLUDE_TRIANGLE_PAIRS_HPP_
+#define INCLUDE_TRIANGLE_PAIRS_HPP_
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./ray.hpp"
+#include <vector>
+
+// Two triangles with the same material that share the edge (a, b), stored
+// as one leaf primitive: the first triangle is (a, b, c) and the second is
+// (a, b, d). first and second are their ids in the triangle array, for
+// shading the closest hit; a triangle without a partner has second == -1.
+//
+// Matches this std430 layout at binding 11 when uploaded with leaves=pairs:
+//   struct TrianglePair {
+//       vec3 a; int first; vec3 b; int second; vec3 c; int padding0;
+//       vec3 d; int padding1;
+//   };
+struct TrianglePair {
+    float a[3];
+    int first;
+    float b[3];
+    int second;
+    float c[3];
+    int padding0;
+    float d[3];
+    int padding1;
+};
+
+static_assert(sizeof(TrianglePair) == 64, "TrianglePair must match std430");
+
+// Leaf primitives, selected with `leaves=<triangles|pairs>`
+enum {
+    LEAVES_TRIANGLES = 0,
+    LEAVES_PAIRS = 1,
+};
+
+// Greedily pairs every triangle with the first unpaired neighbour that
+// shares an edge with exactly the same vertex positions and material
+std::vector<TrianglePair>
+pair_triangles(const std::vector<TriangleForGLSL *> &triangles);
+
+// Builds the tree over the pairs' bounds with strategy and puts pairs in
+// the order the leaves reference them
+AABB *triangle_pairs_to_aabb(std::vector<Box> &boxes,
+                             std::vector<TrianglePair> &pairs, int strategy);
+
+// Tests both triangles, sharing the work on the common edge. triangle is
+// the id of the one that was hit
+bool intersect_triangle_pair(const Ray &ray, const TrianglePair &pair,
+                             float &t, int &triangle);
+
+Hit trace_triangle_pairs(const std::vector<Box> &boxes, int root_id,
+                         const std::vector<TrianglePair> &pairs,
+                         const Ray &ray);
+
+#endif // INCLUDE_TRIANGLE_PAIRS_HPP_
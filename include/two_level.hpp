@@ -0,0 +1,45 @@
+#ifndef INCLUDE_TWO_LEVEL_HPP_
+#define INCLUDE_TWO_LEVEL_HPP_
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./ray.hpp"
+#include <vector>
+
+// One glTF node that draws a mesh. Only the first three rows of the affine
+// transforms are stored, the fourth is always 0 0 0 1. Uploaded to
+// binding 7
+struct InstanceForGLSL {
+    Vec4ForGLSL object_to_world[3];
+    Vec4ForGLSL world_to_object[3];
+    int blas_root_id;
+    int padding[3];
+};
+
+// Every glTF mesh is built once in its own space (a BLAS) no matter how many
+// nodes draw it, and a second tree over the instances (the TLAS) places the
+// copies in the world.
+//
+// triangles go to binding 3 and blas_boxes to binding 4, one BLAS after
+// another with their ids and triangle ranges already offset. The TLAS goes
+// to binding 8, the start and end of its leaves index instances
+struct TwoLevelScene {
+    std::vector<TriangleForGLSL> triangles;
+    std::vector<Box> blas_boxes;
+    std::vector<InstanceForGLSL> instances;
+    std::vector<Box> tlas_boxes;
+    int tlas_root_id;
+};
+
+// Call once per model, then build_tlas once all of them are in. Load the
+// models with share_meshes so every mesh is decoded only once
+void add_two_level_model(TwoLevelScene &scene, const OurNode &model,
+                         int strategy);
+
+void build_tlas(TwoLevelScene &scene, int strategy);
+
+// Closest hit through both levels; instance is set to the instance that
+// was hit, hit.triangle indexes scene.triangles
+Hit trace_two_level(const TwoLevelScene &scene, const Ray &ray,
+                    int &instance);
+
+#endif // INCLUDE_TWO_LEVEL_HPP_
@@ -0,0 +1,54 @@
+#ifndef INCLUDE_WIDE_BVH_HPP_
+#define INCLUDE_WIDE_BVH_HPP_
+#include "./aabb.hpp"
+#include "./ray.hpp"
+#include <vector>
+
+// Node of a BVH with up to Width children, whose bounds are stored as
+// structure of arrays so that all of them are tested in one visit.
+// A slot with count > 0 is a leaf covering triangles [child, child + count),
+// a slot with count == 0 and child >= 0 is an inner node, and child == -1
+// marks an unused slot (its bounds are empty, so it never gets hit).
+//
+// Matches this std430 layout at binding 4 when uploaded with nodes=bvh4:
+//   struct Bvh4Node {
+//       vec4 min_x; vec4 min_y; vec4 min_z;
+//       vec4 max_x; vec4 max_y; vec4 max_z;
+//       ivec4 child; ivec4 count;
+//   };
+// and with nodes=bvh8 every member is a float[8] or int[8] array instead.
+// The root is always node 0
+template <int Width> struct WideNode {
+    float min_x[Width];
+    float min_y[Width];
+    float min_z[Width];
+    float max_x[Width];
+    float max_y[Width];
+    float max_z[Width];
+    int child[Width];
+    int count[Width];
+};
+
+using Bvh4Node = WideNode<4>;
+using Bvh8Node = WideNode<8>;
+
+static_assert(sizeof(Bvh4Node) == 128, "Bvh4Node must match std430");
+static_assert(sizeof(Bvh8Node) == 256, "Bvh8Node must match std430");
+
+// Pulls the children of the largest inner children up into their parent
+// until every node has Width children or only leaves below it
+std::vector<Bvh4Node> collapse_to_bvh4(const std::vector<Box> &boxes,
+                                       int root_id);
+
+std::vector<Bvh8Node> collapse_to_bvh8(const std::vector<Box> &boxes,
+                                       int root_id);
+
+Hit trace_bvh4(const std::vector<Bvh4Node> &nodes,
+               const TriangleForGLSL *triangles, const int *triangle_indices,
+               const Ray &ray);
+
+Hit trace_bvh8(const std::vector<Bvh8Node> &nodes,
+               const TriangleForGLSL *triangles, const int *triangle_indices,
+               const Ray &ray);
+
+#endif // INCLUDE_WIDE_BVH_HPP_
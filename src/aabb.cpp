@@ -1,5 +1,12 @@
 #include "./aabb.hpp"
+#include "./compact_bvh.hpp"
+#include "./cost_model.hpp"
+#include "./lbvh.hpp"
 #include "./load_model.hpp"
+#include "./parallel_bvh.hpp"
+#include "./sah.hpp"
+#include "./sbvh.hpp"
+#include "./thread_pool.hpp"
 #include <algorithm>
 #include <iostream>
 #include <limits>
@@ -31,6 +38,39 @@ PaddedVec3ForGLSL get_max(const std::vector<TriangleForGLSL *> &triangles, int s
     return max;
 }
 
+PaddedVec3ForGLSL empty_min() {
+    return PaddedVec3ForGLSL{std::numeric_limits<float>::max(),
+                             std::numeric_limits<float>::max(),
+                             std::numeric_limits<float>::max(), 0};
+}
+
+PaddedVec3ForGLSL empty_max() {
+    return PaddedVec3ForGLSL{-std::numeric_limits<float>::max(),
+                             -std::numeric_limits<float>::max(),
+                             -std::numeric_limits<float>::max(), 0};
+}
+
+void grow(PaddedVec3ForGLSL &min, PaddedVec3ForGLSL &max,
+          const PaddedVec3ForGLSL &other_min,
+          const PaddedVec3ForGLSL &other_max) {
+    min = PaddedVec3ForGLSL{std::min(min.x, other_min.x),
+                            std::min(min.y, other_min.y),
+                            std::min(min.z, other_min.z), 0};
+    max = PaddedVec3ForGLSL{std::max(max.x, other_max.x),
+                            std::max(max.y, other_max.y),
+                            std::max(max.z, other_max.z), 0};
+}
+
+float surface_area(const PaddedVec3ForGLSL &min, const PaddedVec3ForGLSL &max) {
+    float dx = max.x - min.x;
+    float dy = max.y - min.y;
+    float dz = max.z - min.z;
+    if (dx < 0 || dy < 0 || dz < 0) {
+        return 0;
+    }
+    return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
 int get_next_coord(int coord) { return (coord + 1) % 3; }
 
 float get_coord(int coord, const PaddedVec3ForGLSL &v) {
@@ -43,55 +83,57 @@ float get_coord(int coord, const PaddedVec3ForGLSL &v) {
     }
 }
 
-Box triangles_to_box(std::vector<Box> &boxes,
-                     std::vector<TriangleForGLSL *> &triangles, int start,
-                     int end, int coord) {
-    int span = end - start;
-
-    if (span <= 8) {
-        return Box(get_min(triangles, start, end),
-                   get_max(triangles, start, end), -1, -1, start, end);
-    }
-
-    int mid = start + span / 2;
-    std::nth_element(
-        triangles.begin() + start, triangles.begin() + mid,
-        triangles.begin() + end,
-        [coord](const TriangleForGLSL *a, const TriangleForGLSL *b) {
-            return get_coord(coord, a->min) < get_coord(coord, b->min);
-        });
-
-    boxes.emplace_back(
-        triangles_to_box(boxes, triangles, start, mid, get_next_coord(coord)));
-    int left = boxes.size() - 1;
-    boxes.emplace_back(
-        triangles_to_box(boxes, triangles, mid, end, get_next_coord(coord)));
-    int right = boxes.size() - 1;
-
-    return Box(PaddedVec3ForGLSL{std::min(boxes[left].min.x, boxes[right].min.x),
-                           std::min(boxes[left].min.y, boxes[right].min.y),
-                           std::min(boxes[left].min.z, boxes[right].min.z), 0},
-               PaddedVec3ForGLSL{std::max(boxes[left].max.x, boxes[right].max.x),
-                           std::max(boxes[left].max.y, boxes[right].max.y),
-                           std::max(boxes[left].max.z, boxes[right].max.z), 0},
-               left, right, start, end);
+float get_centroid(int coord, const TriangleForGLSL *triangle) {
+    return 0.5f * (get_coord(coord, triangle->min) +
+                   get_coord(coord, triangle->max));
 }
 
 AABB *triangles_to_aabb(std::vector<Box> &boxes,
                         std::vector<TriangleForGLSL *> &triangles, int start,
-                        int end, int coord) {
+                        int end, int coord, int strategy) {
     int span = end - start;
 
-    if (span <= 8) {
+    if (span <= 1) {
         PaddedVec3ForGLSL min = get_min(triangles, start, end);
         PaddedVec3ForGLSL max = get_max(triangles, start, end);
         boxes.emplace_back(Box(min, max, -1, -1, start, end));
         return new AABB{static_cast<int>(boxes.size() - 1)};
     }
-    boxes.emplace_back(triangles_to_box(boxes, triangles, start, end, coord));
+    if (strategy == BVH_SAH) {
+        boxes.emplace_back(triangles_to_box_parallel(
+            get_thread_pool(), boxes, triangles, start, end));
+    } else if (strategy == BVH_LBVH) {
+        boxes.emplace_back(triangles_to_box_lbvh(get_thread_pool(), boxes,
+                                                 triangles, start, end));
+    } else {
+        boxes.emplace_back(
+            triangles_to_box_compact(boxes, triangles, start, end, coord));
+    }
     return new AABB{static_cast<int>(boxes.size() - 1)};
 }
 
+AABB *triangles_to_indexed_aabb(std::vector<Box> &boxes,
+                                const std::vector<TriangleForGLSL *> &triangles,
+                                std::vector<int> &triangle_indices,
+                                float budget) {
+    boxes.emplace_back(
+        triangles_to_box_sbvh(boxes, triangles, triangle_indices, budget));
+    return new AABB{static_cast<int>(boxes.size() - 1)};
+}
+
+float get_sah_cost(const std::vector<Box> &boxes, int root_id) {
+    float root_area = surface_area(boxes[root_id].min, boxes[root_id].max);
+    if (root_area <= 0) {
+        return 0;
+    }
+    double cost = 0;
+    for (const Box &box : boxes) {
+        double area = surface_area(box.min, box.max);
+        cost += box.left_id == -1 ? area * (box.end - box.start) : area;
+    }
+    return static_cast<float>(cost / root_area);
+}
+
 void print_box(std::vector<Box> boxes, int box_id, size_t depth,
                std::vector<TriangleForGLSL *> &triangles) {
     for (size_t i = 0; i < depth; ++i) {
@@ -115,11 +157,6 @@ void print_box(std::vector<Box> boxes, int box_id, size_t depth,
             std::cout << "  ";
         }
         std::cout << "  ";
-        print_triangle(Triangle{
-            Vec3{triangles[i]->v1.x, triangles[i]->v1.y, triangles[i]->v1.z},
-            Vec3{triangles[i]->v2.x, triangles[i]->v2.y, triangles[i]->v2.z},
-            Vec3{triangles[i]->v3.x, triangles[i]->v3.y, triangles[i]->v3.z},
-            Vec2{0.0f, 0.0f}, Vec2{0.0f, 0.0f}, Vec2{0.0f, 0.0f},
-            std::numeric_limits<uint32_t>::max()});
+        print_triangle(*triangles[i]);
     }
 }
@@ -0,0 +1,280 @@
+#include "./bvh_cache.hpp"
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./mapped_file.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+const char BVH_CACHE_MAGIC[8] = {'M', 'Y', 'O', 'W', 'N', 'B', 'V', 'H'};
+
+const size_t BVH_CACHE_ALIGNMENT = 16;
+
+size_t align_up(size_t offset) {
+    return (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT *
+           BVH_CACHE_ALIGNMENT;
+}
+
+uint64_t mix(uint64_t hash, uint64_t word) {
+    hash ^= word;
+    hash *= 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 32);
+}
+
+// Eight bytes at a time, the inputs can be gigabytes
+uint64_t hash_bytes(uint64_t hash, const unsigned char *data, size_t size) {
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = mix(hash, word);
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    return mix(mix(hash, tail), size);
+}
+
+uint64_t hash_file(uint64_t hash, const std::string &path) {
+    MappedFile file(path);
+    return hash_bytes(hash, file.data(), file.size());
+}
+
+// The external buffers and images of a .gltf, found without parsing the
+// whole JSON. Embedded data: URIs are already part of the file's hash
+std::vector<std::string> get_external_uris(const MappedFile &file) {
+    std::vector<std::string> uris;
+    std::string text(reinterpret_cast<const char *>(file.data()),
+                     file.size());
+    size_t at = 0;
+    while ((at = text.find("\"uri\"", at)) != std::string::npos) {
+        size_t open = text.find('"', at + 5);
+        size_t close =
+            open == std::string::npos ? open : text.find('"', open + 1);
+        if (close == std::string::npos) {
+            break;
+        }
+        std::string uri = text.substr(open + 1, close - open - 1);
+        if (uri.rfind("data:", 0) != 0) {
+            uris.push_back(uri);
+        }
+        at = close + 1;
+    }
+    return uris;
+}
+
+uint64_t hash_scene(const std::vector<std::string> &model_paths,
+                    const std::string &settings) {
+    uint64_t hash = hash_bytes(
+        BVH_CACHE_VERSION,
+        reinterpret_cast<const unsigned char *>(settings.data()),
+        settings.size());
+    for (const auto &path : model_paths) {
+        MappedFile file(path);
+        hash = hash_bytes(hash, file.data(), file.size());
+        if (path.size() < 5 || path.substr(path.size() - 5) != ".gltf") {
+            continue;
+        }
+        std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+        for (const auto &uri : get_external_uris(file)) {
+            if (file_exists(directory + uri)) {
+                hash = hash_file(hash, directory + uri);
+            }
+        }
+    }
+    return hash;
+}
+
+std::unique_ptr<BvhCache> open_bvh_cache(const std::string &path,
+                                         uint64_t key) {
+    if (!file_exists(path)) {
+        return nullptr;
+    }
+    std::unique_ptr<BvhCache> cache;
+    try {
+        cache = std::unique_ptr<BvhCache>(new BvhCache(path));
+    } catch (const std::runtime_error &) {
+        return nullptr;
+    }
+    const unsigned char *data = cache->file.data();
+    size_t size = cache->file.size();
+    if (size < sizeof(BvhCacheHeader)) {
+        return nullptr;
+    }
+    BvhCacheHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, BVH_CACHE_MAGIC, 8) != 0 ||
+        header.version != BVH_CACHE_VERSION || header.key != key) {
+        return nullptr;
+    }
+
+    size_t offset = align_up(sizeof(header));
+    size_t triangles_offset = offset;
+    offset = align_up(offset + header.triangle_count * sizeof(TriangleForGLSL));
+    size_t boxes_offset = offset;
+    offset = align_up(offset + header.box_count * sizeof(Box));
+    size_t indices_offset = offset;
+    offset = align_up(offset + header.index_count * sizeof(int));
+    if (offset > size) {
+        return nullptr;
+    }
+    cache->root_id = header.root_id;
+    cache->triangle_count = header.triangle_count;
+    cache->triangles =
+        reinterpret_cast<const TriangleForGLSL *>(data + triangles_offset);
+    cache->box_count = header.box_count;
+    cache->boxes = reinterpret_cast<const Box *>(data + boxes_offset);
+    cache->index_count = header.index_count;
+    cache->triangle_indices =
+        reinterpret_cast<const int *>(data + indices_offset);
+
+    for (uint64_t i = 0; i < header.texture_count; i++) {
+        if (offset + sizeof(CachedTextureHeader) > size) {
+            return nullptr;
+        }
+        CachedTextureHeader texture_header;
+        std::memcpy(&texture_header, data + offset, sizeof(texture_header));
+        offset += sizeof(texture_header);
+        if (offset + texture_header.byte_count > size) {
+            return nullptr;
+        }
+        tinygltf::Image texture;
+        texture.width = texture_header.width;
+        texture.height = texture_header.height;
+        texture.component = texture_header.component;
+        texture.bits = texture_header.bits;
+        texture.pixel_type = texture_header.pixel_type;
+        texture.image.assign(data + offset,
+                             data + offset + texture_header.byte_count);
+        cache->textures.push_back(texture);
+        offset = align_up(offset + texture_header.byte_count);
+    }
+    return cache;
+}
+
+void write_padding(std::ofstream &file) {
+    const char zeros[BVH_CACHE_ALIGNMENT] = {};
+    size_t position = file.tellp();
+    file.write(zeros, align_up(position) - position);
+}
+
+BvhCacheHeader make_header(uint64_t key, int root_id, size_t triangle_count,
+                           size_t box_count, size_t index_count,
+                           size_t texture_count) {
+    BvhCacheHeader header = BvhCacheHeader{};
+    std::memcpy(header.magic, BVH_CACHE_MAGIC, 8);
+    header.version = BVH_CACHE_VERSION;
+    header.root_id = root_id;
+    header.key = key;
+    header.triangle_count = triangle_count;
+    header.box_count = box_count;
+    header.index_count = index_count;
+    header.texture_count = texture_count;
+    return header;
+}
+
+void write_textures(std::ofstream &file,
+                    const std::vector<tinygltf::Image> &textures) {
+    for (const auto &texture : textures) {
+        CachedTextureHeader texture_header = CachedTextureHeader{
+            texture.width, texture.height, texture.component, texture.bits,
+            texture.pixel_type, 0, texture.image.size()};
+        file.write(reinterpret_cast<const char *>(&texture_header),
+                   sizeof(texture_header));
+        file.write(reinterpret_cast<const char *>(texture.image.data()),
+                   texture.image.size());
+        write_padding(file);
+    }
+}
+
+void finish_bvh_cache(std::ofstream &file, const std::string &temporary_path,
+                      const std::string &path) {
+    file.close();
+    if (!file || std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+        std::remove(temporary_path.c_str());
+        throw std::runtime_error("Can't write " + path);
+    }
+}
+
+void write_bvh_cache(const std::string &path, uint64_t key,
+                     const std::vector<TriangleForGLSL *> &triangles,
+                     const std::vector<Box> &boxes, int root_id,
+                     const std::vector<int> &triangle_indices,
+                     const std::vector<tinygltf::Image> &textures) {
+    std::string temporary_path = path + ".tmp";
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error("Can't write " + temporary_path);
+    }
+    BvhCacheHeader header =
+        make_header(key, root_id, triangles.size(), boxes.size(),
+                    triangle_indices.size(), textures.size());
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    write_padding(file);
+    for (const auto triangle : triangles) {
+        file.write(reinterpret_cast<const char *>(triangle),
+                   sizeof(TriangleForGLSL));
+    }
+    write_padding(file);
+    file.write(reinterpret_cast<const char *>(boxes.data()),
+               boxes.size() * sizeof(Box));
+    write_padding(file);
+    file.write(reinterpret_cast<const char *>(triangle_indices.data()),
+               triangle_indices.size() * sizeof(int));
+    write_padding(file);
+    write_textures(file, textures);
+    finish_bvh_cache(file, temporary_path, path);
+}
+
+// Copies exactly byte_count bytes, a buffer at a time
+void copy_from_file(std::ofstream &file, const std::string &source_path,
+                    size_t byte_count) {
+    std::ifstream source(source_path, std::ios::binary);
+    std::vector<char> buffer(1 << 20);
+    while (byte_count > 0 && source) {
+        size_t size = std::min(byte_count, buffer.size());
+        source.read(buffer.data(), size);
+        file.write(buffer.data(), source.gcount());
+        byte_count -= source.gcount();
+    }
+    if (byte_count > 0) {
+        throw std::runtime_error("Can't read " + source_path);
+    }
+}
+
+void write_bvh_cache_from_files(const std::string &path, uint64_t key,
+                                const std::string &triangles_path,
+                                size_t triangle_count,
+                                const std::string &boxes_path,
+                                size_t box_count, int root_id,
+                                const std::vector<tinygltf::Image> &textures) {
+    std::string temporary_path = path + ".tmp";
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error("Can't write " + temporary_path);
+    }
+    BvhCacheHeader header = make_header(key, root_id, triangle_count,
+                                        box_count, 0, textures.size());
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    write_padding(file);
+    try {
+        copy_from_file(file, triangles_path,
+                       triangle_count * sizeof(TriangleForGLSL));
+        write_padding(file);
+        copy_from_file(file, boxes_path, box_count * sizeof(Box));
+    } catch (const std::runtime_error &) {
+        file.close();
+        std::remove(temporary_path.c_str());
+        throw;
+    }
+    write_padding(file);
+    // No triangle indices
+    write_padding(file);
+    write_textures(file, textures);
+    finish_bvh_cache(file, temporary_path, path);
+}
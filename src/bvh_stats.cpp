@@ -0,0 +1,108 @@
+#include "./bvh_stats.hpp"
+#include "./aabb.hpp"
+#include <algorithm>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+double volume(const PaddedVec3ForGLSL &min, const PaddedVec3ForGLSL &max) {
+    double dx = max.x - min.x;
+    double dy = max.y - min.y;
+    double dz = max.z - min.z;
+    if (dx < 0 || dy < 0 || dz < 0) {
+        return 0;
+    }
+    return dx * dy * dz;
+}
+
+PaddedVec3ForGLSL intersection_min(const Box &a, const Box &b) {
+    return PaddedVec3ForGLSL{std::max(a.min.x, b.min.x),
+                             std::max(a.min.y, b.min.y),
+                             std::max(a.min.z, b.min.z), 0};
+}
+
+PaddedVec3ForGLSL intersection_max(const Box &a, const Box &b) {
+    return PaddedVec3ForGLSL{std::min(a.max.x, b.max.x),
+                             std::min(a.max.y, b.max.y),
+                             std::min(a.max.z, b.max.z), 0};
+}
+
+BvhStats get_bvh_stats(const std::vector<Box> &boxes, int root_id,
+                       int triangle_count, int index_count) {
+    BvhStats stats = BvhStats{};
+    stats.sah_cost = get_sah_cost(boxes, root_id);
+
+    double parent_area = 0;
+    double shared_area = 0;
+    double parent_volume = 0;
+    double empty_volume = 0;
+    double leaf_depth_sum = 0;
+    std::vector<std::pair<int, int>> stack = {{root_id, 0}};
+    while (!stack.empty()) {
+        int id = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+        const Box &box = boxes[id];
+        stats.node_count++;
+        stats.max_depth = std::max(stats.max_depth, depth);
+        if (box.left_id == -1) {
+            int count = box.end - box.start;
+            stats.leaf_count++;
+            stats.leaf_references += count;
+            leaf_depth_sum += depth;
+            if (static_cast<int>(stats.leaf_histogram.size()) <= count) {
+                stats.leaf_histogram.resize(count + 1, 0);
+            }
+            stats.leaf_histogram[count]++;
+            continue;
+        }
+        stats.inner_count++;
+        const Box &left = boxes[box.left_id];
+        const Box &right = boxes[box.right_id];
+        PaddedVec3ForGLSL shared_min = intersection_min(left, right);
+        PaddedVec3ForGLSL shared_max = intersection_max(left, right);
+        parent_area += surface_area(box.min, box.max);
+        shared_area += surface_area(shared_min, shared_max);
+        double box_volume = volume(box.min, box.max);
+        double covered = volume(left.min, left.max) +
+                         volume(right.min, right.max) -
+                         volume(shared_min, shared_max);
+        parent_volume += box_volume;
+        empty_volume += std::max(0.0, box_volume - covered);
+        stack.emplace_back(box.left_id, depth + 1);
+        stack.emplace_back(box.right_id, depth + 1);
+    }
+
+    stats.average_leaf_depth =
+        stats.leaf_count > 0 ? leaf_depth_sum / stats.leaf_count : 0;
+    stats.sibling_overlap = parent_area > 0 ? shared_area / parent_area : 0;
+    stats.empty_space = parent_volume > 0 ? empty_volume / parent_volume : 0;
+    stats.node_bytes = stats.node_count * sizeof(Box);
+    stats.triangle_bytes = triangle_count * sizeof(TriangleForGLSL);
+    stats.index_bytes = index_count * sizeof(int);
+    return stats;
+}
+
+void write_bvh_stats_json(std::ostream &out, const BvhStats &stats) {
+    out << "{\n";
+    out << "  \"sah_cost\": " << stats.sah_cost << ",\n";
+    out << "  \"nodes\": " << stats.node_count << ",\n";
+    out << "  \"inner_nodes\": " << stats.inner_count << ",\n";
+    out << "  \"leaves\": " << stats.leaf_count << ",\n";
+    out << "  \"leaf_references\": " << stats.leaf_references << ",\n";
+    out << "  \"max_depth\": " << stats.max_depth << ",\n";
+    out << "  \"average_leaf_depth\": " << stats.average_leaf_depth << ",\n";
+    out << "  \"leaf_histogram\": [";
+    for (size_t i = 0; i < stats.leaf_histogram.size(); i++) {
+        out << (i > 0 ? ", " : "") << stats.leaf_histogram[i];
+    }
+    out << "],\n";
+    out << "  \"sibling_overlap\": " << stats.sibling_overlap << ",\n";
+    out << "  \"empty_space\": " << stats.empty_space << ",\n";
+    out << "  \"memory\": {\n";
+    out << "    \"node_bytes\": " << stats.node_bytes << ",\n";
+    out << "    \"triangle_bytes\": " << stats.triangle_bytes << ",\n";
+    out << "    \"index_bytes\": " << stats.index_bytes << "\n";
+    out << "  }\n";
+    out << "}" << std::endl;
+}
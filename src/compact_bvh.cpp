@@ -0,0 +1,174 @@
+#include "./compact_bvh.hpp"
+#include "./aabb.hpp"
+#include "./cost_model.hpp"
+#include "./parallel_bvh.hpp"
+#include "./thread_pool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Every level halves the node, so this covers any int triangle count
+const int COMPACT_STACK_SIZE = 64;
+
+enum {
+    FRAME_SPLIT = 0,
+    FRAME_RIGHT = 1,
+    FRAME_JOIN = 2,
+};
+
+struct BuildFrame {
+    int start;
+    int end;
+    int coord;
+    int mid;
+    int left;
+    int stage;
+};
+
+std::vector<BuildRecord>
+get_build_records(ThreadPool &pool,
+                  const std::vector<TriangleForGLSL *> &triangles, int start,
+                  int end) {
+    std::vector<BuildRecord> records(end - start);
+    parallel_for(pool, start, end, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     for (int i = chunk_start; i < chunk_end; i++) {
+                         const TriangleForGLSL *triangle = triangles[i];
+                         records[i - start] = BuildRecord{
+                             {triangle->min.x, triangle->min.y,
+                              triangle->min.z},
+                             static_cast<uint32_t>(i),
+                             {triangle->max.x, triangle->max.y,
+                              triangle->max.z},
+                             0};
+                     }
+                 });
+    return records;
+}
+
+void apply_build_records(ThreadPool &pool,
+                         std::vector<TriangleForGLSL *> &triangles, int start,
+                         const std::vector<BuildRecord> &records) {
+    int end = start + records.size();
+    std::vector<TriangleForGLSL *> ordered(records.size());
+    parallel_for(pool, start, end, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     for (int i = chunk_start; i < chunk_end; i++) {
+                         ordered[i - start] =
+                             triangles[records[i - start].index];
+                     }
+                 });
+    std::copy(ordered.begin(), ordered.end(), triangles.begin() + start);
+}
+
+void get_record_bounds(const std::vector<BuildRecord> &records, int start,
+                       int end, PaddedVec3ForGLSL &min,
+                       PaddedVec3ForGLSL &max) {
+    min = empty_min();
+    max = empty_max();
+    for (int i = start; i < end; i++) {
+        grow(min, max,
+             PaddedVec3ForGLSL{records[i].min[0], records[i].min[1],
+                               records[i].min[2], 0},
+             PaddedVec3ForGLSL{records[i].max[0], records[i].max[1],
+                               records[i].max[2], 0});
+    }
+}
+
+// Same decision as should_make_leaf for triangle pointers, on the records
+bool should_make_record_leaf(const std::vector<BuildRecord> &records,
+                             int start, int mid, int end) {
+    int count = end - start;
+    if (count <= 1 || count > get_cost_model().max_leaf_size) {
+        return count <= 1;
+    }
+    PaddedVec3ForGLSL left_min;
+    PaddedVec3ForGLSL left_max;
+    PaddedVec3ForGLSL right_min;
+    PaddedVec3ForGLSL right_max;
+    get_record_bounds(records, start, mid, left_min, left_max);
+    get_record_bounds(records, mid, end, right_min, right_max);
+    float split_cost = surface_area(left_min, left_max) * (mid - start) +
+                       surface_area(right_min, right_max) * (end - mid);
+    grow(left_min, left_max, right_min, right_max);
+    return should_make_leaf(count, left_min, left_max, split_cost);
+}
+
+Box records_to_leaf(const std::vector<BuildRecord> &records, int start,
+                    int end, int offset) {
+    PaddedVec3ForGLSL min;
+    PaddedVec3ForGLSL max;
+    get_record_bounds(records, start, end, min, max);
+    return Box(min, max, -1, -1, offset + start, offset + end);
+}
+
+Box triangles_to_box_compact(std::vector<Box> &boxes,
+                             std::vector<TriangleForGLSL *> &triangles,
+                             int start, int end, int coord) {
+    int count = end - start;
+    std::vector<BuildRecord> records =
+        get_build_records(get_thread_pool(), triangles, start, end);
+    // Only a first guess, leaves usually hold a few triangles
+    boxes.reserve(boxes.size() + count / 2 + 1);
+
+    // Boxes come out in the same order as from the recursive builders: the
+    // left subtree, the right subtree, then the node itself. The root is
+    // returned instead of being added, like they do
+    BuildFrame stack[COMPACT_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = BuildFrame{0, count, coord, 0, -1, FRAME_SPLIT};
+    int last = -1;
+    Box root = Box(empty_min(), empty_max(), -1, -1, start, end);
+    while (stack_size > 0) {
+        BuildFrame &frame = stack[stack_size - 1];
+        Box box = Box(empty_min(), empty_max(), -1, -1, 0, 0);
+        if (frame.stage == FRAME_SPLIT) {
+            int span = frame.end - frame.start;
+            frame.mid = frame.start + span / 2;
+            int axis = frame.coord;
+            if (span > 1) {
+                std::nth_element(
+                    records.begin() + frame.start, records.begin() + frame.mid,
+                    records.begin() + frame.end,
+                    [axis](const BuildRecord &a, const BuildRecord &b) {
+                        return a.min[axis] < b.min[axis];
+                    });
+            }
+            if (!should_make_record_leaf(records, frame.start, frame.mid,
+                                         frame.end)) {
+                frame.stage = FRAME_RIGHT;
+                stack[stack_size++] =
+                    BuildFrame{frame.start, frame.mid,
+                               get_next_coord(frame.coord), 0, -1, FRAME_SPLIT};
+                continue;
+            }
+            box = records_to_leaf(records, frame.start, frame.end, start);
+        } else if (frame.stage == FRAME_RIGHT) {
+            frame.left = last;
+            frame.stage = FRAME_JOIN;
+            stack[stack_size++] =
+                BuildFrame{frame.mid, frame.end, get_next_coord(frame.coord),
+                           0, -1, FRAME_SPLIT};
+            continue;
+        } else {
+            const Box &left = boxes[frame.left];
+            const Box &right = boxes[last];
+            PaddedVec3ForGLSL min = left.min;
+            PaddedVec3ForGLSL max = left.max;
+            grow(min, max, right.min, right.max);
+            box = Box(min, max, frame.left, last, start + frame.start,
+                      start + frame.end);
+        }
+        stack_size--;
+        if (stack_size == 0) {
+            root = box;
+        } else {
+            boxes.push_back(box);
+            last = boxes.size() - 1;
+        }
+    }
+
+    // Apply the permutation to the triangle pointers in one go
+    apply_build_records(get_thread_pool(), triangles, start, records);
+    return root;
+}
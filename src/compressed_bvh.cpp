@@ -0,0 +1,182 @@
+#include "./compressed_bvh.hpp"
+#include "./aabb.hpp"
+#include "./ray.hpp"
+#include "./wide_bvh.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+// Smallest power-of-two step for which quantized_max steps from origin
+// reach max
+int pick_exponent(float origin, float max, int quantized_max) {
+    float extent = max - origin;
+    if (extent <= 0) {
+        return -100;
+    }
+    int exponent = static_cast<int>(std::ceil(std::log2(extent / quantized_max)));
+    exponent = std::max(exponent, -100);
+    while (origin + quantized_max * std::ldexp(1.0f, exponent) < max) {
+        exponent++;
+    }
+    return exponent;
+}
+
+// Rounds down, then keeps stepping down until the decoded value really is
+// below the bound
+int quantize_down(float value, float origin, float step) {
+    int q = static_cast<int>(std::floor((value - origin) / step));
+    q = std::max(q, 0);
+    while (q > 0 && origin + q * step > value) {
+        q--;
+    }
+    return q;
+}
+
+int quantize_up(float value, float origin, float step, int quantized_max) {
+    int q = static_cast<int>(std::ceil((value - origin) / step));
+    q = std::min(std::max(q, 0), quantized_max);
+    while (q < quantized_max && origin + q * step < value) {
+        q++;
+    }
+    return q;
+}
+
+template <typename Quantized>
+CompressedNode<Quantized> compress_node(const Bvh4Node &node) {
+    const int quantized_max = std::numeric_limits<Quantized>::max();
+    const float *mins[3] = {node.min_x, node.min_y, node.min_z};
+    const float *maxs[3] = {node.max_x, node.max_y, node.max_z};
+
+    CompressedNode<Quantized> compressed{};
+    Quantized *q_mins[3] = {compressed.q_min_x, compressed.q_min_y,
+                            compressed.q_min_z};
+    Quantized *q_maxs[3] = {compressed.q_max_x, compressed.q_max_y,
+                            compressed.q_max_z};
+    for (int coord = 0; coord < 3; coord++) {
+        float min = std::numeric_limits<float>::max();
+        float max = -std::numeric_limits<float>::max();
+        for (int slot = 0; slot < 4; slot++) {
+            if (node.child[slot] != -1) {
+                min = std::min(min, mins[coord][slot]);
+                max = std::max(max, maxs[coord][slot]);
+            }
+        }
+        if (min > max) {
+            min = max = 0;
+        }
+        int exponent = pick_exponent(min, max, quantized_max);
+        float step = std::ldexp(1.0f, exponent);
+        compressed.origin[coord] = min;
+        compressed.exponent[coord] = static_cast<int8_t>(exponent);
+        for (int slot = 0; slot < 4; slot++) {
+            if (node.child[slot] == -1) {
+                // Decodes to an empty box, so it is never hit
+                q_mins[coord][slot] = quantized_max;
+                q_maxs[coord][slot] = 0;
+                continue;
+            }
+            q_mins[coord][slot] = quantize_down(mins[coord][slot], min, step);
+            q_maxs[coord][slot] =
+                quantize_up(maxs[coord][slot], min, step, quantized_max);
+        }
+    }
+    for (int slot = 0; slot < 4; slot++) {
+        if (node.count[slot] > 255) {
+            throw std::runtime_error(
+                "Leaf too large for a compressed BVH node");
+        }
+        compressed.child[slot] = node.child[slot];
+        compressed.count[slot] = static_cast<uint8_t>(node.count[slot]);
+    }
+    return compressed;
+}
+
+template <typename Quantized>
+std::vector<CompressedNode<Quantized>> compress(const std::vector<Box> &boxes,
+                                                int root_id) {
+    std::vector<Bvh4Node> wide = collapse_to_bvh4(boxes, root_id);
+    std::vector<CompressedNode<Quantized>> nodes;
+    nodes.reserve(wide.size());
+    for (const Bvh4Node &node : wide) {
+        nodes.emplace_back(compress_node<Quantized>(node));
+    }
+    return nodes;
+}
+
+template <typename Quantized>
+Hit trace_compressed(const std::vector<CompressedNode<Quantized>> &nodes,
+                     const TriangleForGLSL *triangles,
+                     const int *triangle_indices, const Ray &ray) {
+    Hit hit = Hit{-1, std::numeric_limits<float>::max()};
+    int stack[TRAVERSAL_STACK_SIZE * 4];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        const CompressedNode<Quantized> &node = nodes[stack[--stack_size]];
+        float step[3];
+        for (int coord = 0; coord < 3; coord++) {
+            step[coord] = std::ldexp(1.0f, node.exponent[coord]);
+        }
+
+        float t_near[4];
+        int order[4];
+        int order_size = 0;
+        for (int slot = 0; slot < 4; slot++) {
+            if (node.child[slot] == -1) {
+                continue;
+            }
+            PaddedVec3ForGLSL min = PaddedVec3ForGLSL{
+                node.origin[0] + node.q_min_x[slot] * step[0],
+                node.origin[1] + node.q_min_y[slot] * step[1],
+                node.origin[2] + node.q_min_z[slot] * step[2], 0};
+            PaddedVec3ForGLSL max = PaddedVec3ForGLSL{
+                node.origin[0] + node.q_max_x[slot] * step[0],
+                node.origin[1] + node.q_max_y[slot] * step[1],
+                node.origin[2] + node.q_max_z[slot] * step[2], 0};
+            if (!intersect_box(ray, min, max, hit.t, t_near[slot])) {
+                continue;
+            }
+            if (node.count[slot] > 0) {
+                intersect_leaf(ray, triangles, triangle_indices,
+                               node.child[slot],
+                               node.child[slot] + node.count[slot], hit);
+                continue;
+            }
+            int i = order_size++;
+            while (i > 0 && t_near[order[i - 1]] < t_near[slot]) {
+                order[i] = order[i - 1];
+                i--;
+            }
+            order[i] = slot;
+        }
+        for (int i = 0; i < order_size; i++) {
+            stack[stack_size++] = node.child[order[i]];
+        }
+    }
+    return hit;
+}
+
+std::vector<CompressedNode8> compress_to_bvh4q8(const std::vector<Box> &boxes,
+                                                int root_id) {
+    return compress<uint8_t>(boxes, root_id);
+}
+
+std::vector<CompressedNode16>
+compress_to_bvh4q16(const std::vector<Box> &boxes, int root_id) {
+    return compress<uint16_t>(boxes, root_id);
+}
+
+Hit trace_compressed8(const std::vector<CompressedNode8> &nodes,
+                      const TriangleForGLSL *triangles,
+                      const int *triangle_indices, const Ray &ray) {
+    return trace_compressed(nodes, triangles, triangle_indices, ray);
+}
+
+Hit trace_compressed16(const std::vector<CompressedNode16> &nodes,
+                       const TriangleForGLSL *triangles,
+                       const int *triangle_indices, const Ray &ray) {
+    return trace_compressed(nodes, triangles, triangle_indices, ray);
+}
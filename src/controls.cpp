@@ -14,10 +14,13 @@ float initial_fov = 45.0f;
 float speed = 3.0f; // 3 units / second
 float mouse_speed = 0.005f;
 int renderMode = 0;
+bool stackless = false;
+bool stackless_key_down = false;
 
 glm::vec2 get_rotation() { return glm::vec2(pitch, yaw); }
 glm::vec3 get_position() { return position; }
 int get_render_mode() { return renderMode; }
+bool get_stackless() { return stackless; }
 
 void update_movement(GLFWwindow *window, int mode) {
 
@@ -81,6 +84,13 @@ void update_movement(GLFWwindow *window, int mode) {
         renderMode = 1;
     }
 
+    // T switches between stack-based and stackless traversal
+    bool stackless_key = glfwGetKey(window, GLFW_KEY_T) == GLFW_PRESS;
+    if (stackless_key && !stackless_key_down) {
+        stackless = !stackless;
+    }
+    stackless_key_down = stackless_key;
+
     // Move forward
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
         position += direction * delta_time * speed;
@@ -0,0 +1,111 @@
+#include "./cost_model.hpp"
+#include "./aabb.hpp"
+#include "./ray.hpp"
+#include <chrono>
+#include <random>
+#include <vector>
+
+// A node visit in the shaders pops the stack, tests two boxes and branches
+// on the result, which keeps leaves at around four triangles like the old
+// fixed limit of 8 did. The CPU numbers are roughly what
+// calibrate_cost_model measures
+const CostModel GPU_COST_MODEL = CostModel{1.0f, 0.3f, 8};
+const CostModel CPU_COST_MODEL = CostModel{1.0f, 0.65f, 8};
+
+// Tests timed per kind during calibration
+const int CALIBRATION_TESTS = 1 << 22;
+
+CostModel cost_model = GPU_COST_MODEL;
+
+// Keeps the timed tests from being optimized away
+volatile int calibration_sink;
+
+CostModel get_default_cost_model(int backend) {
+    return backend == COST_CPU ? CPU_COST_MODEL : GPU_COST_MODEL;
+}
+
+template <typename Function> double time_tests(const Function &function) {
+    auto start = std::chrono::steady_clock::now();
+    function();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+}
+
+CostModel calibrate_cost_model() {
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> position(-1, 1);
+    const int count = 1024;
+    std::vector<Ray> rays;
+    std::vector<TriangleForGLSL> triangles(count);
+    for (int i = 0; i < count; i++) {
+        rays.push_back(make_ray(
+            PaddedVec3ForGLSL{position(random), position(random), -2, 0},
+            PaddedVec3ForGLSL{position(random) * 0.1f,
+                              position(random) * 0.1f, 1, 0}));
+        PaddedVec3ForGLSL v1 =
+            PaddedVec3ForGLSL{position(random), position(random), 0, 0};
+        triangles[i].v1 = v1;
+        triangles[i].v2 = PaddedVec3ForGLSL{v1.x + 0.5f, v1.y, 0.1f, 0};
+        triangles[i].v3 = PaddedVec3ForGLSL{v1.x, v1.y + 0.5f, -0.1f, 0};
+        triangles[i].min = v3_min(triangles[i].v1, triangles[i].v2,
+                                  triangles[i].v3);
+        triangles[i].max = v3_max(triangles[i].v1, triangles[i].v2,
+                                  triangles[i].v3);
+    }
+
+    int hits = 0;
+    double box_time = time_tests([&] {
+        for (int i = 0; i < CALIBRATION_TESTS; i++) {
+            float t_near;
+            const TriangleForGLSL &box = triangles[(i * 7) % count];
+            hits += intersect_box(rays[i % count], box.min, box.max, 1e30f,
+                                  t_near);
+        }
+    });
+    double triangle_time = time_tests([&] {
+        for (int i = 0; i < CALIBRATION_TESTS; i++) {
+            float t;
+            hits += intersect_triangle(rays[i % count],
+                                       triangles[(i * 7) % count], t);
+        }
+    });
+    calibration_sink = hits;
+    // trace_boxes tests both children of every inner node it visits
+    return CostModel{1.0f, static_cast<float>(triangle_time / (2 * box_time)),
+                     cost_model.max_leaf_size};
+}
+
+void set_cost_model(const CostModel &model) { cost_model = model; }
+
+const CostModel &get_cost_model() { return cost_model; }
+
+bool should_make_leaf(int count, const PaddedVec3ForGLSL &min,
+                      const PaddedVec3ForGLSL &max, float split_cost) {
+    if (count <= 1) {
+        return true;
+    }
+    if (count > cost_model.max_leaf_size) {
+        return false;
+    }
+    float area = surface_area(min, max);
+    return cost_model.intersection * count * area <=
+           cost_model.traversal * area +
+               cost_model.intersection * split_cost;
+}
+
+bool should_make_leaf(const std::vector<TriangleForGLSL *> &triangles,
+                      int start, int mid, int end) {
+    int count = end - start;
+    if (count <= 1 || count > cost_model.max_leaf_size) {
+        return count <= 1;
+    }
+    PaddedVec3ForGLSL left_min = get_min(triangles, start, mid);
+    PaddedVec3ForGLSL left_max = get_max(triangles, start, mid);
+    PaddedVec3ForGLSL right_min = get_min(triangles, mid, end);
+    PaddedVec3ForGLSL right_max = get_max(triangles, mid, end);
+    float split_cost = surface_area(left_min, left_max) * (mid - start) +
+                       surface_area(right_min, right_max) * (end - mid);
+    grow(left_min, left_max, right_min, right_max);
+    return should_make_leaf(count, left_min, left_max, split_cost);
+}
@@ -0,0 +1,104 @@
+#include "./depth_first.hpp"
+#include "./aabb.hpp"
+#include "./ray.hpp"
+#include <limits>
+#include <utility>
+#include <vector>
+
+void set_bounds(DepthFirstNode &node, const PaddedVec3ForGLSL &min,
+                const PaddedVec3ForGLSL &max) {
+    node.min[0] = min.x;
+    node.min[1] = min.y;
+    node.min[2] = min.z;
+    node.max[0] = max.x;
+    node.max[1] = max.y;
+    node.max[2] = max.z;
+}
+
+void write_depth_first(std::vector<DepthFirstNode> &nodes,
+                       const std::vector<Box> &boxes, int box_id) {
+    const Box &box = boxes[box_id];
+    int node_id = nodes.size();
+    nodes.emplace_back();
+    if (box.left_id == -1) {
+        if (box.end > box.start) {
+            set_bounds(nodes[node_id], box.min, box.max);
+        } else {
+            set_bounds(nodes[node_id], empty_min(), empty_max());
+        }
+        nodes[node_id].offset = box.start;
+        nodes[node_id].count = box.end - box.start;
+        return;
+    }
+    set_bounds(nodes[node_id], box.min, box.max);
+    nodes[node_id].count = 0;
+
+    int first = box.left_id;
+    int second = box.right_id;
+    if (surface_area(boxes[second].min, boxes[second].max) >
+        surface_area(boxes[first].min, boxes[first].max)) {
+        std::swap(first, second);
+    }
+    write_depth_first(nodes, boxes, first);
+    // Recursing may reallocate nodes, so no references across these calls
+    nodes[node_id].offset = nodes.size();
+    write_depth_first(nodes, boxes, second);
+}
+
+std::vector<DepthFirstNode> to_depth_first(const std::vector<Box> &boxes,
+                                           int root_id) {
+    std::vector<DepthFirstNode> nodes;
+    nodes.reserve(boxes.size());
+    write_depth_first(nodes, boxes, root_id);
+    return nodes;
+}
+
+bool intersect_node(const Ray &ray, const DepthFirstNode &node, float t_max,
+                    float &t_near) {
+    return intersect_box(
+        ray, PaddedVec3ForGLSL{node.min[0], node.min[1], node.min[2], 0},
+        PaddedVec3ForGLSL{node.max[0], node.max[1], node.max[2], 0}, t_max,
+        t_near);
+}
+
+Hit trace_depth_first(const std::vector<DepthFirstNode> &nodes,
+                      const TriangleForGLSL *triangles,
+                      const int *triangle_indices, const Ray &ray) {
+    Hit hit = Hit{-1, std::numeric_limits<float>::max()};
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        int node_id = stack[--stack_size];
+        const DepthFirstNode &node = nodes[node_id];
+        float t_near;
+        if (!intersect_node(ray, node, hit.t, t_near)) {
+            continue;
+        }
+        if (node.count > 0) {
+            intersect_leaf(ray, triangles, triangle_indices, node.offset,
+                           node.offset + node.count, hit);
+            continue;
+        }
+        int first = node_id + 1;
+        int second = node.offset;
+        float t_first;
+        float t_second;
+        bool first_hit = intersect_node(ray, nodes[first], hit.t, t_first);
+        bool second_hit = intersect_node(ray, nodes[second], hit.t, t_second);
+        if (first_hit && second_hit) {
+            if (t_first < t_second) {
+                stack[stack_size++] = second;
+                stack[stack_size++] = first;
+            } else {
+                stack[stack_size++] = first;
+                stack[stack_size++] = second;
+            }
+        } else if (first_hit) {
+            stack[stack_size++] = first;
+        } else if (second_hit) {
+            stack[stack_size++] = second;
+        }
+    }
+    return hit;
+}
@@ -0,0 +1,338 @@
+#include "./dynamic_bvh.hpp"
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include <algorithm>
+#include <queue>
+#include <utility>
+#include <vector>
+
+// Dirty ranges closer than this are uploaded as one
+const int DIRTY_MERGE_GAP = 64;
+
+Box empty_box() { return Box(empty_min(), empty_max(), -1, -1, 0, 0); }
+
+void mark_box(DynamicScene &scene, int id) {
+    scene.dirty_boxes.push_back(DirtyRange{id, id + 1});
+}
+
+int allocate_box(DynamicScene &scene) {
+    if (!scene.free_boxes.empty()) {
+        int id = scene.free_boxes.back();
+        scene.free_boxes.pop_back();
+        return id;
+    }
+    scene.boxes.push_back(empty_box());
+    scene.parents.push_back(-1);
+    return scene.boxes.size() - 1;
+}
+
+void free_box(DynamicScene &scene, int id) {
+    scene.boxes[id] = empty_box();
+    scene.parents[id] = -1;
+    scene.free_boxes.push_back(id);
+    mark_box(scene, id);
+}
+
+void replace_child(DynamicScene &scene, int parent, int old_child,
+                   int new_child) {
+    Box &box = scene.boxes[parent];
+    if (box.left_id == old_child) {
+        box.left_id = new_child;
+    } else {
+        box.right_id = new_child;
+    }
+    scene.parents[new_child] = parent;
+    mark_box(scene, parent);
+}
+
+void fit_to_children(DynamicScene &scene, int id) {
+    Box &box = scene.boxes[id];
+    const Box &left = scene.boxes[box.left_id];
+    const Box &right = scene.boxes[box.right_id];
+    box.min = left.min;
+    box.max = left.max;
+    grow(box.min, box.max, right.min, right.max);
+    box.start = std::min(left.start, right.start);
+    box.end = std::max(left.end, right.end);
+    mark_box(scene, id);
+}
+
+float union_area(const Box &a, const Box &b) {
+    PaddedVec3ForGLSL min = a.min;
+    PaddedVec3ForGLSL max = a.max;
+    grow(min, max, b.min, b.max);
+    return surface_area(min, max);
+}
+
+// Swaps the child `child` of `parent` with the grandchild `grandchild`,
+// which hangs below parent's other child
+void swap_with_grandchild(DynamicScene &scene, int parent, int child,
+                          int grandchild) {
+    int middle = scene.parents[grandchild];
+    replace_child(scene, parent, child, grandchild);
+    replace_child(scene, middle, grandchild, child);
+    fit_to_children(scene, middle);
+}
+
+// Tree rotation: swaps a child of the node with one of its grandchildren
+// when that makes the node in between smaller
+void rotate(DynamicScene &scene, int id) {
+    const Box &box = scene.boxes[id];
+    int children[2] = {box.left_id, box.right_id};
+    float best_gain = 0;
+    int best_child = -1;
+    int best_grandchild = -1;
+    for (int side = 0; side < 2; side++) {
+        int child = children[side];
+        int other = children[1 - side];
+        const Box &middle = scene.boxes[other];
+        if (middle.left_id == -1) {
+            continue;
+        }
+        float area = surface_area(middle.min, middle.max);
+        int grandchildren[2] = {middle.left_id, middle.right_id};
+        for (int i = 0; i < 2; i++) {
+            // child takes the place of grandchildren[i] next to the other
+            float gain = area - union_area(scene.boxes[child],
+                                           scene.boxes[grandchildren[1 - i]]);
+            if (gain > best_gain) {
+                best_gain = gain;
+                best_child = child;
+                best_grandchild = grandchildren[i];
+            }
+        }
+    }
+    if (best_child != -1) {
+        swap_with_grandchild(scene, id, best_child, best_grandchild);
+    }
+}
+
+void refit_upwards(DynamicScene &scene, int id) {
+    while (id != -1) {
+        rotate(scene, id);
+        fit_to_children(scene, id);
+        id = scene.parents[id];
+    }
+}
+
+// Branch and bound over the tree for the node that, paired with the new
+// one, grows the tree's surface area the least
+int find_best_sibling(const DynamicScene &scene, const Box &node) {
+    float node_area = surface_area(node.min, node.max);
+    int best = scene.root_id;
+    float best_cost = union_area(scene.boxes[best], node);
+    // (area the ancestors grow by, box id), smallest growth first
+    std::priority_queue<std::pair<float, int>,
+                        std::vector<std::pair<float, int>>,
+                        std::greater<std::pair<float, int>>>
+        queue;
+    queue.push(std::make_pair(0.0f, scene.root_id));
+    while (!queue.empty()) {
+        float inherited = queue.top().first;
+        int id = queue.top().second;
+        queue.pop();
+        if (inherited + node_area >= best_cost) {
+            break;
+        }
+        const Box &box = scene.boxes[id];
+        float direct = union_area(box, node);
+        if (direct + inherited < best_cost) {
+            best = id;
+            best_cost = direct + inherited;
+        }
+        if (box.left_id == -1) {
+            continue;
+        }
+        float child_inherited =
+            inherited + direct - surface_area(box.min, box.max);
+        if (child_inherited + node_area < best_cost) {
+            queue.push(std::make_pair(child_inherited, box.left_id));
+            queue.push(std::make_pair(child_inherited, box.right_id));
+        }
+    }
+    return best;
+}
+
+void insert_node(DynamicScene &scene, int id) {
+    if (scene.root_id == -1) {
+        scene.root_id = id;
+        scene.parents[id] = -1;
+        return;
+    }
+    int sibling = find_best_sibling(scene, scene.boxes[id]);
+    int old_parent = scene.parents[sibling];
+    int parent = allocate_box(scene);
+    scene.boxes[parent] = Box(empty_min(), empty_max(), sibling, id, 0, 0);
+    scene.parents[parent] = old_parent;
+    scene.parents[sibling] = parent;
+    scene.parents[id] = parent;
+    if (old_parent == -1) {
+        scene.root_id = parent;
+    } else {
+        replace_child(scene, old_parent, sibling, parent);
+    }
+    refit_upwards(scene, parent);
+}
+
+void remove_leaf(DynamicScene &scene, int leaf) {
+    int parent = scene.parents[leaf];
+    free_box(scene, leaf);
+    if (parent == -1) {
+        scene.root_id = -1;
+        return;
+    }
+    const Box &box = scene.boxes[parent];
+    int sibling = box.left_id == leaf ? box.right_id : box.left_id;
+    int grandparent = scene.parents[parent];
+    free_box(scene, parent);
+    if (grandparent == -1) {
+        scene.root_id = sibling;
+        scene.parents[sibling] = -1;
+        return;
+    }
+    replace_child(scene, grandparent, parent, sibling);
+    refit_upwards(scene, grandparent);
+}
+
+DynamicScene make_dynamic_scene(const std::vector<TriangleForGLSL *> &triangles,
+                                const std::vector<int> &triangle_models,
+                                const std::vector<Box> &boxes, int root_id,
+                                int model_count) {
+    DynamicScene scene = DynamicScene{};
+    scene.triangles.reserve(triangles.size());
+    for (const auto triangle : triangles) {
+        scene.triangles.push_back(*triangle);
+    }
+    scene.boxes = boxes;
+    scene.root_id = root_id;
+    scene.parents.assign(boxes.size(), -1);
+    scene.triangle_models = triangle_models;
+    scene.triangle_leaves.assign(triangles.size(), -1);
+    scene.model_count = model_count;
+    for (size_t id = 0; id < boxes.size(); id++) {
+        const Box &box = boxes[id];
+        if (box.left_id != -1) {
+            scene.parents[box.left_id] = id;
+            scene.parents[box.right_id] = id;
+            continue;
+        }
+        for (int i = box.start; i < box.end; i++) {
+            scene.triangle_leaves[i] = id;
+        }
+    }
+    return scene;
+}
+
+int insert_model(DynamicScene &scene,
+                 std::vector<TriangleForGLSL *> &triangles) {
+    int model = scene.model_count++;
+    if (triangles.empty()) {
+        return model;
+    }
+    std::vector<Box> local;
+    AABB *aabb =
+        triangles_to_aabb(local, triangles, 0, triangles.size(), 0, BVH_SAH);
+    int local_root = aabb->root_id;
+    delete aabb;
+
+    int offset = scene.triangles.size();
+    for (const auto triangle : triangles) {
+        scene.triangles.push_back(*triangle);
+        scene.triangle_models.push_back(model);
+        scene.triangle_leaves.push_back(-1);
+    }
+    scene.dirty_triangles.push_back(
+        DirtyRange{offset, static_cast<int>(scene.triangles.size())});
+
+    std::vector<int> ids(local.size());
+    for (size_t i = 0; i < local.size(); i++) {
+        ids[i] = allocate_box(scene);
+    }
+    for (size_t i = 0; i < local.size(); i++) {
+        Box box = local[i];
+        box.start += offset;
+        box.end += offset;
+        if (box.left_id != -1) {
+            box.left_id = ids[box.left_id];
+            box.right_id = ids[box.right_id];
+            scene.parents[box.left_id] = ids[i];
+            scene.parents[box.right_id] = ids[i];
+        } else {
+            for (int j = box.start; j < box.end; j++) {
+                scene.triangle_leaves[j] = ids[i];
+            }
+        }
+        scene.boxes[ids[i]] = box;
+        mark_box(scene, ids[i]);
+    }
+    insert_node(scene, ids[local_root]);
+    return model;
+}
+
+bool remove_model(DynamicScene &scene, int model) {
+    std::vector<int> leaves;
+    for (size_t i = 0; i < scene.triangles.size(); i++) {
+        if (scene.triangle_models[i] == model) {
+            leaves.push_back(scene.triangle_leaves[i]);
+        }
+    }
+    std::sort(leaves.begin(), leaves.end());
+    leaves.erase(std::unique(leaves.begin(), leaves.end()), leaves.end());
+
+    for (int leaf : leaves) {
+        // Move what stays to the front of the leaf's range
+        Box &box = scene.boxes[leaf];
+        int kept = box.start;
+        PaddedVec3ForGLSL min = empty_min();
+        PaddedVec3ForGLSL max = empty_max();
+        for (int i = box.start; i < box.end; i++) {
+            if (scene.triangle_models[i] == model) {
+                scene.removed_triangles++;
+                continue;
+            }
+            scene.triangles[kept] = scene.triangles[i];
+            scene.triangle_models[kept] = scene.triangle_models[i];
+            grow(min, max, scene.triangles[kept].min,
+                 scene.triangles[kept].max);
+            kept++;
+        }
+        for (int i = kept; i < box.end; i++) {
+            scene.triangle_models[i] = -1;
+            scene.triangle_leaves[i] = -1;
+        }
+        scene.dirty_triangles.push_back(DirtyRange{box.start, kept});
+        if (kept == box.start) {
+            remove_leaf(scene, leaf);
+            continue;
+        }
+        box.min = min;
+        box.max = max;
+        box.end = kept;
+        mark_box(scene, leaf);
+        if (scene.parents[leaf] != -1) {
+            refit_upwards(scene, scene.parents[leaf]);
+        }
+    }
+    return scene.removed_triangles * 2 > static_cast<int>(scene.triangles.size());
+}
+
+std::vector<DirtyRange> take_dirty_ranges(std::vector<DirtyRange> &dirty) {
+    std::sort(dirty.begin(), dirty.end(),
+              [](const DirtyRange &a, const DirtyRange &b) {
+                  return a.start < b.start;
+              });
+    std::vector<DirtyRange> merged;
+    for (const DirtyRange &range : dirty) {
+        if (range.end <= range.start) {
+            continue;
+        }
+        if (!merged.empty() &&
+            range.start <= merged.back().end + DIRTY_MERGE_GAP) {
+            merged.back().end = std::max(merged.back().end, range.end);
+        } else {
+            merged.push_back(range);
+        }
+    }
+    dirty.clear();
+    return merged;
+}
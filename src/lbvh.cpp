@@ -0,0 +1,211 @@
+#include "./lbvh.hpp"
+#include "./aabb.hpp"
+#include "./cost_model.hpp"
+#include "./parallel_bvh.hpp"
+#include "./sah.hpp"
+#include "./thread_pool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Spreads the lowest 10 bits of v so there are two zero bits between each
+uint32_t expand_bits10(uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Same as above for the lowest 21 bits
+uint64_t expand_bits21(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | (v << 32)) & 0x001f00000000ffffull;
+    v = (v | (v << 16)) & 0x001f0000ff0000ffull;
+    v = (v | (v << 8)) & 0x100f00f00f00f00full;
+    v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+    v = (v | (v << 2)) & 0x1249249249249249ull;
+    return v;
+}
+
+uint32_t quantize(float v, uint32_t max) {
+    return static_cast<uint32_t>(
+        std::min(std::max(v * (max + 1), 0.0f), static_cast<float>(max)));
+}
+
+// Coordinates are expected to be normalized to [0, 1]
+uint32_t morton_code30(float x, float y, float z) {
+    return (expand_bits10(quantize(x, 0x3ff)) << 2) |
+           (expand_bits10(quantize(y, 0x3ff)) << 1) |
+           expand_bits10(quantize(z, 0x3ff));
+}
+
+uint64_t morton_code63(float x, float y, float z) {
+    return (expand_bits21(quantize(x, 0x1fffff)) << 2) |
+           (expand_bits21(quantize(y, 0x1fffff)) << 1) |
+           expand_bits21(quantize(z, 0x1fffff));
+}
+
+// Least significant digit radix sort of the codes, carrying the triangle
+// indices along. Every pass histograms and scatters fixed chunks in parallel,
+// which keeps the sort stable and the result independent of the thread count
+template <typename Code>
+void radix_sort(ThreadPool &pool, std::vector<Code> &codes,
+                std::vector<int> &indices, int bits) {
+    const int digit_bits = 8;
+    const int digit_count = 1 << digit_bits;
+    int size = codes.size();
+    int chunk_count = (size + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+    std::vector<Code> codes_out(size);
+    std::vector<int> indices_out(size);
+    std::vector<int> offsets(chunk_count * digit_count);
+
+    for (int shift = 0; shift < bits; shift += digit_bits) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallel_for(pool, 0, size, PARALLEL_CHUNK,
+                     [&](int chunk_start, int chunk_end) {
+                         int *histogram = &offsets[chunk_start /
+                                                   PARALLEL_CHUNK * digit_count];
+                         for (int i = chunk_start; i < chunk_end; i++) {
+                             histogram[(codes[i] >> shift) & (digit_count - 1)]++;
+                         }
+                     });
+        // Exclusive prefix sum, digit-major so equal digits keep chunk order
+        int sum = 0;
+        for (int digit = 0; digit < digit_count; digit++) {
+            for (int chunk = 0; chunk < chunk_count; chunk++) {
+                int count = offsets[chunk * digit_count + digit];
+                offsets[chunk * digit_count + digit] = sum;
+                sum += count;
+            }
+        }
+        parallel_for(pool, 0, size, PARALLEL_CHUNK,
+                     [&](int chunk_start, int chunk_end) {
+                         int *offset = &offsets[chunk_start / PARALLEL_CHUNK *
+                                                digit_count];
+                         for (int i = chunk_start; i < chunk_end; i++) {
+                             int target =
+                                 offset[(codes[i] >> shift) & (digit_count - 1)]++;
+                             codes_out[target] = codes[i];
+                             indices_out[target] = indices[i];
+                         }
+                     });
+        codes.swap(codes_out);
+        indices.swap(indices_out);
+    }
+}
+
+template <typename Code>
+int find_morton_split(const std::vector<Code> &codes, int start, int end) {
+    Code first = codes[start];
+    Code last = codes[end - 1];
+    if (first == last) {
+        // Identical codes carry no more information, split in the middle
+        return start + (end - start) / 2;
+    }
+    int bit = sizeof(Code) * 8 - 1;
+    while (!(((first ^ last) >> bit) & 1)) {
+        bit--;
+    }
+    // All codes share the bits above `bit`, and they are sorted, so the ones
+    // with this bit set form the upper part of the range
+    return std::partition_point(codes.begin() + start, codes.begin() + end,
+                                [bit](Code code) { return !((code >> bit) & 1); }) -
+           codes.begin();
+}
+
+template <typename Code>
+Box morton_to_box(std::vector<Box> &boxes,
+                  const std::vector<TriangleForGLSL *> &triangles,
+                  const std::vector<Code> &codes, int start, int end) {
+    int mid = find_morton_split(codes, start, end);
+    if (should_make_leaf(triangles, start, mid, end)) {
+        return Box(get_min(triangles, start, end),
+                   get_max(triangles, start, end), -1, -1, start, end);
+    }
+    boxes.emplace_back(morton_to_box(boxes, triangles, codes, start, mid));
+    int left = boxes.size() - 1;
+    boxes.emplace_back(morton_to_box(boxes, triangles, codes, mid, end));
+    int right = boxes.size() - 1;
+
+    PaddedVec3ForGLSL min = boxes[left].min;
+    PaddedVec3ForGLSL max = boxes[left].max;
+    grow(min, max, boxes[right].min, boxes[right].max);
+    return Box(min, max, left, right, start, end);
+}
+
+template <typename Code, typename Encode>
+Box build_lbvh(ThreadPool &pool, std::vector<Box> &boxes,
+               std::vector<TriangleForGLSL *> &triangles, int start, int end,
+               int bits, Encode encode) {
+    int span = end - start;
+
+    std::vector<PaddedVec3ForGLSL> chunk_min((span + PARALLEL_CHUNK - 1) /
+                                             PARALLEL_CHUNK);
+    std::vector<PaddedVec3ForGLSL> chunk_max(chunk_min.size());
+    parallel_for(pool, start, end, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     int chunk = (chunk_start - start) / PARALLEL_CHUNK;
+                     get_centroid_bounds(triangles, chunk_start, chunk_end,
+                                         chunk_min[chunk], chunk_max[chunk]);
+                 });
+    PaddedVec3ForGLSL min = empty_min();
+    PaddedVec3ForGLSL max = empty_max();
+    for (size_t i = 0; i < chunk_min.size(); i++) {
+        grow(min, max, chunk_min[i], chunk_max[i]);
+    }
+    float scale[3];
+    for (int coord = 0; coord < 3; coord++) {
+        float extent = get_coord(coord, max) - get_coord(coord, min);
+        scale[coord] = extent > 0 ? 1.0f / extent : 0;
+    }
+
+    std::vector<Code> codes(span);
+    std::vector<int> indices(span);
+    parallel_for(pool, 0, span, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     for (int i = chunk_start; i < chunk_end; i++) {
+                         const TriangleForGLSL *t = triangles[start + i];
+                         codes[i] = encode(
+                             (get_centroid(0, t) - min.x) * scale[0],
+                             (get_centroid(1, t) - min.y) * scale[1],
+                             (get_centroid(2, t) - min.z) * scale[2]);
+                         indices[i] = start + i;
+                     }
+                 });
+    radix_sort(pool, codes, indices, bits);
+
+    std::vector<TriangleForGLSL *> sorted(span);
+    parallel_for(pool, 0, span, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     for (int i = chunk_start; i < chunk_end; i++) {
+                         sorted[i] = triangles[indices[i]];
+                     }
+                 });
+    std::copy(sorted.begin(), sorted.end(), triangles.begin() + start);
+
+    // Codes are indexed relative to start, shift them so ranges line up
+    // with the triangle indices stored in the boxes
+    codes.insert(codes.begin(), start, Code(0));
+    return build_in_parallel(
+        pool, boxes, start, end,
+        [&codes](int start, int end) {
+            return find_morton_split(codes, start, end);
+        },
+        [&triangles, &codes](std::vector<Box> &arena, int start, int end) {
+            arena.emplace_back(
+                morton_to_box(arena, triangles, codes, start, end));
+        });
+}
+
+Box triangles_to_box_lbvh(ThreadPool &pool, std::vector<Box> &boxes,
+                          std::vector<TriangleForGLSL *> &triangles, int start,
+                          int end) {
+    if (end - start > LBVH_MORTON64_THRESHOLD) {
+        return build_lbvh<uint64_t>(pool, boxes, triangles, start, end, 63,
+                                    morton_code63);
+    }
+    return build_lbvh<uint32_t>(pool, boxes, triangles, start, end, 30,
+                                morton_code30);
+}
@@ -0,0 +1,138 @@
+#include "./leaf_triangles.hpp"
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./ray.hpp"
+#include <cmath>
+#include <limits>
+#include <vector>
+
+LeafTriangle to_leaf_triangle(const TriangleForGLSL &triangle) {
+    // Columns of the matrix that takes unit triangle space to the world:
+    // both edges, the normal and the first vertex
+    const TriangleForGLSL &t = triangle;
+    double e1[3] = {t.v2.x - t.v1.x, t.v2.y - t.v1.y, t.v2.z - t.v1.z};
+    double e2[3] = {t.v3.x - t.v1.x, t.v3.y - t.v1.y, t.v3.z - t.v1.z};
+    double n[3] = {e1[1] * e2[2] - e1[2] * e2[1],
+                   e1[2] * e2[0] - e1[0] * e2[2],
+                   e1[0] * e2[1] - e1[1] * e2[0]};
+    double v1[3] = {t.v1.x, t.v1.y, t.v1.z};
+
+    // Rows of the inverse are the cross products of the other two columns
+    double r0[3] = {e2[1] * n[2] - e2[2] * n[1], e2[2] * n[0] - e2[0] * n[2],
+                    e2[0] * n[1] - e2[1] * n[0]};
+    double r1[3] = {n[1] * e1[2] - n[2] * e1[1], n[2] * e1[0] - n[0] * e1[2],
+                    n[0] * e1[1] - n[1] * e1[0]};
+    double determinant = e1[0] * r0[0] + e1[1] * r0[1] + e1[2] * r0[2];
+    if (std::abs(determinant) < 1e-30) {
+        // The ray never moves along z, so it never crosses z = 0
+        return LeafTriangle{
+            {Vec4ForGLSL{0, 0, 0, 0}, Vec4ForGLSL{0, 0, 0, 0},
+             Vec4ForGLSL{0, 0, 0, 1}}};
+    }
+    double rows[3][3];
+    for (int i = 0; i < 3; i++) {
+        rows[0][i] = r0[i] / determinant;
+        rows[1][i] = r1[i] / determinant;
+        rows[2][i] = n[i] / determinant;
+    }
+    LeafTriangle leaf_triangle;
+    for (int row = 0; row < 3; row++) {
+        double w = -(rows[row][0] * v1[0] + rows[row][1] * v1[1] +
+                     rows[row][2] * v1[2]);
+        leaf_triangle.rows[row] = Vec4ForGLSL{
+            static_cast<float>(rows[row][0]), static_cast<float>(rows[row][1]),
+            static_cast<float>(rows[row][2]), static_cast<float>(w)};
+    }
+    return leaf_triangle;
+}
+
+std::vector<LeafTriangle>
+to_leaf_triangles(const TriangleForGLSL *triangles, size_t triangle_count,
+                  const std::vector<int> &triangle_indices) {
+    std::vector<LeafTriangle> leaf_triangles;
+    if (triangle_indices.empty()) {
+        leaf_triangles.reserve(triangle_count);
+        for (size_t i = 0; i < triangle_count; i++) {
+            leaf_triangles.push_back(to_leaf_triangle(triangles[i]));
+        }
+        return leaf_triangles;
+    }
+    leaf_triangles.reserve(triangle_indices.size());
+    for (int index : triangle_indices) {
+        leaf_triangles.push_back(to_leaf_triangle(triangles[index]));
+    }
+    return leaf_triangles;
+}
+
+float transform_row(const Vec4ForGLSL &row, const PaddedVec3ForGLSL &v,
+                    float w) {
+    return row.x * v.x + row.y * v.y + row.z * v.z + row.w * w;
+}
+
+bool intersect_leaf_triangle(const Ray &ray, const LeafTriangle &triangle,
+                             float &t) {
+    float origin_z = transform_row(triangle.rows[2], ray.origin, 1);
+    float direction_z = transform_row(triangle.rows[2], ray.direction, 0);
+    t = -origin_z / direction_z;
+    if (!(t > 0)) {
+        return false;
+    }
+    float u = transform_row(triangle.rows[0], ray.origin, 1) +
+              t * transform_row(triangle.rows[0], ray.direction, 0);
+    if (u < 0 || u > 1) {
+        return false;
+    }
+    float v = transform_row(triangle.rows[1], ray.origin, 1) +
+              t * transform_row(triangle.rows[1], ray.direction, 0);
+    return v >= 0 && u + v <= 1;
+}
+
+Hit trace_leaf_triangles(const std::vector<Box> &boxes, int root_id,
+                         const std::vector<LeafTriangle> &leaf_triangles,
+                         const int *triangle_indices, const Ray &ray) {
+    Hit hit = Hit{-1, std::numeric_limits<float>::max()};
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = root_id;
+    while (stack_size > 0) {
+        const Box &box = boxes[stack[--stack_size]];
+        float t_near;
+        if (!intersect_box(ray, box.min, box.max, hit.t, t_near)) {
+            continue;
+        }
+        if (box.left_id != -1) {
+            float t_left;
+            float t_right;
+            bool left = intersect_box(ray, boxes[box.left_id].min,
+                                      boxes[box.left_id].max, hit.t, t_left);
+            bool right =
+                intersect_box(ray, boxes[box.right_id].min,
+                              boxes[box.right_id].max, hit.t, t_right);
+            if (left && right) {
+                if (t_left < t_right) {
+                    stack[stack_size++] = box.right_id;
+                    stack[stack_size++] = box.left_id;
+                } else {
+                    stack[stack_size++] = box.left_id;
+                    stack[stack_size++] = box.right_id;
+                }
+            } else if (left) {
+                stack[stack_size++] = box.left_id;
+            } else if (right) {
+                stack[stack_size++] = box.right_id;
+            }
+            continue;
+        }
+        for (int i = box.start; i < box.end; i++) {
+            float t;
+            if (intersect_leaf_triangle(ray, leaf_triangles[i], t) &&
+                t < hit.t) {
+                hit = Hit{i, t};
+            }
+        }
+    }
+    if (hit.triangle != -1 && triangle_indices) {
+        hit.triangle = triangle_indices[hit.triangle];
+    }
+    return hit;
+}
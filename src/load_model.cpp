@@ -1,7 +1,13 @@
 #include "./load_model.hpp"
+#include "./mapped_glb.hpp"
+#include "./thread_pool.hpp"
 #include "./tiny_gltf.h"
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
 #include <string>
 
@@ -9,8 +15,6 @@ Vec3 make_vec3(const std::vector<double> &vec) {
     return Vec3{vec[0], vec[1], vec[2]};
 }
 
-Vec3 make_vec3(const float *vec) { return Vec3{vec[0], vec[1], vec[2]}; }
-
 Vec4 make_vec4(const std::vector<double> &vec) {
     return Vec4{vec[0], vec[1], vec[2], vec[3]};
 }
@@ -112,7 +116,7 @@ Matrix4 compose_matrix(const Vec3 &translation, const Vec4 &rotation,
     return matrix;
 }
 
-void print_triangle(const Triangle &t) {
+void print_triangle(const TriangleForGLSL &t) {
     std::cout << "[";
     std::cout << "[";
     std::cout << t.v1.x << ", " << t.v1.y << ", " << t.v1.z;
@@ -181,11 +185,41 @@ uint32_t find_texture(const tinygltf::Texture *tex,
     return res;
 }
 
-void load_node(OurNode *parent, const tinygltf::Node &node,
-               const tinygltf::Model &model, float global_scale) {
-    auto new_node = OurNode{};
+// Triangles primitive decodes to, 0 for the ones that are skipped. report
+// prints why a primitive is skipped
+size_t count_primitive_triangles(const tinygltf::Primitive &primitive,
+                                 const tinygltf::Model &model, bool report) {
+    if (primitive.mode != TINYGLTF_MODE_TRIANGLES) {
+        if (report) {
+            std::cerr << "Warning: primitive.mode is not triangles"
+                      << std::endl;
+        }
+        return 0;
+    }
+    if (primitive.indices == -1) {
+        if (report) {
+            std::cerr << "Warning: primitive.indices == -1; skipping"
+                      << std::endl;
+        }
+        return 0;
+    }
+    const tinygltf::Accessor &accessor = model.accessors[primitive.indices];
+    switch (accessor.componentType) {
+    case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT:
+    case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT:
+    case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE:
+        return accessor.count / 3;
+    default:
+        if (report) {
+            std::cerr << "Index component type " << accessor.componentType
+                      << " not supported!" << std::endl;
+        }
+        return 0;
+    }
+}
 
-    // Generate local node matrix
+// Sets the local transform of new_node from node
+void load_transform(OurNode &new_node, const tinygltf::Node &node) {
     auto translation = Vec3{0.0F, 0.0F, 0.0F};
     if (node.translation.size() == 3) {
         translation = make_vec3(node.translation);
@@ -205,223 +239,222 @@ void load_node(OurNode *parent, const tinygltf::Node &node,
     } else {
         new_node.matrix = compose_matrix(translation, new_node.rotation, scale);
     }
+}
+
+void load_node(OurNode *parent, const tinygltf::Node &node,
+               const tinygltf::Model &model, float global_scale,
+               std::vector<bool> *sized_meshes) {
+    auto new_node = OurNode{};
+    load_transform(new_node, node);
 
     // Node with children
     if (!node.children.empty()) {
         for (const auto &child : node.children) {
-            load_node(&new_node, model.nodes[child], model, global_scale);
+            load_node(&new_node, model.nodes[child], model, global_scale,
+                      sized_meshes);
         }
     }
 
-    // Node contains mesh data
-    if (node.mesh > -1) {
-        const tinygltf::Mesh mesh = model.meshes[node.mesh];
+    // Node contains mesh data, only counted here so decode_primitives can
+    // fill every primitive's range on its own
+    new_node.mesh = node.mesh;
+    if (node.mesh > -1 && !(sized_meshes && (*sized_meshes)[node.mesh])) {
+        if (sized_meshes) {
+            (*sized_meshes)[node.mesh] = true;
+        }
+        size_t triangle_count = 0;
+        for (const auto &primitive : model.meshes[node.mesh].primitives) {
+            triangle_count += count_primitive_triangles(primitive, model, true);
+        }
+        new_node.primitives.resize(triangle_count);
+    }
+    parent->children.emplace_back(std::move(new_node));
+}
 
-        for (const auto &primitive : mesh.primitives) {
-            if (primitive.mode != TINYGLTF_MODE_TRIANGLES) {
-                std::cout << "Warning: primitive.mode is not triangles"
-                          << std::endl;
-                continue;
+// Triangles [first, first + count) of primitive, decoded into out
+struct PrimitiveChunk {
+    TriangleForGLSL *out;
+    const tinygltf::Primitive *primitive;
+    size_t first;
+    size_t count;
+};
+
+void collect_primitive_chunks(OurNode &node, const tinygltf::Model &model,
+                              std::vector<PrimitiveChunk> &chunks) {
+    // Nodes that share a mesh another node holds have nothing to decode
+    if (node.mesh > -1 && !node.primitives.empty()) {
+        size_t offset = 0;
+        for (const auto &primitive : model.meshes[node.mesh].primitives) {
+            size_t triangle_count =
+                count_primitive_triangles(primitive, model, false);
+            for (size_t first = 0; first < triangle_count;
+                 first += LOAD_CHUNK_TRIANGLES) {
+                chunks.push_back(PrimitiveChunk{
+                    node.primitives.data() + offset + first, &primitive, first,
+                    std::min(LOAD_CHUNK_TRIANGLES, triangle_count - first)});
             }
-            if (primitive.indices == -1) {
-                std::cout << "Warning: primitive.indices == -1; skipping"
-                          << std::endl;
-                continue;
-            }
-            uint32_t index_count = 0;
-
-            std::vector<Vertex> vertex_buffer = std::vector<Vertex>();
-            std::vector<uint32_t> index_buffer = std::vector<uint32_t>();
-
-            const float *buffer_texture_coords;
-            {
-                const tinygltf::Accessor &accessor =
-                    model.accessors[primitive.attributes.at("POSITION")];
-
-                const tinygltf::BufferView &buffer_view =
-                    model.bufferViews[accessor.bufferView];
-                const tinygltf::Buffer &buffer =
-                    model.buffers[buffer_view.buffer];
-                const float *positions = reinterpret_cast<const float *>(
-                    &buffer.data[buffer_view.byteOffset + accessor.byteOffset]);
-
-                buffer_texture_coords = nullptr;
-                if (primitive.attributes.find("TEXCOORD_0") !=
-                    primitive.attributes.end()) {
-                    const tinygltf::Accessor &uv_accessor =
-                        model.accessors[primitive.attributes.find("TEXCOORD_0")
-                                            ->second];
-                    const tinygltf::BufferView &uv_view =
-                        model.bufferViews[uv_accessor.bufferView];
-                    buffer_texture_coords = reinterpret_cast<const float *>(
-                        &(model.buffers[uv_view.buffer]
-                              .data[uv_accessor.byteOffset +
-                                    uv_view.byteOffset]));
-                }
+            offset += triangle_count;
+        }
+    }
+    for (auto &child : node.children) {
+        collect_primitive_chunks(child, model, chunks);
+    }
+}
 
-                for (size_t i = 0; i < accessor.count; ++i) {
-                    // Positions are Vec3 components, so for each vec3 stride,
-                    // offset for x, y, and z.
-                    // std::cout << "(" << positions[i * 3 + 0] << ", " // x
-                    //           << positions[i * 3 + 1] << ", "        // y
-                    //           << positions[i * 3 + 2] << ")"         // z
-                    //           << "\n";
-                    Vertex v = Vertex{
-                        positions[i * 3 + 0], positions[i * 3 + 1],
-                        positions[i * 3 + 2], buffer_texture_coords[i * 2],
-                        buffer_texture_coords[i * 2 + 1]};
-                    vertex_buffer.emplace_back(v);
-                }
-            }
-            {
-                const tinygltf::Accessor &accessor =
-                    model.accessors[primitive.indices];
-                const tinygltf::BufferView &buffer_view =
-                    model.bufferViews[accessor.bufferView];
-                const tinygltf::Buffer &buffer =
-                    model.buffers[buffer_view.buffer];
-
-                index_count = static_cast<uint32_t>(accessor.count);
-                switch (accessor.componentType) {
-                case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT: {
-                    auto *buf = new uint32_t[accessor.count];
-                    memcpy(buf,
-                           &buffer.data[accessor.byteOffset +
-                                        buffer_view.byteOffset],
-                           accessor.count * sizeof(uint32_t));
-                    for (size_t index = 0; index < accessor.count; index++) {
-                        index_buffer.emplace_back(buf[index]);
-                    }
-                    delete[] buf;
-                    break;
-                }
-                case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT: {
-                    auto *buf = new uint16_t[accessor.count];
-                    memcpy(buf,
-                           &buffer.data[accessor.byteOffset +
-                                        buffer_view.byteOffset],
-                           accessor.count * sizeof(uint16_t));
-                    for (size_t index = 0; index < accessor.count; index++) {
-                        index_buffer.emplace_back(buf[index]);
-                    }
-                    delete[] buf;
-                    break;
-                }
-                case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE: {
-                    auto *buf = new uint8_t[accessor.count];
-                    memcpy(buf,
-                           &buffer.data[accessor.byteOffset +
-                                        buffer_view.byteOffset],
-                           accessor.count * sizeof(uint8_t));
-                    for (size_t index = 0; index < accessor.count; index++) {
-                        index_buffer.emplace_back(buf[index]);
-                    }
-                    delete[] buf;
-                    break;
-                }
-                default:
-                    std::cerr << "Index component type "
-                              << accessor.componentType << " not supported!"
-                              << std::endl;
-                    return;
-                }
-            }
-            {
-                for (size_t i = 0; i < index_count; i += 3) {
-                    Vertex v1_with_uv = vertex_buffer[index_buffer[i]];
-                    Vertex v2_with_uv = vertex_buffer[index_buffer[1 + i]];
-                    Vertex v3_with_uv = vertex_buffer[index_buffer[2 + i]];
-                    Vec3 v1 = Vec3{v1_with_uv.x, v1_with_uv.y, v1_with_uv.z};
-                    Vec3 v2 = Vec3{v2_with_uv.x, v2_with_uv.y, v2_with_uv.z};
-                    Vec3 v3 = Vec3{v3_with_uv.x, v3_with_uv.y, v3_with_uv.z};
-                    Vec2 uv1 = Vec2{v1_with_uv.uv_x, v1_with_uv.uv_y};
-                    Vec2 uv2 = Vec2{v2_with_uv.uv_x, v2_with_uv.uv_y};
-                    Vec2 uv3 = Vec2{v3_with_uv.uv_x, v3_with_uv.uv_y};
-                    uint32_t texture_id = std::numeric_limits<uint32_t>::max();
-                    uint32_t metallic_roughness_texture_id =
-                        std::numeric_limits<uint32_t>::max();
-                    Vec3 emissive_factor = Vec3{0.0, 0.0, 0.0};
-                    Vec4 base_color_factor = Vec4{1.0, 1.0, 1.0, 1.0};
-                    double metallic_factor = 0.5;
-                    double roughness_factor = 0.5;
-                    double alpha_cutoff = 0.5;
-                    bool double_sided = true;
-                    if (static_cast<size_t>(primitive.material) <
-                        model.materials.size()) {
-                        if (buffer_texture_coords != nullptr) {
-                            texture_id = model.materials[primitive.material]
-                                             .pbrMetallicRoughness
-                                             .baseColorTexture.index;
-                            metallic_roughness_texture_id =
-                                model.materials[primitive.material]
-                                    .pbrMetallicRoughness
-                                    .metallicRoughnessTexture.index;
-                            base_color_factor = make_vec4(
-                                model.materials[primitive.material]
-                                    .pbrMetallicRoughness.baseColorFactor);
-                        }
-                        emissive_factor = make_vec3(
-                            model.materials[primitive.material].emissiveFactor);
-                        metallic_factor =
-                            model.materials[primitive.material]
-                                .pbrMetallicRoughness.metallicFactor;
-                        roughness_factor =
-                            model.materials[primitive.material]
-                                .pbrMetallicRoughness.roughnessFactor;
-                        alpha_cutoff =
-                            model.materials[primitive.material].alphaCutoff;
-                        double_sided =
-                            model.materials[primitive.material].doubleSided;
-                    }
-                    Triangle triangle{v1,
-                                      v2,
-                                      v3,
-                                      uv1,
-                                      uv2,
-                                      uv3,
-                                      texture_id,
-                                      metallic_roughness_texture_id,
-                                      metallic_factor,
-                                      roughness_factor,
-                                      alpha_cutoff,
-                                      double_sided,
-                                      emissive_factor,
-                                      base_color_factor};
-                    new_node.primitives.emplace_back(triangle);
-                }
-            }
+uint32_t read_index(const unsigned char *indices, int component_type,
+                    size_t i) {
+    switch (component_type) {
+    case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT: {
+        uint32_t index;
+        memcpy(&index, indices + i * sizeof(uint32_t), sizeof(uint32_t));
+        return index;
+    }
+    case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT: {
+        uint16_t index;
+        memcpy(&index, indices + i * sizeof(uint16_t), sizeof(uint16_t));
+        return index;
+    }
+    default:
+        return indices[i];
+    }
+}
+
+// A triangle with only the material of primitive filled in
+TriangleForGLSL get_material(const tinygltf::Primitive &primitive,
+                             const tinygltf::Model &model, bool has_uvs) {
+    TriangleForGLSL triangle = TriangleForGLSL{};
+    triangle.texture_id = std::numeric_limits<uint32_t>::max();
+    triangle.metallic_roughness_texture_id =
+        std::numeric_limits<uint32_t>::max();
+    triangle.emissive_factor = PaddedVec3ForGLSL{0.0f, 0.0f, 0.0f, 0};
+    triangle.base_color_factor = Vec4ForGLSL{1.0f, 1.0f, 1.0f, 1.0f};
+    triangle.metallic_factor = 0.5f;
+    triangle.roughness_factor = 0.5f;
+    triangle.alpha_cutoff = 0.5f;
+    triangle.double_sided = true;
+    if (static_cast<size_t>(primitive.material) >= model.materials.size()) {
+        return triangle;
+    }
+    const tinygltf::Material &material = model.materials[primitive.material];
+    const tinygltf::PbrMetallicRoughness &pbr = material.pbrMetallicRoughness;
+    if (has_uvs) {
+        triangle.texture_id = pbr.baseColorTexture.index;
+        triangle.metallic_roughness_texture_id =
+            pbr.metallicRoughnessTexture.index;
+        triangle.base_color_factor = Vec4ForGLSL{
+            static_cast<float>(pbr.baseColorFactor[0]),
+            static_cast<float>(pbr.baseColorFactor[1]),
+            static_cast<float>(pbr.baseColorFactor[2]),
+            static_cast<float>(pbr.baseColorFactor[3])};
+    }
+    triangle.emissive_factor = PaddedVec3ForGLSL{
+        static_cast<float>(material.emissiveFactor[0]),
+        static_cast<float>(material.emissiveFactor[1]),
+        static_cast<float>(material.emissiveFactor[2]), 0};
+    triangle.metallic_factor = pbr.metallicFactor;
+    triangle.roughness_factor = pbr.roughnessFactor;
+    triangle.alpha_cutoff = material.alphaCutoff;
+    triangle.double_sided = material.doubleSided;
+    return triangle;
+}
+
+// Decodes straight from the buffers' floats into the layout the shader
+// reads, the positions stay in the node's space
+void decode_chunk(const PrimitiveChunk &chunk, const tinygltf::Model &model,
+                  const std::vector<const unsigned char *> &buffers) {
+    const tinygltf::Primitive &primitive = *chunk.primitive;
+    const tinygltf::Accessor &accessor =
+        model.accessors[primitive.attributes.at("POSITION")];
+    const tinygltf::BufferView &buffer_view =
+        model.bufferViews[accessor.bufferView];
+    const float *positions = reinterpret_cast<const float *>(
+        buffers[buffer_view.buffer] + buffer_view.byteOffset +
+        accessor.byteOffset);
+
+    const float *texture_coords = nullptr;
+    auto uv_attribute = primitive.attributes.find("TEXCOORD_0");
+    if (uv_attribute != primitive.attributes.end()) {
+        const tinygltf::Accessor &uv_accessor =
+            model.accessors[uv_attribute->second];
+        const tinygltf::BufferView &uv_view =
+            model.bufferViews[uv_accessor.bufferView];
+        texture_coords = reinterpret_cast<const float *>(
+            buffers[uv_view.buffer] + uv_accessor.byteOffset +
+            uv_view.byteOffset);
+    }
+
+    const tinygltf::Accessor &index_accessor =
+        model.accessors[primitive.indices];
+    const tinygltf::BufferView &index_view =
+        model.bufferViews[index_accessor.bufferView];
+    const unsigned char *indices = buffers[index_view.buffer] +
+                                   index_accessor.byteOffset +
+                                   index_view.byteOffset;
+
+    TriangleForGLSL material =
+        get_material(primitive, model, texture_coords != nullptr);
+    for (size_t i = 0; i < chunk.count; i++) {
+        TriangleForGLSL &triangle = chunk.out[i];
+        triangle = material;
+        PaddedVec3ForGLSL *vertices[3] = {&triangle.v1, &triangle.v2,
+                                          &triangle.v3};
+        Vec2ForGLSL *uvs[3] = {&triangle.uv1, &triangle.uv2, &triangle.uv3};
+        for (int corner = 0; corner < 3; corner++) {
+            uint32_t index = read_index(indices, index_accessor.componentType,
+                                        3 * (chunk.first + i) + corner);
+            const float *position = positions + 3 * index;
+            *vertices[corner] =
+                PaddedVec3ForGLSL{position[0], position[1], position[2], 0};
+            *uvs[corner] = texture_coords == nullptr
+                               ? Vec2ForGLSL{0.0f, 0.0f}
+                               : Vec2ForGLSL{texture_coords[2 * index],
+                                             texture_coords[2 * index + 1]};
         }
+        triangle.min = v3_min(triangle.v1, triangle.v2, triangle.v3);
+        triangle.max = v3_max(triangle.v1, triangle.v2, triangle.v3);
     }
-    parent->children.emplace_back(new_node);
 }
 
-OurNode load_model(std::string filename) {
-    tinygltf::Model gltf_model;
-    tinygltf::TinyGLTF loader;
+void decode_primitives(ThreadPool &pool, OurNode &root,
+                       const tinygltf::Model &model,
+                       const std::vector<const unsigned char *> &buffers) {
+    std::vector<PrimitiveChunk> chunks;
+    collect_primitive_chunks(root, model, chunks);
+    parallel_for(pool, 0, chunks.size(), 1, [&](int start, int end) {
+        for (int i = start; i < end; i++) {
+            decode_chunk(chunks[i], model, buffers);
+        }
+    });
+}
+
+// The node the scene nodes of a model are added to
+OurNode make_root_node() {
     OurNode root_node{};
+    root_node.translation = Vec3{0.0f, 0.0f, -0.0f};
+    root_node.scale = Vec3{1.0f, 1.0f, 1.0f};
+    root_node.rotation = Vec4{0.0f, 0.0f, 0.0f, 0.0f};
+    root_node.matrix = compose_matrix(root_node.translation, root_node.rotation,
+                                      root_node.scale);
+    return root_node;
+}
 
+// Parses filename into gltf_model, a .glb through glb so its geometry
+// stays in the mapped file
+void read_gltf(const std::string &filename, tinygltf::Model &gltf_model,
+               MappedGlb &glb) {
+    tinygltf::TinyGLTF loader;
     std::string err;
     std::string warn;
     bool file_loaded;
     if (filename.substr(filename.size() - 4) != ".glb") {
         file_loaded =
             loader.LoadASCIIFromFile(&gltf_model, &err, &warn, filename);
-        if (gltf_model.images.size() == 0) {
-        } else
-            for (auto &image : gltf_model.images) {
-                root_node.images.emplace_back(image);
-            }
     } else {
         file_loaded =
-            loader.LoadBinaryFromFile(&gltf_model, &err, &warn, filename);
-        if (gltf_model.images.size() == 0) {
-        } else
-            for (auto &image : gltf_model.images) {
-                root_node.images.emplace_back(image);
-            }
+            load_mapped_glb(loader, &gltf_model, glb, &err, &warn, filename);
     }
     if (!warn.empty()) {
-        printf("Warn: %s\n", warn.c_str());
+        fprintf(stderr, "Warn: %s\n", warn.c_str());
     }
     if (!err.empty()) {
         throw std::runtime_error(err.c_str());
@@ -429,23 +462,32 @@ OurNode load_model(std::string filename) {
     if (!file_loaded) {
         throw std::runtime_error("Failed to parse glTF");
     }
+}
 
-    const tinygltf::Scene &scene =
-        gltf_model
-            .scenes[gltf_model.defaultScene > -1 ? gltf_model.defaultScene : 0];
+const tinygltf::Scene &get_scene(const tinygltf::Model &gltf_model) {
+    return gltf_model
+        .scenes[gltf_model.defaultScene > -1 ? gltf_model.defaultScene : 0];
+}
 
-    float scale = 1.0f;
+OurNode load_model(std::string filename, bool share_meshes) {
+    tinygltf::Model gltf_model;
+    OurNode root_node = make_root_node();
 
-    root_node.translation = Vec3{0.0f, 0.0f, -0.0f};
-    root_node.scale = Vec3{1.0f, 1.0f, 1.0f};
-    root_node.rotation = Vec4{0.0f, 0.0f, 0.0f, 0.0f};
-    root_node.matrix = compose_matrix(root_node.translation, root_node.rotation,
-                                      root_node.scale);
+    // Keeps the BIN chunk of a .glb mapped until the triangles are decoded
+    MappedGlb glb;
+    read_gltf(filename, gltf_model, glb);
+    for (auto &image : gltf_model.images) {
+        root_node.images.emplace_back(image);
+    }
 
-    for (const auto &node_idx : scene.nodes) {
-        const tinygltf::Node node = gltf_model.nodes[node_idx];
-        load_node(&root_node, node, gltf_model, scale);
+    float scale = 1.0f;
+    std::vector<bool> sized_meshes(gltf_model.meshes.size(), false);
+    for (const auto &node_idx : get_scene(gltf_model).nodes) {
+        load_node(&root_node, gltf_model.nodes[node_idx], gltf_model, scale,
+                  share_meshes ? &sized_meshes : nullptr);
     }
+    decode_primitives(get_thread_pool(), root_node, gltf_model,
+                      get_buffer_data(gltf_model, glb));
 
 #ifdef DEBUG_PRINT
     std::cout << "[" << std::endl;
@@ -456,6 +498,75 @@ OurNode load_model(std::string filename) {
     return root_node;
 }
 
+// Decodes the primitives of node and then of its children into chunk, one
+// chunk at a time, and hands them to sink in world space. matrices holds
+// the matrices of node's parents, the model's root first; they are applied
+// one after another like flatten_node does so the triangles come out the
+// same
+void load_node_chunks(const tinygltf::Node &node,
+                      const tinygltf::Model &model,
+                      const std::vector<const unsigned char *> &buffers,
+                      std::vector<Matrix4> &matrices,
+                      std::vector<TriangleForGLSL> &chunk,
+                      const TriangleSink &sink) {
+    OurNode transform{};
+    load_transform(transform, node);
+    matrices.push_back(transform.matrix);
+    if (node.mesh > -1) {
+        for (const auto &primitive : model.meshes[node.mesh].primitives) {
+            size_t triangle_count =
+                count_primitive_triangles(primitive, model, true);
+            for (size_t first = 0; first < triangle_count;
+                 first += LOAD_CHUNK_TRIANGLES) {
+                PrimitiveChunk part = PrimitiveChunk{
+                    chunk.data(), &primitive, first,
+                    std::min(LOAD_CHUNK_TRIANGLES, triangle_count - first)};
+                decode_chunk(part, model, buffers);
+                for (size_t i = 0; i < part.count; i++) {
+                    for (auto matrix = matrices.rbegin();
+                         matrix != matrices.rend(); matrix++) {
+                        chunk[i] = transform_triangle(chunk[i], *matrix);
+                    }
+                }
+                sink(chunk.data(), part.count);
+            }
+        }
+    }
+    for (const auto &child : node.children) {
+        load_node_chunks(model.nodes[child], model, buffers, matrices, chunk,
+                         sink);
+    }
+    matrices.pop_back();
+}
+
+size_t load_model_chunks(const std::string &filename,
+                         std::vector<tinygltf::Image> &images,
+                         const TriangleSink &sink) {
+    tinygltf::Model gltf_model;
+    MappedGlb glb;
+    read_gltf(filename, gltf_model, glb);
+
+    size_t held_bytes = 0;
+    for (auto &image : gltf_model.images) {
+        held_bytes += image.image.size();
+        images.push_back(std::move(image));
+    }
+    // Empty for the BIN chunk of a mapped .glb
+    for (const auto &buffer : gltf_model.buffers) {
+        held_bytes += buffer.data.size();
+    }
+
+    std::vector<const unsigned char *> buffers =
+        get_buffer_data(gltf_model, glb);
+    std::vector<Matrix4> matrices = {make_root_node().matrix};
+    std::vector<TriangleForGLSL> chunk(LOAD_CHUNK_TRIANGLES);
+    for (const auto &node_idx : get_scene(gltf_model).nodes) {
+        load_node_chunks(gltf_model.nodes[node_idx], gltf_model, buffers,
+                         matrices, chunk, sink);
+    }
+    return held_bytes;
+}
+
 Vec3 add_vec3(const Vec3 &vec1, const Vec3 &vec2) {
     return Vec3{vec1.x + vec2.x, vec1.y + vec2.y, vec1.z + vec2.z};
 }
@@ -499,60 +610,123 @@ PaddedVec3ForGLSL v3_max(const PaddedVec3ForGLSL &v1,
                              std::max(v1.z, std::max(v2.z, v3.z)), 0};
 }
 
-std::vector<TriangleForGLSL *> node_to_triangles(const OurNode &node) {
-    std::vector<TriangleForGLSL *> triangles = {};
+TriangleForGLSL transform_triangle(const TriangleForGLSL &triangle,
+                                   const Matrix4 &matrix) {
+    TriangleForGLSL transformed = triangle;
+    transformed.v1 = transform4(matrix, triangle.v1);
+    transformed.v2 = transform4(matrix, triangle.v2);
+    transformed.v3 = transform4(matrix, triangle.v3);
+    transformed.min = v3_min(transformed.v1, transformed.v2, transformed.v3);
+    transformed.max = v3_max(transformed.v1, transformed.v2, transformed.v3);
+    return transformed;
+}
+
+size_t count_triangles(const OurNode &node) {
+    size_t count = node.primitives.size();
+    for (const auto &child : node.children) {
+        count += count_triangles(child);
+    }
+    return count;
+}
+
+// Writes the triangles of node and its children to out, each transformed
+// by its own node's matrix and then by every parent's in turn. Returns how
+// many were written
+size_t flatten_node(const OurNode &node, TriangleForGLSL *out) {
+    size_t count = 0;
     for (const auto &primitive : node.primitives) {
-        PaddedVec3ForGLSL v1_transformed =
-            transform4(node.matrix, primitive.v1);
-        PaddedVec3ForGLSL v2_transformed =
-            transform4(node.matrix, primitive.v2);
-        PaddedVec3ForGLSL v3_transformed =
-            transform4(node.matrix, primitive.v3);
-        PaddedVec3ForGLSL min_transformed =
-            v3_min(v1_transformed, v2_transformed, v3_transformed);
-        PaddedVec3ForGLSL max_transformed =
-            v3_max(v1_transformed, v2_transformed, v3_transformed);
-        Vec2ForGLSL uv1 = Vec2ForGLSL{static_cast<float>(primitive.uv1.x),
-                                      static_cast<float>(primitive.uv1.y)};
-        Vec2ForGLSL uv2 = Vec2ForGLSL{static_cast<float>(primitive.uv2.x),
-                                      static_cast<float>(primitive.uv2.y)};
-        Vec2ForGLSL uv3 = Vec2ForGLSL{static_cast<float>(primitive.uv3.x),
-                                      static_cast<float>(primitive.uv3.y)};
-        uint32_t texture_id = primitive.texture_id;
-        uint32_t metallic_roughness_texture_id =
-            primitive.metallic_roughness_texture_id;
-        float metallic_factor = static_cast<float>(primitive.metallic_factor);
-        float roughness_factor = static_cast<float>(primitive.roughness_factor);
-        float alpha_cutoff = static_cast<float>(primitive.alpha_cutoff);
-        uint32_t double_sided = static_cast<uint32_t>(primitive.double_sided);
-        PaddedVec3ForGLSL emissive_factor = PaddedVec3ForGLSL{
-            static_cast<float>(primitive.emissive_factor.x),
-            static_cast<float>(primitive.emissive_factor.y),
-            static_cast<float>(primitive.emissive_factor.z), 0};
-        Vec4ForGLSL base_color_factor =
-            Vec4ForGLSL{static_cast<float>(primitive.base_color_factor.x),
-                        static_cast<float>(primitive.base_color_factor.y),
-                        static_cast<float>(primitive.base_color_factor.z),
-                        static_cast<float>(primitive.base_color_factor.w)};
-        triangles.emplace_back(new TriangleForGLSL{
-            v1_transformed, v2_transformed, v3_transformed, min_transformed,
-            max_transformed, uv1, uv2, uv3, texture_id,
-            metallic_roughness_texture_id, metallic_factor, roughness_factor,
-            alpha_cutoff, double_sided, emissive_factor, base_color_factor});
+        out[count++] = transform_triangle(primitive, node.matrix);
     }
     for (const auto &child : node.children) {
-        std::vector<TriangleForGLSL *> new_triangles = node_to_triangles(child);
-        for (auto &triangle : new_triangles) {
-            triangle->v1 = transform4(node.matrix, triangle->v1);
-            triangle->v2 = transform4(node.matrix, triangle->v2);
-            triangle->v3 = transform4(node.matrix, triangle->v3);
-            triangle->min = v3_min(triangle->v1, triangle->v2, triangle->v3);
-            triangle->max = v3_max(triangle->v1, triangle->v2, triangle->v3);
+        size_t child_count = flatten_node(child, out + count);
+        for (size_t i = count; i < count + child_count; i++) {
+            out[i] = transform_triangle(out[i], node.matrix);
+        }
+        count += child_count;
+    }
+    return count;
+}
+
+TriangleArena::TriangleArena(size_t count)
+    : triangles(new TriangleForGLSL[count]), count(count) {}
+
+std::vector<TriangleForGLSL *> TriangleArena::get_pointers() {
+    std::vector<TriangleForGLSL *> pointers(count);
+    for (size_t i = 0; i < count; i++) {
+        pointers[i] = &triangles[i];
+    }
+    return pointers;
+}
+
+void TriangleArena::reorder(std::vector<TriangleForGLSL *> &pointers,
+                            size_t start, size_t end) {
+    // Follows every cycle of the permutation with one triangle in hand, a
+    // pointer that points to its own slot marks the slot as done
+    for (size_t i = start; i < end; i++) {
+        if (pointers[i] == &triangles[i]) {
+            continue;
+        }
+        TriangleForGLSL first = triangles[i];
+        size_t slot = i;
+        while (true) {
+            size_t from = pointers[slot] - triangles.get();
+            pointers[slot] = &triangles[slot];
+            if (from == i) {
+                triangles[slot] = first;
+                break;
+            }
+            triangles[slot] = triangles[from];
+            slot = from;
+        }
+    }
+}
+
+TriangleArena flatten_model(const OurNode &model) {
+    TriangleArena arena(count_triangles(model));
+    flatten_node(model, arena.data());
+    return arena;
+}
+
+TriangleArena flatten_models(ThreadPool &pool, std::vector<OurNode> &models,
+                             std::vector<size_t> &model_starts) {
+    model_starts.clear();
+    size_t count = 0;
+    for (const auto &model : models) {
+        model_starts.push_back(count);
+        count += count_triangles(model);
+    }
+    TriangleArena arena(count);
+    parallel_for(pool, 0, models.size(), 1, [&](int start, int end) {
+        for (int i = start; i < end; i++) {
+            flatten_node(models[i], arena.data() + model_starts[i]);
+            std::vector<TriangleForGLSL>().swap(models[i].primitives);
+            std::vector<OurNode>().swap(models[i].children);
+        }
+    });
+    return arena;
+}
+
+std::vector<OurNode> load_models(ThreadPool &pool,
+                                 const std::vector<std::string> &paths,
+                                 bool share_meshes) {
+    std::vector<OurNode> models(paths.size());
+    std::vector<std::exception_ptr> errors(paths.size());
+    TaskGroup group;
+    TaskGroupGuard guard(pool, group);
+    for (size_t i = 0; i < paths.size(); i++) {
+        pool.submit(group, [&, i] {
+            try {
+                models[i] = load_model(paths[i], share_meshes);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    pool.wait(group);
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
         }
-        triangles.reserve(triangles.size() + new_triangles.size());
-        triangles.insert(triangles.end(),
-                         std::make_move_iterator(new_triangles.begin()),
-                         std::make_move_iterator(new_triangles.end()));
     }
-    return triangles;
+    return models;
 }
@@ -6,22 +6,62 @@
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 // #define DEBUG_PRINT
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 
 #include "./aabb.hpp"
+#include "./bvh_cache.hpp"
+#include "./bvh_stats.hpp"
+#include "./compressed_bvh.hpp"
 #include "./controls.hpp"
+#include "./cost_model.hpp"
+#include "./depth_first.hpp"
+#include "./dynamic_bvh.hpp"
+#include "./leaf_triangles.hpp"
 #include "./load_model.hpp"
+#include "./out_of_core.hpp"
+#include "./progressive.hpp"
+#include "./refit.hpp"
+#include "./sbvh.hpp"
+#include "./thread_pool.hpp"
+#include "./threaded_bvh.hpp"
+#include "./treelet.hpp"
+#include "./triangle_pairs.hpp"
+#include "./two_level.hpp"
 #include "./use_opengl.h"
+#include "./wide_bvh.hpp"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
 void framebuffer_size_callback(GLFWwindow *window, int width, int height);
 void process_input(GLFWwindow *window);
 
+// Lines typed on stdin while the window is open, see `--live`
+struct LiveCommands {
+    std::mutex mutex;
+    std::vector<std::string> lines;
+};
+void read_live_commands(LiveCommands *commands);
+void run_live_command(const std::string &line, DynamicScene &scene);
+bool run_move_command(const std::string &line, MovableScene &scene);
+void upload_dirty_ranges(GLuint buffer, size_t &capacity, const void *data,
+                         size_t element_size, size_t count,
+                         const std::vector<DirtyRange> &ranges);
+
 // settings
 const unsigned int SCR_WIDTH = 500;
 const unsigned int SCR_HEIGHT = 500;
@@ -43,11 +83,41 @@ const char *read_shader(std::string filename) {
     return cstr;
 }
 
+// Unlike std::stod, the whole text has to be the number and bad input gives
+// false instead of an exception
+bool parse_number(const std::string &text, double &value) {
+    char *end = nullptr;
+    value = std::strtod(text.c_str(), &end);
+    return !text.empty() && *end == '\0' && std::isfinite(value);
+}
+
+// Only digits, so that "-1" isn't wrapped around
+bool parse_count(const std::string &text, size_t &value) {
+    if (text.empty() ||
+        text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    errno = 0;
+    unsigned long long count = std::strtoull(text.c_str(), nullptr, 10);
+    value = count;
+    return errno == 0 && count <= SIZE_MAX;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
-        std::cout << "Usage: " << argv[0]
+        std::cerr << "Usage: " << argv[0]
                   << " <shader file> [<gltf_file>...] [<glb_file>...] ... "
-                     "[mode=<mouse|arrows>] "
+                     "[mode=<mouse|arrows>] [sky=<file>] [bvh=<median|sah|lbvh|sbvh>] "
+                     "[sbvh_budget=<fraction>] "
+                     "[nodes=<binary|bvh4|bvh8|compressed8|compressed16|"
+                     "depth_first>] "
+                     "[threads=<count>] [scene=<flat|two_level>] "
+                     "[treelet_budget=<milliseconds>] [--bvh-stats[=<file>]] "
+                     "[cache=<file>] [cost=<gpu|cpu|calibrate>] "
+                     "[max_leaf=<count>] [--live] "
+                     "[memory_budget=<megabytes>] [--threaded] "
+                     "[triangles=<full|woop>] [leaves=<triangles|pairs>] "
+                     "[--progressive] [--movable] "
                   << std::endl;
         return 1;
     }
@@ -59,38 +129,350 @@ int main(int argc, char *argv[]) {
     auto start_model = std::chrono::high_resolution_clock::now();
 #endif
     std::string sky_path = "";
-    std::string last_arg = argv[argc - 1];
     int mode = MODE_MOUSE;
-    if (last_arg.find("mode=") != std::string::npos) {
+    int bvh_strategy = BVH_SAH;
+    float sbvh_budget = SBVH_DEFAULT_BUDGET;
+    int node_layout = NODES_BINARY;
+    bool two_level = false;
+    double treelet_budget = 0;
+    bool bvh_stats = false;
+    std::string bvh_stats_path = "";
+    std::string cache_path = "";
+    int cost_backend = COST_GPU;
+    bool calibrate = false;
+    int max_leaf_size = get_default_cost_model(COST_GPU).max_leaf_size;
+    bool live = false;
+    size_t memory_budget = 0;
+    bool threaded = false;
+    int leaf_triangle_format = LEAF_TRIANGLES_FULL;
+    int leaf_primitives = LEAVES_TRIANGLES;
+    bool progressive = false;
+    bool movable = false;
+    // Options come after all the models, in any order
+    while (argc > 2) {
+        std::string last_arg = argv[argc - 1];
+        if (last_arg.rfind("mode=", 0) == 0) {
+            if (last_arg.substr(5) == "arrows") {
+                mode = MODE_ARROWS;
+            }
+        } else if (last_arg.rfind("sky=", 0) == 0) {
+            sky_path = last_arg.substr(4);
+        } else if (last_arg.rfind("bvh=", 0) == 0) {
+            if (last_arg.substr(4) == "median") {
+                bvh_strategy = BVH_MEDIAN;
+            } else if (last_arg.substr(4) == "sah") {
+                bvh_strategy = BVH_SAH;
+            } else if (last_arg.substr(4) == "lbvh") {
+                bvh_strategy = BVH_LBVH;
+            } else if (last_arg.substr(4) == "sbvh") {
+                bvh_strategy = BVH_SBVH;
+            } else {
+                std::cerr << "Unknown BVH builder: " << last_arg.substr(4)
+                          << std::endl;
+                return 1;
+            }
+        } else if (last_arg.rfind("nodes=", 0) == 0) {
+            if (last_arg.substr(6) == "binary") {
+                node_layout = NODES_BINARY;
+            } else if (last_arg.substr(6) == "bvh4") {
+                node_layout = NODES_BVH4;
+            } else if (last_arg.substr(6) == "bvh8") {
+                node_layout = NODES_BVH8;
+            } else if (last_arg.substr(6) == "compressed8") {
+                node_layout = NODES_COMPRESSED8;
+            } else if (last_arg.substr(6) == "compressed16") {
+                node_layout = NODES_COMPRESSED16;
+            } else if (last_arg.substr(6) == "depth_first") {
+                node_layout = NODES_DEPTH_FIRST;
+            } else {
+                std::cerr << "Unknown node layout: " << last_arg.substr(6)
+                          << std::endl;
+                return 1;
+            }
+        } else if (last_arg.rfind("sbvh_budget=", 0) == 0) {
+            double budget;
+            if (!parse_number(last_arg.substr(12), budget) || budget < 0 ||
+                budget > SBVH_MAX_BUDGET) {
+                std::cerr << "Invalid SBVH budget: " << last_arg.substr(12)
+                          << ", expected a fraction from 0 to "
+                          << SBVH_MAX_BUDGET << std::endl;
+                return 1;
+            }
+            sbvh_budget = budget;
+        } else if (last_arg.rfind("threads=", 0) == 0) {
+            size_t thread_count;
+            if (!parse_count(last_arg.substr(8), thread_count)) {
+                std::cerr << "Invalid thread count: " << last_arg.substr(8)
+                          << std::endl;
+                return 1;
+            }
+            set_thread_count(thread_count);
+        } else if (last_arg == "--bvh-stats") {
+            bvh_stats = true;
+        } else if (last_arg.rfind("--bvh-stats=", 0) == 0) {
+            bvh_stats = true;
+            bvh_stats_path = last_arg.substr(12);
+        } else if (last_arg.rfind("cost=", 0) == 0) {
+            if (last_arg.substr(5) == "gpu") {
+                cost_backend = COST_GPU;
+            } else if (last_arg.substr(5) == "cpu") {
+                cost_backend = COST_CPU;
+            } else if (last_arg.substr(5) == "calibrate") {
+                calibrate = true;
+            } else {
+                std::cerr << "Unknown cost model: " << last_arg.substr(5)
+                          << std::endl;
+                return 1;
+            }
+        } else if (last_arg.rfind("max_leaf=", 0) == 0) {
+            size_t leaf_size;
+            if (!parse_count(last_arg.substr(9), leaf_size)) {
+                std::cerr << "Invalid leaf size: " << last_arg.substr(9)
+                          << std::endl;
+                return 1;
+            }
+            // Compressed nodes store leaf sizes in a byte
+            max_leaf_size =
+                std::min<size_t>(std::max<size_t>(leaf_size, 1), 255);
+        } else if (last_arg.rfind("memory_budget=", 0) == 0) {
+            size_t megabytes;
+            if (!parse_count(last_arg.substr(14), megabytes) ||
+                megabytes > SIZE_MAX >> 20) {
+                std::cerr << "Invalid memory budget: " << last_arg.substr(14)
+                          << std::endl;
+                return 1;
+            }
+            memory_budget = megabytes << 20;
+        } else if (last_arg.rfind("triangles=", 0) == 0) {
+            if (last_arg.substr(10) == "full") {
+                leaf_triangle_format = LEAF_TRIANGLES_FULL;
+            } else if (last_arg.substr(10) == "woop") {
+                leaf_triangle_format = LEAF_TRIANGLES_WOOP;
+            } else {
+                std::cerr << "Unknown triangle format: " << last_arg.substr(10)
+                          << std::endl;
+                return 1;
+            }
+        } else if (last_arg.rfind("leaves=", 0) == 0) {
+            if (last_arg.substr(7) == "triangles") {
+                leaf_primitives = LEAVES_TRIANGLES;
+            } else if (last_arg.substr(7) == "pairs") {
+                leaf_primitives = LEAVES_PAIRS;
+            } else {
+                std::cerr << "Unknown leaf primitive: " << last_arg.substr(7)
+                          << std::endl;
+                return 1;
+            }
+        } else if (last_arg == "--threaded") {
+            threaded = true;
+        } else if (last_arg == "--progressive") {
+            progressive = true;
+        } else if (last_arg == "--movable") {
+            movable = true;
+        } else if (last_arg == "--live") {
+            live = true;
+        } else if (last_arg.rfind("cache=", 0) == 0) {
+            cache_path = last_arg.substr(6);
+        } else if (last_arg.rfind("treelet_budget=", 0) == 0) {
+            if (!parse_number(last_arg.substr(15), treelet_budget)) {
+                std::cerr << "Invalid treelet budget: "
+                          << last_arg.substr(15) << std::endl;
+                return 1;
+            }
+        } else if (last_arg.rfind("scene=", 0) == 0) {
+            if (last_arg.substr(6) == "flat") {
+                two_level = false;
+            } else if (last_arg.substr(6) == "two_level") {
+                two_level = true;
+            } else {
+                std::cerr << "Unknown scene layout: " << last_arg.substr(6)
+                          << std::endl;
+                return 1;
+            }
+        } else {
+            break;
+        }
         argc--;
-        std::string mode_arg = last_arg.substr(5);
-        last_arg = argv[argc - 1];
-        if (mode_arg == "arrows") {
-            mode = MODE_ARROWS;
+    }
+
+    if (two_level && (bvh_strategy == BVH_SBVH || node_layout != NODES_BINARY)) {
+        std::cerr << "scene=two_level only supports binary nodes without "
+                     "split references, using bvh=sah nodes=binary"
+                  << std::endl;
+        bvh_strategy = BVH_SAH;
+        node_layout = NODES_BINARY;
+    }
+    if (live && (two_level || bvh_strategy == BVH_SBVH ||
+                 node_layout != NODES_BINARY || !cache_path.empty())) {
+        std::cerr << "--live only supports scene=flat with binary nodes "
+                     "without split references or a cache, using bvh=sah "
+                     "nodes=binary"
+                  << std::endl;
+        two_level = false;
+        bvh_strategy = BVH_SAH;
+        node_layout = NODES_BINARY;
+        cache_path = "";
+    }
+    if (threaded && (two_level || live)) {
+        std::cerr << "--threaded only works with a fixed scene=flat tree, "
+                     "leaving it out"
+                  << std::endl;
+        threaded = false;
+    }
+    if (leaf_triangle_format != LEAF_TRIANGLES_FULL && live) {
+        std::cerr << "--live keeps full triangles, using triangles=full"
+                  << std::endl;
+        leaf_triangle_format = LEAF_TRIANGLES_FULL;
+    }
+    if (leaf_primitives == LEAVES_PAIRS &&
+        (two_level || live || bvh_strategy == BVH_SBVH ||
+         !cache_path.empty() || leaf_triangle_format != LEAF_TRIANGLES_FULL)) {
+        std::cerr << "leaves=pairs only works with scene=flat, full triangles "
+                     "and without bvh=sbvh, --live or cache, using "
+                     "leaves=triangles"
+                  << std::endl;
+        leaf_primitives = LEAVES_TRIANGLES;
+    }
+    if (progressive &&
+        (two_level || live || bvh_strategy == BVH_SBVH ||
+         node_layout != NODES_BINARY || !cache_path.empty() ||
+         treelet_budget > 0 || threaded || bvh_stats ||
+         leaf_triangle_format != LEAF_TRIANGLES_FULL ||
+         leaf_primitives == LEAVES_PAIRS)) {
+        std::cerr << "--progressive only works with scene=flat, binary nodes, "
+                     "full triangles and without bvh=sbvh, --live, cache, "
+                     "treelet_budget, --threaded, --bvh-stats or leaves=pairs, "
+                     "building the whole tree first"
+                  << std::endl;
+        progressive = false;
+    }
+    if (movable &&
+        (two_level || live || progressive || bvh_strategy == BVH_SBVH ||
+         node_layout != NODES_BINARY || !cache_path.empty() || threaded ||
+         leaf_triangle_format != LEAF_TRIANGLES_FULL ||
+         leaf_primitives == LEAVES_PAIRS)) {
+        std::cerr << "--movable only works with scene=flat, binary nodes, "
+                     "full triangles and without bvh=sbvh, --live, "
+                     "--progressive, cache, --threaded or leaves=pairs, "
+                     "leaving it out"
+                  << std::endl;
+        movable = false;
+    }
+    if (memory_budget > 0) {
+        if (cache_path.empty()) {
+            std::cerr << "memory_budget= needs cache=<file> to write the tree "
+                         "to"
+                      << std::endl;
+            return 1;
         }
-        if(last_arg.find("sky=") != std::string::npos) {
-            argc--;
-            sky_path = last_arg.substr(4);
+        if (two_level || bvh_strategy == BVH_SBVH ||
+            treelet_budget > 0) {
+            std::cerr << "memory_budget= builds a flat scene without split "
+                         "references or treelet optimization, using "
+                         "scene=flat bvh=sah treelet_budget=0"
+                      << std::endl;
+            two_level = false;
+            bvh_strategy = BVH_SAH;
+            treelet_budget = 0;
         }
     }
-    else if(last_arg.find("sky=") != std::string::npos) {
-        argc--;
-        sky_path = last_arg.substr(4);
-    }
-    
-
-    for (int i = 2; i < argc; ++i) {
-        std::string path = argv[i];
-        OurNode model = load_model(path);
-        std::vector<TriangleForGLSL *> new_triangles = node_to_triangles(model);
-        triangles.reserve(triangles.size() + new_triangles.size());
-        triangles.insert(triangles.end(),
-                         std::make_move_iterator(new_triangles.begin()),
-                         std::make_move_iterator(new_triangles.end()));
-        for (size_t j = 0; j < model.images.size(); ++j) {
-            textures.emplace_back(model.images[j]);
+
+    CostModel cost_model = get_default_cost_model(cost_backend);
+    if (calibrate) {
+        cost_model = calibrate_cost_model();
+        std::cerr << "Calibrated cost model: traversal "
+                  << cost_model.traversal << ", intersection "
+                  << cost_model.intersection << std::endl;
+    }
+    cost_model.max_leaf_size = max_leaf_size;
+    set_cost_model(cost_model);
+
+    // A cache hit skips loading the models and building the tree
+    std::unique_ptr<BvhCache> cache;
+    uint64_t cache_key = 0;
+    if (!cache_path.empty() && !two_level) {
+        std::vector<std::string> model_paths(argv + 2, argv + argc);
+        std::string settings =
+            "bvh=" + std::to_string(bvh_strategy) +
+            " sbvh_budget=" + std::to_string(sbvh_budget) +
+            " treelet_budget=" + std::to_string(treelet_budget) +
+            " cost=" + std::to_string(cost_model.traversal) + "," +
+            std::to_string(cost_model.intersection) + "," +
+            std::to_string(max_leaf_size) +
+            " memory_budget=" + std::to_string(memory_budget);
+        // Reads every model file, so a missing one is reported here
+        try {
+            cache_key = hash_scene(model_paths, settings);
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << std::endl;
+            return 1;
+        }
+        cache = open_bvh_cache(cache_path, cache_key);
+        // Out of core the tree goes straight into the cache file, which is
+        // then used as if it had been there already
+        if (!cache && memory_budget > 0) {
+            std::vector<tinygltf::Image> build_textures;
+            try {
+                build_out_of_core(model_paths, cache_path, cache_key,
+                                  memory_budget, bvh_strategy, build_textures);
+            } catch (const std::exception &error) {
+                std::cerr << error.what() << std::endl;
+                return 1;
+            }
+            cache = open_bvh_cache(cache_path, cache_key);
+            if (!cache) {
+                std::cerr << "Can't read back " << cache_path << std::endl;
+                return 1;
+            }
+        }
+        if (cache) {
+            textures.swap(cache->textures);
         }
     }
+
+    // Either the triangles of every instance baked into world space, or
+    // each mesh once with a tree per mesh and one over the instances
+    TwoLevelScene scene;
+    // The flat scene's triangles, triangles points into it. It is put into
+    // the order of the leaves before it is uploaded
+    TriangleArena arena;
+    // Where every file's triangles start in the arena, so --live can remove
+    // them again
+    std::vector<size_t> model_starts;
+    // Every file is loaded on its own worker, then merged in the order
+    // given
+    std::vector<OurNode> models;
+    // The glTF nodes of the flat scene with their local triangles, so
+    // --movable can transform them again and refit the tree
+    MovableScene movable_scene;
+    if (!cache) {
+        try {
+            models = load_models(
+                get_thread_pool(),
+                std::vector<std::string>(argv + 2, argv + argc), two_level);
+        } catch (const std::exception &error) {
+            std::cerr << error.what() << std::endl;
+            return 1;
+        }
+    }
+    for (auto &model : models) {
+        textures.insert(textures.end(),
+                        std::make_move_iterator(model.images.begin()),
+                        std::make_move_iterator(model.images.end()));
+        if (two_level) {
+            add_two_level_model(scene, model, bvh_strategy);
+        }
+    }
+    if (movable) {
+        for (const auto &model : models) {
+            add_movable_model(movable_scene, model);
+        }
+    }
+    if (!two_level && !cache) {
+        arena = flatten_models(get_thread_pool(), models, model_starts);
+        triangles = arena.get_pointers();
+    }
+    models.clear();
     OurNode sky_model;
     if(sky_path!="") {
         sky_model = load_model(sky_path);
@@ -98,7 +480,7 @@ int main(int argc, char *argv[]) {
     }
 #ifdef DEBUG_PRINT
     auto end_model = std::chrono::high_resolution_clock::now();
-    std::cout << "Model loading took "
+    std::cerr << "Model loading took "
               << std::chrono::duration_cast<std::chrono::milliseconds>(
                      end_model - start_model)
                      .count()
@@ -109,10 +491,7 @@ int main(int argc, char *argv[]) {
     std::cout << "[" << std::endl;
     for (auto &t : triangles) {
         std::cout << "  ";
-        Triangle triangle = Triangle{Vec3{t->v1.x, t->v1.y, t->v1.z},
-                                     Vec3{t->v2.x, t->v2.y, t->v2.z},
-                                     Vec3{t->v3.x, t->v3.y, t->v3.z}};
-        print_triangle(triangle);
+        print_triangle(*t);
     }
     std::cout << "]" << std::endl;
 #endif
@@ -121,10 +500,76 @@ int main(int argc, char *argv[]) {
     auto start_aabb = std::chrono::high_resolution_clock::now();
 #endif
     std::vector<Box> boxes;
-    AABB *aabb = triangles_to_aabb(boxes, triangles, 0, triangles.size(), 0);
+    // Only filled by the split BVH, whose leaves index this array instead of
+    // the triangles
+    std::vector<int> triangle_indices;
+    // Only filled with leaves=pairs, the leaves then reference these and
+    // the triangles stay in the order they were loaded in
+    std::vector<TrianglePair> triangle_pairs;
+    AABB *aabb;
+    if (cache) {
+        boxes.assign(cache->boxes, cache->boxes + cache->box_count);
+        triangle_indices.assign(cache->triangle_indices,
+                                cache->triangle_indices + cache->index_count);
+        aabb = new AABB{cache->root_id};
+    } else if (two_level) {
+        build_tlas(scene, bvh_strategy);
+        aabb = new AABB{scene.tlas_root_id};
+    } else if (leaf_primitives == LEAVES_PAIRS) {
+        triangle_pairs = pair_triangles(triangles);
+        aabb = triangle_pairs_to_aabb(boxes, triangle_pairs, bvh_strategy);
+        std::cerr << "Paired " << triangles.size() << " triangles into "
+                  << triangle_pairs.size() << " leaf primitives" << std::endl;
+    } else if (bvh_strategy == BVH_SBVH) {
+        aabb = triangles_to_indexed_aabb(boxes, triangles, triangle_indices,
+                                         sbvh_budget);
+    } else if (progressive) {
+        // The real tree is built under every leaf of this one while the
+        // window is open
+        aabb = build_coarse_bvh(boxes, triangles);
+    } else {
+        aabb = triangles_to_aabb(boxes, triangles, 0, triangles.size(), 0,
+                                 bvh_strategy);
+    }
+    if (treelet_budget > 0 && !two_level && !cache) {
+        TreeletReport report = optimize_treelets(
+            get_thread_pool(), boxes, aabb->root_id, treelet_budget);
+        std::cerr << "Treelet optimization ran " << report.passes
+                  << (report.finished ? "" : " (out of time)")
+                  << " passes, SAH cost " << report.cost_before << " -> "
+                  << report.cost_after << std::endl;
+    }
+    if (!cache_path.empty() && !two_level && !cache) {
+        try {
+            write_bvh_cache(cache_path, cache_key, triangles, boxes,
+                            aabb->root_id, triangle_indices, textures);
+        } catch (const std::runtime_error &error) {
+            std::cerr << "Warning: " << error.what() << std::endl;
+        }
+    }
+    DynamicScene live_scene = DynamicScene{};
+    if (live) {
+        std::vector<int> triangle_models;
+        triangle_models.reserve(triangles.size());
+        for (auto triangle : triangles) {
+            size_t index = triangle - arena.data();
+            triangle_models.push_back(
+                std::upper_bound(model_starts.begin(), model_starts.end(),
+                                 index) -
+                model_starts.begin() - 1);
+        }
+        live_scene = make_dynamic_scene(triangles, triangle_models, boxes,
+                                        aabb->root_id, argc - 2);
+    }
+    size_t triangle_count = triangles.size();
+    if (cache) {
+        triangle_count = cache->triangle_count;
+    } else if (two_level) {
+        triangle_count = scene.triangles.size();
+    }
 #ifdef DEBUG_PRINT
     auto end_aabb = std::chrono::high_resolution_clock::now();
-    std::cout << "AABB construction took "
+    std::cerr << "AABB construction took "
               << std::chrono::duration_cast<std::chrono::milliseconds>(
                      end_aabb - start_aabb)
                      .count()
@@ -134,6 +579,82 @@ int main(int argc, char *argv[]) {
     print_box(boxes, aabb->root_id, 0, triangles);
 #endif
 
+    // Report on the tree and quit without opening a window
+    if (bvh_stats) {
+        if (two_level) {
+            std::cerr << "--bvh-stats only works with scene=flat"
+                      << std::endl;
+            return 1;
+        }
+        BvhStats stats = get_bvh_stats(boxes, aabb->root_id, triangle_count,
+                                       triangle_indices.size());
+        if (bvh_stats_path.empty()) {
+            write_bvh_stats_json(std::cout, stats);
+        } else {
+            std::ofstream file(bvh_stats_path);
+            write_bvh_stats_json(file, stats);
+        }
+        delete aabb;
+        return 0;
+    }
+
+    // What gets uploaded to binding 4, the shader is told which through the
+    // node_layout and bvh_width uniforms
+    std::vector<Bvh4Node> bvh4_nodes;
+    std::vector<Bvh8Node> bvh8_nodes;
+    std::vector<CompressedNode8> compressed8_nodes;
+    std::vector<CompressedNode16> compressed16_nodes;
+    std::vector<DepthFirstNode> depth_first_nodes;
+    const void *node_data = boxes.data();
+    size_t node_data_size = boxes.size() * sizeof(Box);
+    int root_id = aabb->root_id;
+    int bvh_width = 2;
+    if (two_level) {
+        node_data = scene.blas_boxes.data();
+        node_data_size = scene.blas_boxes.size() * sizeof(Box);
+    } else if (live) {
+        node_data = live_scene.boxes.data();
+    } else if (node_layout == NODES_BVH4) {
+        bvh4_nodes = collapse_to_bvh4(boxes, aabb->root_id);
+        node_data = bvh4_nodes.data();
+        node_data_size = bvh4_nodes.size() * sizeof(Bvh4Node);
+        root_id = 0;
+        bvh_width = 4;
+    } else if (node_layout == NODES_BVH8) {
+        bvh8_nodes = collapse_to_bvh8(boxes, aabb->root_id);
+        node_data = bvh8_nodes.data();
+        node_data_size = bvh8_nodes.size() * sizeof(Bvh8Node);
+        root_id = 0;
+        bvh_width = 8;
+    } else if (node_layout == NODES_COMPRESSED8) {
+        compressed8_nodes = compress_to_bvh4q8(boxes, aabb->root_id);
+        node_data = compressed8_nodes.data();
+        node_data_size = compressed8_nodes.size() * sizeof(CompressedNode8);
+        root_id = 0;
+        bvh_width = 4;
+    } else if (node_layout == NODES_COMPRESSED16) {
+        compressed16_nodes = compress_to_bvh4q16(boxes, aabb->root_id);
+        node_data = compressed16_nodes.data();
+        node_data_size = compressed16_nodes.size() * sizeof(CompressedNode16);
+        root_id = 0;
+        bvh_width = 4;
+    } else if (node_layout == NODES_DEPTH_FIRST) {
+        depth_first_nodes = to_depth_first(boxes, aabb->root_id);
+        node_data = depth_first_nodes.data();
+        node_data_size = depth_first_nodes.size() * sizeof(DepthFirstNode);
+        root_id = 0;
+    }
+    // Uploaded next to the nodes above, so both traversals can be compared
+    std::vector<ThreadedNode> threaded_nodes;
+    if (threaded) {
+        threaded_nodes = to_threaded(boxes, aabb->root_id);
+    }
+#ifdef DEBUG_PRINT
+    std::cout << "BVH has " << boxes.size() << " binary nodes, uploading "
+              << node_data_size << " bytes of " << bvh_width
+              << "-wide nodes" << std::endl;
+#endif
+
     // glfw: initialize and configure
     // ------------------------------
     glfwInit();
@@ -337,13 +858,33 @@ int main(int argc, char *argv[]) {
     int frame = 0;
     // SSBO for vectors
     // triangles
-    // copy triangles to array
-    TriangleForGLSL *triangle_array = new TriangleForGLSL[triangles.size()];
-    for (size_t i = 0; i < triangles.size(); ++i) {
-        triangle_array[i] = *triangles[i];
+    // put the arena in the order of the leaves and upload it as it is
+    if (movable) {
+        prepare_refit(movable_scene,
+                      get_triangle_order(arena.get_pointers(), triangles),
+                      boxes, aabb->root_id);
+    }
+    arena.reorder(triangles, 0, triangles.size());
+    // Reorders the pointers of every coarse leaf, the arena follows once a
+    // leaf is swapped in
+    std::unique_ptr<ProgressiveBuild> progressive_build;
+    if (progressive) {
+        progressive_build = std::unique_ptr<ProgressiveBuild>(
+            new ProgressiveBuild(get_thread_pool(), triangles, boxes,
+                                 bvh_strategy));
     }
-    for (auto t : triangles) {
-        delete t;
+    const TriangleForGLSL *triangle_data = arena.data();
+    if (cache) {
+        triangle_data = cache->triangles;
+    } else if (two_level) {
+        triangle_data = scene.triangles.data();
+    } else if (live) {
+        triangle_data = live_scene.triangles.data();
+    }
+    std::vector<LeafTriangle> leaf_triangles;
+    if (leaf_triangle_format == LEAF_TRIANGLES_WOOP) {
+        leaf_triangles =
+            to_leaf_triangles(triangle_data, triangle_count, triangle_indices);
     }
 #ifdef DEBUG_PRINT
     auto start_ssbo = std::chrono::high_resolution_clock::now();
@@ -352,16 +893,86 @@ int main(int argc, char *argv[]) {
     glGenBuffers(1, &ssbo_triangles);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_triangles);
     glBufferData(GL_SHADER_STORAGE_BUFFER,
-                 triangles.size() * sizeof(TriangleForGLSL), triangle_array,
+                 triangle_count * sizeof(TriangleForGLSL), triangle_data,
                  GL_DYNAMIC_COPY);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, ssbo_triangles);
     GLuint ssbo_boxes;
     glGenBuffers(1, &ssbo_boxes);
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_boxes);
-    glBufferData(GL_SHADER_STORAGE_BUFFER, boxes.size() * sizeof(Box),
-                 boxes.data(), GL_DYNAMIC_COPY);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, node_data_size, node_data,
+                 GL_DYNAMIC_COPY);
     glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, ssbo_boxes);
+    if (!triangle_indices.empty()) {
+        GLuint ssbo_triangle_indices;
+        glGenBuffers(1, &ssbo_triangle_indices);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_triangle_indices);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     triangle_indices.size() * sizeof(int),
+                     triangle_indices.data(), GL_DYNAMIC_COPY);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, ssbo_triangle_indices);
+    }
+    if (two_level) {
+        GLuint ssbo_instances;
+        glGenBuffers(1, &ssbo_instances);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_instances);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     scene.instances.size() * sizeof(InstanceForGLSL),
+                     scene.instances.data(), GL_DYNAMIC_COPY);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, ssbo_instances);
+        GLuint ssbo_tlas;
+        glGenBuffers(1, &ssbo_tlas);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_tlas);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     scene.tlas_boxes.size() * sizeof(Box),
+                     scene.tlas_boxes.data(), GL_DYNAMIC_COPY);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, ssbo_tlas);
+    }
+    if (!leaf_triangles.empty()) {
+        GLuint ssbo_leaf_triangles;
+        glGenBuffers(1, &ssbo_leaf_triangles);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_leaf_triangles);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     leaf_triangles.size() * sizeof(LeafTriangle),
+                     leaf_triangles.data(), GL_DYNAMIC_COPY);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, ssbo_leaf_triangles);
+    }
+    if (!triangle_pairs.empty()) {
+        GLuint ssbo_triangle_pairs;
+        glGenBuffers(1, &ssbo_triangle_pairs);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_triangle_pairs);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     triangle_pairs.size() * sizeof(TrianglePair),
+                     triangle_pairs.data(), GL_DYNAMIC_COPY);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, ssbo_triangle_pairs);
+    }
+    if (threaded) {
+        GLuint ssbo_threaded;
+        glGenBuffers(1, &ssbo_threaded);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo_threaded);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,
+                     threaded_nodes.size() * sizeof(ThreadedNode),
+                     threaded_nodes.data(), GL_DYNAMIC_COPY);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, ssbo_threaded);
+    }
     glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    size_t triangle_capacity = triangle_count * sizeof(TriangleForGLSL);
+    size_t box_capacity = node_data_size;
+    // Never freed, the reader blocks on stdin for as long as the process
+    // runs and may still touch it after main returned
+    LiveCommands *live_commands = nullptr;
+    if (live) {
+        live_commands = new LiveCommands();
+        std::cout << "Live editing: type `add <file>` or `remove <model id>`, "
+                     "models on the command line are numbered from 0"
+                  << std::endl;
+        std::thread(read_live_commands, live_commands).detach();
+    } else if (movable) {
+        live_commands = new LiveCommands();
+        std::cout << "Moving nodes: type `move <node id> <x> <y> <z>`, glTF "
+                     "nodes are numbered depth first across the models"
+                  << std::endl;
+        std::thread(read_live_commands, live_commands).detach();
+    }
 #ifdef DEBUG_PRINT
     auto end_ssbo = std::chrono::high_resolution_clock::now();
     std::cout << "SSBO creation took "
@@ -375,6 +986,90 @@ int main(int argc, char *argv[]) {
         // -----
         process_input(window);
 
+        if (live) {
+            std::vector<std::string> lines;
+            {
+                std::lock_guard<std::mutex> lock(live_commands->mutex);
+                lines.swap(live_commands->lines);
+            }
+            for (const auto &line : lines) {
+                run_live_command(line, live_scene);
+            }
+            upload_dirty_ranges(ssbo_triangles, triangle_capacity,
+                                live_scene.triangles.data(),
+                                sizeof(TriangleForGLSL),
+                                live_scene.triangles.size(),
+                                take_dirty_ranges(live_scene.dirty_triangles));
+            upload_dirty_ranges(ssbo_boxes, box_capacity,
+                                live_scene.boxes.data(), sizeof(Box),
+                                live_scene.boxes.size(),
+                                take_dirty_ranges(live_scene.dirty_boxes));
+            triangle_count = live_scene.triangles.size();
+            // An empty tree has only free boxes, which no ray hits
+            root_id = std::max(live_scene.root_id, 0);
+        }
+        if (movable) {
+            std::vector<std::string> lines;
+            {
+                std::lock_guard<std::mutex> lock(live_commands->mutex);
+                lines.swap(live_commands->lines);
+            }
+            bool moved = false;
+            for (const auto &line : lines) {
+                moved = run_move_command(line, movable_scene) || moved;
+            }
+            if (moved &&
+                refit(get_thread_pool(), movable_scene, arena.data(), nullptr,
+                      boxes, REFIT_DEFAULT_REBUILD_THRESHOLD)) {
+                std::cout << "Refitting made the BVH too slow, building it "
+                             "again"
+                          << std::endl;
+                delete aabb;
+                boxes.clear();
+                aabb = triangles_to_aabb(boxes, triangles, 0,
+                                         triangles.size(), 0, bvh_strategy);
+                prepare_refit(
+                    movable_scene,
+                    get_triangle_order(arena.get_pointers(), triangles),
+                    boxes, aabb->root_id);
+                arena.reorder(triangles, 0, triangles.size());
+                root_id = aabb->root_id;
+            }
+            if (moved) {
+                upload_dirty_ranges(
+                    ssbo_triangles, triangle_capacity, arena.data(),
+                    sizeof(TriangleForGLSL), triangle_count,
+                    {DirtyRange{0, static_cast<int>(triangle_count)}});
+                upload_dirty_ranges(
+                    ssbo_boxes, box_capacity, boxes.data(), sizeof(Box),
+                    boxes.size(),
+                    {DirtyRange{0, static_cast<int>(boxes.size())}});
+            }
+        }
+        if (progressive_build) {
+            std::vector<DirtyRange> dirty_boxes;
+            std::vector<DirtyRange> dirty_triangles;
+            progressive_build->swap_in_finished(boxes, dirty_boxes,
+                                                dirty_triangles);
+            // One leaf at a time, merged ranges may cover leaves whose
+            // pointers are still being sorted
+            for (const auto &range : dirty_triangles) {
+                arena.reorder(triangles, range.start, range.end);
+            }
+            upload_dirty_ranges(ssbo_triangles, triangle_capacity,
+                                arena.data(), sizeof(TriangleForGLSL),
+                                triangle_count,
+                                take_dirty_ranges(dirty_triangles));
+            upload_dirty_ranges(ssbo_boxes, box_capacity, boxes.data(),
+                                sizeof(Box), boxes.size(),
+                                take_dirty_ranges(dirty_boxes));
+            if (progressive_build->finished()) {
+                std::cout << "Progressive build finished, BVH has "
+                          << boxes.size() << " nodes" << std::endl;
+                progressive_build.reset();
+            }
+        }
+
         // Compute the MVP matrix from keyboard and mouse input
         update_movement(window, mode);
 
@@ -419,7 +1114,7 @@ int main(int argc, char *argv[]) {
         glUniform1i(frame_location, frame++);
         int triangle_count_location =
             glGetUniformLocation(shader_program, "triangle_count");
-        glUniform1i(triangle_count_location, triangles.size());
+        glUniform1i(triangle_count_location, triangle_count);
         int positionLocation = glGetUniformLocation(shader_program, "position");
         glm::vec3 position = get_position();
         glUniform3f(positionLocation, position.x, position.y, position.z);
@@ -429,7 +1124,28 @@ int main(int argc, char *argv[]) {
 
         // AABB
         int root_id_location = glGetUniformLocation(shader_program, "root_id");
-        glUniform1i(root_id_location, aabb->root_id);
+        glUniform1i(root_id_location, root_id);
+        int bvh_width_location =
+            glGetUniformLocation(shader_program, "bvh_width");
+        glUniform1i(bvh_width_location, bvh_width);
+        int node_layout_location =
+            glGetUniformLocation(shader_program, "node_layout");
+        glUniform1i(node_layout_location, node_layout);
+        int indexed_triangles_location =
+            glGetUniformLocation(shader_program, "indexed_triangles");
+        glUniform1i(indexed_triangles_location, !triangle_indices.empty());
+        int two_level_location =
+            glGetUniformLocation(shader_program, "two_level");
+        glUniform1i(two_level_location, two_level);
+        int leaf_triangles_location =
+            glGetUniformLocation(shader_program, "leaf_triangles");
+        glUniform1i(leaf_triangles_location, leaf_triangle_format);
+        int triangle_pairs_location =
+            glGetUniformLocation(shader_program, "triangle_pairs");
+        glUniform1i(triangle_pairs_location, leaf_primitives);
+        int stackless_location =
+            glGetUniformLocation(shader_program, "stackless");
+        glUniform1i(stackless_location, threaded && get_stackless());
 
         int render_mode_location = glGetUniformLocation(shader_program, "fast_render");
         glUniform1i(render_mode_location, get_render_mode());
@@ -444,6 +1160,7 @@ int main(int argc, char *argv[]) {
     // glfw: terminate, clearing all previously allocated GLFW resources.
     // ------------------------------------------------------------------
     glfwTerminate();
+    progressive_build.reset();
     delete aabb;
     return 0;
 }
@@ -456,6 +1173,97 @@ void process_input(GLFWwindow *window) {
         glfwSetWindowShouldClose(window, true);
 }
 
+void read_live_commands(LiveCommands *commands) {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        std::lock_guard<std::mutex> lock(commands->mutex);
+        commands->lines.push_back(line);
+    }
+}
+
+void run_live_command(const std::string &line, DynamicScene &scene) {
+    try {
+        if (line.rfind("add ", 0) == 0) {
+            // Textures of models added at runtime are not uploaded, their
+            // ids would pick images of the models already loaded
+            OurNode model = load_model(line.substr(4));
+            TriangleArena arena = flatten_model(model);
+            for (size_t i = 0; i < arena.size(); i++) {
+                arena.data()[i].texture_id =
+                    std::numeric_limits<uint32_t>::max();
+                arena.data()[i].metallic_roughness_texture_id =
+                    std::numeric_limits<uint32_t>::max();
+            }
+            std::vector<TriangleForGLSL *> triangles = arena.get_pointers();
+            int id = insert_model(scene, triangles);
+            std::cout << "Added model " << id << " with " << triangles.size()
+                      << " triangles" << std::endl;
+        } else if (line.rfind("remove ", 0) == 0) {
+            if (remove_model(scene, std::stoi(line.substr(7)))) {
+                std::cout << "Most triangle slots are unused now, restart "
+                             "to build the tree again"
+                          << std::endl;
+            }
+        } else if (!line.empty()) {
+            std::cout << "Unknown command: " << line << std::endl;
+        }
+    } catch (const std::exception &error) {
+        std::cout << "Warning: " << error.what() << std::endl;
+    }
+}
+
+// `move <node id> <x> <y> <z>` offsets a glTF node and everything below it
+// in its parent's space. Returns whether a node moved
+bool run_move_command(const std::string &line, MovableScene &scene) {
+    std::istringstream words(line);
+    std::string command;
+    int node;
+    Vec3 offset;
+    if (!(words >> command >> node >> offset.x >> offset.y >> offset.z) ||
+        command != "move") {
+        if (!line.empty()) {
+            std::cout << "Unknown command: " << line << std::endl;
+        }
+        return false;
+    }
+    if (node < 0 || node >= static_cast<int>(scene.node_parents.size())) {
+        std::cout << "Warning: there is no node " << node << std::endl;
+        return false;
+    }
+    Matrix4 translation =
+        compose_matrix(offset, Vec4{0, 0, 0, 1}, Vec3{1, 1, 1});
+    set_node_matrix(scene, node,
+                    mul_matrixes(translation, scene.node_matrices[node]));
+    return true;
+}
+
+// Uploads only what changed, or everything into a buffer twice as large
+// once the array outgrew it
+void upload_dirty_ranges(GLuint buffer, size_t &capacity, const void *data,
+                         size_t element_size, size_t count,
+                         const std::vector<DirtyRange> &ranges) {
+    if (ranges.empty()) {
+        return;
+    }
+    const char *bytes = static_cast<const char *>(data);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    if (count * element_size > capacity) {
+        capacity = 2 * count * element_size;
+        glBufferData(GL_SHADER_STORAGE_BUFFER, capacity, nullptr,
+                     GL_DYNAMIC_COPY);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * element_size,
+                        bytes);
+    } else {
+        for (const auto &range : ranges) {
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                            range.start * element_size,
+                            (range.end - range.start) * element_size,
+                            bytes + range.start * element_size);
+        }
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
 // glfw: whenever the window size changed (by OS or user resize) this callback
 // function executes
 // ---------------------------------------------------------------------------------------------
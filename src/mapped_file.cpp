@@ -0,0 +1,65 @@
+#include "./mapped_file.hpp"
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string &path) {
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Can't open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        byte_count = info.st_size;
+        void *view = mmap(nullptr, byte_count, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            bytes = static_cast<const unsigned char *>(view);
+            mapped = true;
+        }
+    }
+    close(fd);
+    if (mapped || byte_count == 0) {
+        return;
+    }
+#endif
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Can't open " + path);
+    }
+    buffer.assign(std::istreambuf_iterator<char>(file),
+                  std::istreambuf_iterator<char>());
+    bytes = buffer.data();
+    byte_count = buffer.size();
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (mapped) {
+        munmap(const_cast<unsigned char *>(bytes), byte_count);
+    }
+#endif
+}
+
+void MappedFile::advise_sequential() const {
+#ifndef _WIN32
+    if (mapped) {
+        madvise(const_cast<unsigned char *>(bytes), byte_count,
+                MADV_SEQUENTIAL);
+    }
+#endif
+}
+
+bool file_exists(const std::string &path) {
+    struct stat info;
+    return stat(path.c_str(), &info) == 0;
+}
@@ -0,0 +1,147 @@
+#include "./mapped_glb.hpp"
+#include "./json.hpp"
+#include "./mapped_file.hpp"
+#include "./tiny_gltf.h"
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+const uint32_t GLB_MAGIC = 0x46546C67;
+const uint32_t GLB_CHUNK_JSON = 0x4E4F534A;
+const uint32_t GLB_CHUNK_BIN = 0x004E4942;
+
+// .glb is little endian, like every platform this runs on
+uint32_t read_uint32(const unsigned char *bytes) {
+    uint32_t value;
+    std::memcpy(&value, bytes, 4);
+    return value;
+}
+
+void append_uint32(std::vector<unsigned char> &bytes, uint32_t value) {
+    unsigned char word[4];
+    std::memcpy(word, &value, 4);
+    bytes.insert(bytes.end(), word, word + 4);
+}
+
+void append_chunk(std::vector<unsigned char> &glb, uint32_t type,
+                  const unsigned char *data, size_t size,
+                  unsigned char padding) {
+    size_t padded_size = (size + 3) / 4 * 4;
+    append_uint32(glb, padded_size);
+    append_uint32(glb, type);
+    glb.insert(glb.end(), data, data + size);
+    glb.resize(glb.size() + padded_size - size, padding);
+}
+
+// Points the images stored in the BIN chunk at new buffer views into a
+// much smaller first buffer, and returns that buffer's bytes
+std::vector<unsigned char> move_images_out(nlohmann::json &json,
+                                           const unsigned char *bin,
+                                           size_t bin_size) {
+    std::vector<unsigned char> images;
+    nlohmann::json &views = json["bufferViews"];
+    nlohmann::json no_images = nlohmann::json::array();
+    for (auto &image : json.contains("images") ? json["images"] : no_images) {
+        if (!image.contains("bufferView")) {
+            continue;
+        }
+        const nlohmann::json &view =
+            views.at(image["bufferView"].get<size_t>());
+        if (view.value("buffer", -1) != 0) {
+            continue;
+        }
+        size_t offset = view.value("byteOffset", size_t(0));
+        size_t length = view.at("byteLength").get<size_t>();
+        if (offset + length > bin_size) {
+            throw std::out_of_range("image outside of the BIN chunk");
+        }
+        image["bufferView"] = views.size();
+        views.push_back({{"buffer", 0},
+                         {"byteOffset", images.size()},
+                         {"byteLength", length}});
+        images.insert(images.end(), bin + offset, bin + offset + length);
+        images.resize((images.size() + 3) / 4 * 4, 0);
+    }
+    // tinygltf refuses an empty BIN chunk
+    if (images.empty()) {
+        images.resize(4, 0);
+    }
+    json["buffers"][0]["byteLength"] = images.size();
+    return images;
+}
+
+bool load_mapped_glb(tinygltf::TinyGLTF &loader, tinygltf::Model *model,
+                     MappedGlb &glb, std::string *err, std::string *warn,
+                     const std::string &filename) {
+    glb.file = std::unique_ptr<MappedFile>(new MappedFile(filename));
+    glb.bin = nullptr;
+    glb.file->advise_sequential();
+    const unsigned char *bytes = glb.file->data();
+    size_t size = glb.file->size();
+    std::string base_dir =
+        filename.substr(0, filename.find_last_of("/\\") + 1);
+
+    size_t json_end = 0;
+    size_t bin_size = 0;
+    if (size >= 20 && read_uint32(bytes) == GLB_MAGIC &&
+        read_uint32(bytes + 16) == GLB_CHUNK_JSON) {
+        json_end = 20 + size_t(read_uint32(bytes + 12));
+    }
+    if (json_end > 0 && json_end + 8 <= size &&
+        read_uint32(bytes + json_end + 4) == GLB_CHUNK_BIN) {
+        bin_size = read_uint32(bytes + json_end);
+    }
+    if (bin_size == 0 || json_end + 8 + bin_size > size) {
+        return loader.LoadBinaryFromMemory(model, err, warn, bytes, size,
+                                           base_dir);
+    }
+
+    nlohmann::json json =
+        nlohmann::json::parse(bytes + 20, bytes + json_end, nullptr, false);
+    std::vector<unsigned char> images;
+    try {
+        // The BIN chunk can only be the first buffer, the one without a uri
+        if (json.is_discarded() || json.at("buffers").at(0).contains("uri")) {
+            return loader.LoadBinaryFromMemory(model, err, warn, bytes, size,
+                                               base_dir);
+        }
+        images = move_images_out(json, bytes + json_end + 8, bin_size);
+    } catch (const std::exception &) {
+        return loader.LoadBinaryFromMemory(model, err, warn, bytes, size,
+                                           base_dir);
+    }
+
+    std::string text = json.dump();
+    std::vector<unsigned char> small_glb;
+    small_glb.reserve(28 + text.size() + 3 + images.size());
+    append_uint32(small_glb, GLB_MAGIC);
+    append_uint32(small_glb, 2);
+    append_uint32(small_glb, 0);
+    append_chunk(small_glb, GLB_CHUNK_JSON,
+                 reinterpret_cast<const unsigned char *>(text.data()),
+                 text.size(), ' ');
+    append_chunk(small_glb, GLB_CHUNK_BIN, images.data(), images.size(), 0);
+    uint32_t length = small_glb.size();
+    std::memcpy(small_glb.data() + 8, &length, 4);
+    if (!loader.LoadBinaryFromMemory(model, err, warn, small_glb.data(),
+                                     small_glb.size(), base_dir)) {
+        return false;
+    }
+    glb.bin = bytes + json_end + 8;
+    return true;
+}
+
+std::vector<const unsigned char *>
+get_buffer_data(const tinygltf::Model &model, const MappedGlb &glb) {
+    std::vector<const unsigned char *> buffers;
+    for (const auto &buffer : model.buffers) {
+        buffers.push_back(buffer.data.data());
+    }
+    if (glb.bin && !buffers.empty()) {
+        buffers[0] = glb.bin;
+    }
+    return buffers;
+}
@@ -0,0 +1,245 @@
+#include "./out_of_core.hpp"
+#include "./aabb.hpp"
+#include "./bvh_cache.hpp"
+#include "./load_model.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Triangles waiting in a file to be split or built
+struct Bucket {
+    std::string path;
+    size_t count;
+    PaddedVec3ForGLSL centroid_min;
+    PaddedVec3ForGLSL centroid_max;
+};
+
+struct OutOfCoreBuild {
+    std::string prefix;
+    int next_file;
+    size_t capacity;
+    int strategy;
+    std::ofstream triangles;
+    std::ofstream boxes;
+    size_t triangle_count;
+    size_t box_count;
+};
+
+std::ofstream open_spill_file(const std::string &path) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error("Can't write " + path);
+    }
+    return file;
+}
+
+void close_spill_file(std::ofstream &file, const std::string &path) {
+    file.close();
+    if (!file) {
+        throw std::runtime_error("Can't write " + path);
+    }
+}
+
+Bucket new_bucket(OutOfCoreBuild &build) {
+    return Bucket{build.prefix + std::to_string(build.next_file++), 0,
+                  empty_min(), empty_max()};
+}
+
+void add_to_bucket(Bucket &bucket, std::ofstream &file,
+                   const TriangleForGLSL &triangle) {
+    file.write(reinterpret_cast<const char *>(&triangle),
+               sizeof(TriangleForGLSL));
+    PaddedVec3ForGLSL centroid =
+        PaddedVec3ForGLSL{get_centroid(0, &triangle), get_centroid(1, &triangle),
+                          get_centroid(2, &triangle), 0};
+    grow(bucket.centroid_min, bucket.centroid_max, centroid, centroid);
+    bucket.count++;
+}
+
+size_t read_chunk(std::ifstream &file, std::vector<TriangleForGLSL> &chunk) {
+    file.read(reinterpret_cast<char *>(chunk.data()),
+              chunk.size() * sizeof(TriangleForGLSL));
+    return file.gcount() / sizeof(TriangleForGLSL);
+}
+
+// Writes the triangles of bucket to two new buckets, by their centroid on
+// axis against middle or, with by_count, the first half left
+void partition_bucket(OutOfCoreBuild &build, const Bucket &bucket, int axis,
+                      float middle, bool by_count, Bucket &left,
+                      Bucket &right) {
+    left = new_bucket(build);
+    right = new_bucket(build);
+    std::ofstream left_file = open_spill_file(left.path);
+    std::ofstream right_file = open_spill_file(right.path);
+    std::ifstream file(bucket.path, std::ios::binary);
+    std::vector<TriangleForGLSL> chunk(
+        std::min(OUT_OF_CORE_CHUNK, build.capacity));
+    size_t seen = 0;
+    size_t count;
+    while ((count = read_chunk(file, chunk)) > 0) {
+        for (size_t i = 0; i < count; i++, seen++) {
+            bool goes_left = by_count
+                                 ? seen < bucket.count / 2
+                                 : get_centroid(axis, &chunk[i]) < middle;
+            if (goes_left) {
+                add_to_bucket(left, left_file, chunk[i]);
+            } else {
+                add_to_bucket(right, right_file, chunk[i]);
+            }
+        }
+    }
+    if (seen != bucket.count) {
+        throw std::runtime_error("Can't read " + bucket.path);
+    }
+    file.close();
+    close_spill_file(left_file, left.path);
+    close_spill_file(right_file, right.path);
+}
+
+// Halves the bucket at the middle of its centroids' longest axis, or by
+// count when that leaves one side empty. A middle that rounds back to the
+// minimum would, and so would centroids that are all in the same spot
+void split_bucket(OutOfCoreBuild &build, const Bucket &bucket, Bucket &left,
+                  Bucket &right) {
+    int axis = 0;
+    float extent = 0;
+    for (int coord = 0; coord < 3; coord++) {
+        float coord_extent = get_coord(coord, bucket.centroid_max) -
+                             get_coord(coord, bucket.centroid_min);
+        if (coord_extent > extent) {
+            axis = coord;
+            extent = coord_extent;
+        }
+    }
+    float middle = get_coord(axis, bucket.centroid_min) + 0.5f * extent;
+    bool by_count = !(middle > get_coord(axis, bucket.centroid_min));
+
+    partition_bucket(build, bucket, axis, middle, by_count, left, right);
+    if (!by_count && (left.count == 0 || right.count == 0)) {
+        std::remove(left.path.c_str());
+        std::remove(right.path.c_str());
+        partition_bucket(build, bucket, axis, middle, true, left, right);
+    }
+    std::remove(bucket.path.c_str());
+}
+
+// Appends the bucket's tree to the spill files, children before parents,
+// and returns the id its root will have in the final file
+int build_bucket(OutOfCoreBuild &build, const Bucket &bucket, Box &root) {
+    if (bucket.count > build.capacity) {
+        Bucket left;
+        Bucket right;
+        split_bucket(build, bucket, left, right);
+        Box left_root = Box(empty_min(), empty_max(), -1, -1, 0, 0);
+        Box right_root = left_root;
+        int left_id = build_bucket(build, left, left_root);
+        int right_id = build_bucket(build, right, right_root);
+        PaddedVec3ForGLSL min = left_root.min;
+        PaddedVec3ForGLSL max = left_root.max;
+        grow(min, max, right_root.min, right_root.max);
+        root = Box(min, max, left_id, right_id, left_root.start,
+                   right_root.end);
+        build.boxes.write(reinterpret_cast<const char *>(&root), sizeof(Box));
+        return build.box_count++;
+    }
+
+    std::vector<TriangleForGLSL> triangles(bucket.count);
+    std::ifstream file(bucket.path, std::ios::binary);
+    if (read_chunk(file, triangles) != bucket.count) {
+        throw std::runtime_error("Can't read " + bucket.path);
+    }
+    file.close();
+    std::remove(bucket.path.c_str());
+    std::vector<TriangleForGLSL *> pointers(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        pointers[i] = &triangles[i];
+    }
+    std::vector<Box> boxes;
+    AABB *aabb = triangles_to_aabb(boxes, pointers, 0, pointers.size(), 0,
+                                   build.strategy);
+    int root_id = aabb->root_id;
+    delete aabb;
+
+    for (const auto triangle : pointers) {
+        build.triangles.write(reinterpret_cast<const char *>(triangle),
+                              sizeof(TriangleForGLSL));
+    }
+    for (auto &box : boxes) {
+        if (box.left_id != -1) {
+            box.left_id += build.box_count;
+            box.right_id += build.box_count;
+        }
+        box.start += build.triangle_count;
+        box.end += build.triangle_count;
+    }
+    build.boxes.write(reinterpret_cast<const char *>(boxes.data()),
+                      boxes.size() * sizeof(Box));
+    root = boxes[root_id];
+    root_id += build.box_count;
+    build.triangle_count += triangles.size();
+    build.box_count += boxes.size();
+    return root_id;
+}
+
+void build_out_of_core(const std::vector<std::string> &model_paths,
+                       const std::string &path, uint64_t key,
+                       size_t memory_budget, int strategy,
+                       std::vector<tinygltf::Image> &textures) {
+    OutOfCoreBuild build;
+    build.prefix = path + ".part";
+    build.next_file = 0;
+    build.capacity =
+        std::max<size_t>(memory_budget / OUT_OF_CORE_BYTES_PER_TRIANGLE, 1);
+    build.strategy = strategy;
+    build.triangle_count = 0;
+    build.box_count = 0;
+
+    Bucket all = new_bucket(build);
+    std::ofstream all_file = open_spill_file(all.path);
+    for (const auto &model_path : model_paths) {
+        size_t held_bytes = load_model_chunks(
+            model_path, textures,
+            [&](const TriangleForGLSL *triangles, size_t count) {
+                for (size_t i = 0; i < count; i++) {
+                    add_to_bucket(all, all_file, triangles[i]);
+                }
+            });
+        if (held_bytes > memory_budget) {
+            std::cerr << "Warning: " << model_path << " kept "
+                      << (held_bytes >> 20)
+                      << " MB of textures and buffers in memory, more than "
+                         "memory_budget"
+                      << std::endl;
+        }
+    }
+    close_spill_file(all_file, all.path);
+    if (all.count == 0) {
+        std::remove(all.path.c_str());
+        throw std::runtime_error("No triangles to build a tree over");
+    }
+
+    std::string triangles_path = build.prefix + "_triangles";
+    std::string boxes_path = build.prefix + "_boxes";
+    build.triangles = open_spill_file(triangles_path);
+    build.boxes = open_spill_file(boxes_path);
+    Box root = Box(empty_min(), empty_max(), -1, -1, 0, 0);
+    int root_id = build_bucket(build, all, root);
+    close_spill_file(build.triangles, triangles_path);
+    close_spill_file(build.boxes, boxes_path);
+
+    try {
+        write_bvh_cache_from_files(path, key, triangles_path,
+                                   build.triangle_count, boxes_path,
+                                   build.box_count, root_id, textures);
+    } catch (const std::runtime_error &) {
+        std::remove(triangles_path.c_str());
+        std::remove(boxes_path.c_str());
+        throw;
+    }
+    std::remove(triangles_path.c_str());
+    std::remove(boxes_path.c_str());
+}
@@ -0,0 +1,225 @@
+#include "./parallel_bvh.hpp"
+#include "./aabb.hpp"
+#include "./compact_bvh.hpp"
+#include "./sah.hpp"
+#include "./thread_pool.hpp"
+#include <memory>
+#include <vector>
+
+SahBins bin_parallel(ThreadPool &pool, const std::vector<BuildRecord> &records,
+                     int start, int end) {
+    int chunk_count = (end - start + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+    std::vector<PaddedVec3ForGLSL> chunk_min(chunk_count);
+    std::vector<PaddedVec3ForGLSL> chunk_max(chunk_count);
+    parallel_for(pool, start, end, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     int chunk = (chunk_start - start) / PARALLEL_CHUNK;
+                     get_centroid_bounds(records, chunk_start, chunk_end,
+                                         chunk_min[chunk], chunk_max[chunk]);
+                 });
+    PaddedVec3ForGLSL centroid_min = empty_min();
+    PaddedVec3ForGLSL centroid_max = empty_max();
+    for (int i = 0; i < chunk_count; i++) {
+        grow(centroid_min, centroid_max, chunk_min[i], chunk_max[i]);
+    }
+
+    std::vector<SahBins> chunk_bins(chunk_count);
+    parallel_for(pool, start, end, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     SahBins &bins =
+                         chunk_bins[(chunk_start - start) / PARALLEL_CHUNK];
+                     clear_bins(bins, centroid_min, centroid_max);
+                     fill_bins(bins, records, chunk_start, chunk_end);
+                 });
+    SahBins bins = chunk_bins[0];
+    for (int i = 1; i < chunk_count; i++) {
+        merge_bins(bins, chunk_bins[i]);
+    }
+    return bins;
+}
+
+// Stable, so the order inside each half only depends on the input order
+int partition_parallel(ThreadPool &pool, std::vector<BuildRecord> &records,
+                       int start, int end, const SahSplit &split) {
+    int chunk_count = (end - start + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK;
+    std::vector<int> left_count(chunk_count, 0);
+    parallel_for(pool, start, end, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     int count = 0;
+                     for (int i = chunk_start; i < chunk_end; i++) {
+                         count += goes_left(split, records[i]);
+                     }
+                     left_count[(chunk_start - start) / PARALLEL_CHUNK] = count;
+                 });
+    std::vector<int> left_offset(chunk_count);
+    std::vector<int> right_offset(chunk_count);
+    int left_total = 0;
+    for (int i = 0; i < chunk_count; i++) {
+        left_offset[i] = left_total;
+        left_total += left_count[i];
+    }
+    int right_total = left_total;
+    for (int i = 0; i < chunk_count; i++) {
+        right_offset[i] = right_total;
+        right_total += std::min(PARALLEL_CHUNK, end - start - i * PARALLEL_CHUNK) -
+                       left_count[i];
+    }
+
+    std::vector<BuildRecord> scratch(end - start);
+    parallel_for(pool, start, end, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     int chunk = (chunk_start - start) / PARALLEL_CHUNK;
+                     int left = left_offset[chunk];
+                     int right = right_offset[chunk];
+                     for (int i = chunk_start; i < chunk_end; i++) {
+                         if (goes_left(split, records[i])) {
+                             scratch[left++] = records[i];
+                         } else {
+                             scratch[right++] = records[i];
+                         }
+                     }
+                 });
+    parallel_for(pool, start, end, PARALLEL_CHUNK,
+                 [&](int chunk_start, int chunk_end) {
+                     std::copy(scratch.begin() + (chunk_start - start),
+                               scratch.begin() + (chunk_end - start),
+                               records.begin() + chunk_start);
+                 });
+    return start + left_total;
+}
+
+// One node of the task tree. Subtrees below the grain are built into their
+// own arena with local ids; the nodes above it only remember their bounds
+struct BuildTask {
+    std::vector<Box> arena;
+    std::unique_ptr<BuildTask> left;
+    std::unique_ptr<BuildTask> right;
+    PaddedVec3ForGLSL min;
+    PaddedVec3ForGLSL max;
+    int start;
+    int end;
+    int size;
+    int offset;
+};
+
+void build_subtree(ThreadPool &pool, BuildTask &task, int start, int end,
+                   const SplitFunction &split,
+                   const SubtreeFunction &build_sequential) {
+    task.start = start;
+    task.end = end;
+    if (end - start <= PARALLEL_BUILD_GRAIN) {
+        build_sequential(task.arena, start, end);
+        task.min = task.arena.back().min;
+        task.max = task.arena.back().max;
+        task.size = task.arena.size();
+        return;
+    }
+
+    int mid = split(start, end);
+
+    task.left.reset(new BuildTask());
+    task.right.reset(new BuildTask());
+    TaskGroup group;
+    // The left task uses this frame, so it has to finish even when the
+    // right side throws
+    TaskGroupGuard guard(pool, group);
+    pool.submit(group, [&] {
+        build_subtree(pool, *task.left, start, mid, split, build_sequential);
+    });
+    build_subtree(pool, *task.right, mid, end, split, build_sequential);
+    pool.wait(group);
+
+    task.min = task.left->min;
+    task.max = task.left->max;
+    grow(task.min, task.max, task.right->min, task.right->max);
+    task.size = task.left->size + task.right->size + 1;
+}
+
+// Lays the tasks out as [left subtree][right subtree][node], the same order
+// the recursive builder uses, and collects the arenas that need copying
+void assign_offsets(BuildTask &task, int offset,
+                    std::vector<BuildTask *> &arenas) {
+    task.offset = offset;
+    if (!task.left) {
+        arenas.push_back(&task);
+        return;
+    }
+    assign_offsets(*task.left, offset, arenas);
+    assign_offsets(*task.right, offset + task.left->size, arenas);
+}
+
+void write_inner_nodes(const BuildTask &task, std::vector<Box> &boxes) {
+    if (!task.left) {
+        return;
+    }
+    write_inner_nodes(*task.left, boxes);
+    write_inner_nodes(*task.right, boxes);
+    int left = task.left->offset + task.left->size - 1;
+    int right = task.right->offset + task.right->size - 1;
+    boxes[task.offset + task.size - 1] =
+        Box(task.min, task.max, left, right, task.start, task.end);
+}
+
+Box build_in_parallel(ThreadPool &pool, std::vector<Box> &boxes, int start,
+                      int end, const SplitFunction &split,
+                      const SubtreeFunction &build_sequential) {
+    BuildTask root;
+    build_subtree(pool, root, start, end, split, build_sequential);
+
+    std::vector<BuildTask *> arenas;
+    assign_offsets(root, boxes.size(), arenas);
+    boxes.resize(boxes.size() + root.size,
+                 Box(empty_min(), empty_max(), -1, -1, 0, 0));
+    TaskGroup group;
+    TaskGroupGuard guard(pool, group);
+    for (BuildTask *task : arenas) {
+        pool.submit(group, [task, &boxes] {
+            for (size_t i = 0; i < task->arena.size(); i++) {
+                Box box = task->arena[i];
+                if (box.left_id != -1) {
+                    box.left_id += task->offset;
+                    box.right_id += task->offset;
+                }
+                boxes[task->offset + i] = box;
+            }
+        });
+    }
+    pool.wait(group);
+    write_inner_nodes(root, boxes);
+
+    // Like the other builders, leave the root for the caller to append
+    Box root_box = boxes.back();
+    boxes.pop_back();
+    return root_box;
+}
+
+Box triangles_to_box_parallel(ThreadPool &pool, std::vector<Box> &boxes,
+                              std::vector<TriangleForGLSL *> &triangles,
+                              int start, int end) {
+    std::vector<BuildRecord> records =
+        get_build_records(pool, triangles, start, end);
+    size_t first_box = boxes.size();
+    Box root = build_in_parallel(
+        pool, boxes, 0, end - start,
+        [&pool, &records](int start, int end) {
+            SahSplit split =
+                pick_sah_split(bin_parallel(pool, records, start, end));
+            if (split.coord == -1) {
+                return start + (end - start) / 2;
+            }
+            return partition_parallel(pool, records, start, end, split);
+        },
+        [&records](std::vector<Box> &arena, int start, int end) {
+            arena.emplace_back(records_to_box_sah(arena, records, start, end));
+        });
+
+    // The tree was built over positions in records, which start at 0
+    for (size_t i = first_box; i < boxes.size(); i++) {
+        boxes[i].start += start;
+        boxes[i].end += start;
+    }
+    root.start += start;
+    root.end += start;
+    apply_build_records(pool, triangles, start, records);
+    return root;
+}
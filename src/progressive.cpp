@@ -0,0 +1,154 @@
+#include "./progressive.hpp"
+#include "./aabb.hpp"
+#include "./dynamic_bvh.hpp"
+#include "./lbvh.hpp"
+#include "./load_model.hpp"
+#include "./thread_pool.hpp"
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Leaves over the cells [first_cell, last_cell), halving the cell range so
+// every split is one bit of the Morton code. Ranges without triangles are
+// skipped
+int cells_to_box(std::vector<Box> &boxes,
+                 const std::vector<TriangleForGLSL *> &triangles,
+                 const std::vector<int> &cell_starts, int first_cell,
+                 int last_cell) {
+    int start = cell_starts[first_cell];
+    int end = cell_starts[last_cell];
+    int middle_cell = first_cell + (last_cell - first_cell) / 2;
+    if (last_cell - first_cell == 1) {
+        boxes.emplace_back(Box(get_min(triangles, start, end),
+                               get_max(triangles, start, end), -1, -1, start,
+                               end));
+        return boxes.size() - 1;
+    }
+    if (cell_starts[middle_cell] == start) {
+        return cells_to_box(boxes, triangles, cell_starts, middle_cell,
+                            last_cell);
+    }
+    if (cell_starts[middle_cell] == end) {
+        return cells_to_box(boxes, triangles, cell_starts, first_cell,
+                            middle_cell);
+    }
+    int left_id =
+        cells_to_box(boxes, triangles, cell_starts, first_cell, middle_cell);
+    int right_id =
+        cells_to_box(boxes, triangles, cell_starts, middle_cell, last_cell);
+    PaddedVec3ForGLSL min = boxes[left_id].min;
+    PaddedVec3ForGLSL max = boxes[left_id].max;
+    grow(min, max, boxes[right_id].min, boxes[right_id].max);
+    boxes.emplace_back(Box(min, max, left_id, right_id, start, end));
+    return boxes.size() - 1;
+}
+
+AABB *build_coarse_bvh(std::vector<Box> &boxes,
+                       std::vector<TriangleForGLSL *> &triangles) {
+    if (triangles.empty()) {
+        boxes.emplace_back(Box(empty_min(), empty_max(), -1, -1, 0, 0));
+        return new AABB{static_cast<int>(boxes.size() - 1)};
+    }
+    PaddedVec3ForGLSL centroid_min = empty_min();
+    PaddedVec3ForGLSL centroid_max = empty_max();
+    for (const auto triangle : triangles) {
+        PaddedVec3ForGLSL centroid = PaddedVec3ForGLSL{
+            get_centroid(0, triangle), get_centroid(1, triangle),
+            get_centroid(2, triangle), 0};
+        grow(centroid_min, centroid_max, centroid, centroid);
+    }
+    float scale[3];
+    for (int coord = 0; coord < 3; coord++) {
+        float extent =
+            get_coord(coord, centroid_max) - get_coord(coord, centroid_min);
+        scale[coord] = extent > 0 ? 1.0f / extent : 0.0f;
+    }
+
+    // Counting sort by the top bits of the centroids' Morton codes
+    const int cell_count = 1 << PROGRESSIVE_COARSE_BITS;
+    std::vector<uint16_t> cells(triangles.size());
+    std::vector<int> cell_starts(cell_count + 1, 0);
+    for (size_t i = 0; i < triangles.size(); i++) {
+        uint32_t code = morton_code30(
+            (get_centroid(0, triangles[i]) - centroid_min.x) * scale[0],
+            (get_centroid(1, triangles[i]) - centroid_min.y) * scale[1],
+            (get_centroid(2, triangles[i]) - centroid_min.z) * scale[2]);
+        cells[i] = code >> (30 - PROGRESSIVE_COARSE_BITS);
+        cell_starts[cells[i] + 1]++;
+    }
+    for (int cell = 0; cell < cell_count; cell++) {
+        cell_starts[cell + 1] += cell_starts[cell];
+    }
+    std::vector<TriangleForGLSL *> sorted(triangles.size());
+    std::vector<int> next = cell_starts;
+    for (size_t i = 0; i < triangles.size(); i++) {
+        sorted[next[cells[i]]++] = triangles[i];
+    }
+    triangles.swap(sorted);
+
+    int root_id = cells_to_box(boxes, triangles, cell_starts, 0, cell_count);
+    return new AABB{root_id};
+}
+
+ProgressiveBuild::ProgressiveBuild(ThreadPool &pool,
+                                   std::vector<TriangleForGLSL *> &triangles,
+                                   const std::vector<Box> &boxes, int strategy)
+    : pool(pool) {
+    for (size_t id = 0; id < boxes.size(); id++) {
+        const Box &box = boxes[id];
+        if (box.left_id != -1) {
+            continue;
+        }
+        remaining++;
+        int leaf_id = id;
+        int start = box.start;
+        int end = box.end;
+        pool.submit(group, [this, &triangles, leaf_id, start, end, strategy] {
+            RefinedLeaf leaf;
+            leaf.leaf_id = leaf_id;
+            AABB *aabb =
+                triangles_to_aabb(leaf.boxes, triangles, start, end, 0, strategy);
+            leaf.root_id = aabb->root_id;
+            delete aabb;
+            std::lock_guard<std::mutex> lock(mutex);
+            done.push_back(std::move(leaf));
+        });
+    }
+}
+
+ProgressiveBuild::~ProgressiveBuild() { pool.wait(group); }
+
+int ProgressiveBuild::swap_in_finished(std::vector<Box> &boxes,
+                                       std::vector<DirtyRange> &dirty_boxes,
+                                       std::vector<DirtyRange> &dirty_triangles) {
+    std::vector<RefinedLeaf> finished;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished.swap(done);
+    }
+    for (const auto &leaf : finished) {
+        // The task reordered the triangles of this range
+        dirty_triangles.push_back(DirtyRange{boxes[leaf.leaf_id].start,
+                                             boxes[leaf.leaf_id].end});
+        int offset = boxes.size();
+        std::vector<int> ids(leaf.boxes.size());
+        int next = offset;
+        for (size_t i = 0; i < leaf.boxes.size(); i++) {
+            ids[i] = static_cast<int>(i) == leaf.root_id ? leaf.leaf_id
+                                                          : next++;
+        }
+        boxes.resize(next, leaf.boxes[leaf.root_id]);
+        for (size_t i = 0; i < leaf.boxes.size(); i++) {
+            Box box = leaf.boxes[i];
+            if (box.left_id != -1) {
+                box.left_id = ids[box.left_id];
+                box.right_id = ids[box.right_id];
+            }
+            boxes[ids[i]] = box;
+        }
+        dirty_boxes.push_back(DirtyRange{offset, next});
+        dirty_boxes.push_back(DirtyRange{leaf.leaf_id, leaf.leaf_id + 1});
+    }
+    remaining -= finished.size();
+    return finished.size();
+}
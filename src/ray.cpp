@@ -0,0 +1,120 @@
+#include "./ray.hpp"
+#include "./aabb.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+PaddedVec3ForGLSL sub(const PaddedVec3ForGLSL &a, const PaddedVec3ForGLSL &b) {
+    return PaddedVec3ForGLSL{a.x - b.x, a.y - b.y, a.z - b.z, 0};
+}
+
+PaddedVec3ForGLSL cross(const PaddedVec3ForGLSL &a,
+                        const PaddedVec3ForGLSL &b) {
+    return PaddedVec3ForGLSL{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+                             a.x * b.y - a.y * b.x, 0};
+}
+
+float dot(const PaddedVec3ForGLSL &a, const PaddedVec3ForGLSL &b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+Ray make_ray(const PaddedVec3ForGLSL &origin,
+             const PaddedVec3ForGLSL &direction) {
+    return Ray{origin, direction,
+               PaddedVec3ForGLSL{1.0f / direction.x, 1.0f / direction.y,
+                                 1.0f / direction.z, 0}};
+}
+
+bool intersect_box(const Ray &ray, const PaddedVec3ForGLSL &min,
+                   const PaddedVec3ForGLSL &max, float t_max, float &t_near) {
+    float tx1 = (min.x - ray.origin.x) * ray.inv_direction.x;
+    float tx2 = (max.x - ray.origin.x) * ray.inv_direction.x;
+    float ty1 = (min.y - ray.origin.y) * ray.inv_direction.y;
+    float ty2 = (max.y - ray.origin.y) * ray.inv_direction.y;
+    float tz1 = (min.z - ray.origin.z) * ray.inv_direction.z;
+    float tz2 = (max.z - ray.origin.z) * ray.inv_direction.z;
+    t_near = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)),
+                      std::max(std::min(tz1, tz2), 0.0f));
+    float t_far = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)),
+                           std::min(std::max(tz1, tz2), t_max));
+    return t_near <= t_far;
+}
+
+// Moller-Trumbore
+bool intersect_triangle(const Ray &ray, const TriangleForGLSL &triangle,
+                        float &t) {
+    PaddedVec3ForGLSL edge1 = sub(triangle.v2, triangle.v1);
+    PaddedVec3ForGLSL edge2 = sub(triangle.v3, triangle.v1);
+    PaddedVec3ForGLSL p = cross(ray.direction, edge2);
+    float determinant = dot(edge1, p);
+    if (std::abs(determinant) < 1e-12f) {
+        return false;
+    }
+    float inv_determinant = 1.0f / determinant;
+    PaddedVec3ForGLSL to_origin = sub(ray.origin, triangle.v1);
+    float u = dot(to_origin, p) * inv_determinant;
+    if (u < 0 || u > 1) {
+        return false;
+    }
+    PaddedVec3ForGLSL q = cross(to_origin, edge1);
+    float v = dot(ray.direction, q) * inv_determinant;
+    if (v < 0 || u + v > 1) {
+        return false;
+    }
+    t = dot(edge2, q) * inv_determinant;
+    return t > 0;
+}
+
+void intersect_leaf(const Ray &ray, const TriangleForGLSL *triangles,
+                    const int *triangle_indices, int start, int end, Hit &hit) {
+    for (int i = start; i < end; i++) {
+        int triangle = triangle_indices ? triangle_indices[i] : i;
+        float t;
+        if (intersect_triangle(ray, triangles[triangle], t) && t < hit.t) {
+            hit = Hit{triangle, t};
+        }
+    }
+}
+
+Hit trace_boxes(const std::vector<Box> &boxes, int root_id,
+                const TriangleForGLSL *triangles, const int *triangle_indices,
+                const Ray &ray) {
+    Hit hit = Hit{-1, std::numeric_limits<float>::max()};
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = root_id;
+    while (stack_size > 0) {
+        const Box &box = boxes[stack[--stack_size]];
+        float t_near;
+        if (!intersect_box(ray, box.min, box.max, hit.t, t_near)) {
+            continue;
+        }
+        if (box.left_id == -1) {
+            intersect_leaf(ray, triangles, triangle_indices, box.start,
+                           box.end, hit);
+            continue;
+        }
+        // Visit the nearer child first so later boxes get culled by hit.t
+        float t_left;
+        float t_right;
+        bool left = intersect_box(ray, boxes[box.left_id].min,
+                                  boxes[box.left_id].max, hit.t, t_left);
+        bool right = intersect_box(ray, boxes[box.right_id].min,
+                                   boxes[box.right_id].max, hit.t, t_right);
+        if (left && right) {
+            if (t_left < t_right) {
+                stack[stack_size++] = box.right_id;
+                stack[stack_size++] = box.left_id;
+            } else {
+                stack[stack_size++] = box.left_id;
+                stack[stack_size++] = box.right_id;
+            }
+        } else if (left) {
+            stack[stack_size++] = box.left_id;
+        } else if (right) {
+            stack[stack_size++] = box.right_id;
+        }
+    }
+    return hit;
+}
@@ -0,0 +1,159 @@
+#include "./refit.hpp"
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./thread_pool.hpp"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Nodes on one level of the tree are refit by tasks of this many boxes
+const int REFIT_GRAIN = 1024;
+
+// Moved triangles are re-transformed by tasks of this many triangles
+const int REFIT_TRIANGLE_GRAIN = 16384;
+
+void add_movable_node(MovableScene &scene, const OurNode &node, int parent) {
+    int id = scene.node_parents.size();
+    scene.node_parents.push_back(parent);
+    scene.node_matrices.push_back(node.matrix);
+    scene.node_moved.push_back(false);
+    for (const auto &primitive : node.primitives) {
+        scene.triangle_nodes.push_back(id);
+        scene.local_vertices.push_back(primitive.v1);
+        scene.local_vertices.push_back(primitive.v2);
+        scene.local_vertices.push_back(primitive.v3);
+    }
+    for (const auto &child : node.children) {
+        add_movable_node(scene, child, id);
+    }
+}
+
+void add_movable_model(MovableScene &scene, const OurNode &model) {
+    add_movable_node(scene, model, -1);
+}
+
+std::vector<int>
+get_triangle_order(const std::vector<TriangleForGLSL *> &before,
+                   const std::vector<TriangleForGLSL *> &after) {
+    std::vector<std::pair<TriangleForGLSL *, int>> original;
+    original.reserve(before.size());
+    for (size_t i = 0; i < before.size(); i++) {
+        original.emplace_back(before[i], i);
+    }
+    std::sort(original.begin(), original.end());
+    std::vector<int> order(after.size());
+    for (size_t i = 0; i < after.size(); i++) {
+        order[i] = std::lower_bound(original.begin(), original.end(),
+                                    std::make_pair(after[i], -1))
+                       ->second;
+    }
+    return order;
+}
+
+void prepare_refit(MovableScene &scene, const std::vector<int> &order,
+                   const std::vector<Box> &boxes, int root_id) {
+    std::vector<int> triangle_nodes(order.size());
+    std::vector<PaddedVec3ForGLSL> local_vertices(order.size() * 3);
+    for (size_t i = 0; i < order.size(); i++) {
+        triangle_nodes[i] = scene.triangle_nodes[order[i]];
+        for (int j = 0; j < 3; j++) {
+            local_vertices[i * 3 + j] = scene.local_vertices[order[i] * 3 + j];
+        }
+    }
+    scene.triangle_nodes.swap(triangle_nodes);
+    scene.local_vertices.swap(local_vertices);
+
+    // Builders number their boxes differently (progressive and live trees
+    // append parents before their children), so walk down from the root
+    scene.levels.clear();
+    std::vector<int> level = {root_id};
+    while (!level.empty()) {
+        std::vector<int> next;
+        for (int id : level) {
+            if (boxes[id].left_id != -1) {
+                next.push_back(boxes[id].left_id);
+                next.push_back(boxes[id].right_id);
+            }
+        }
+        scene.levels.push_back(std::move(level));
+        level = std::move(next);
+    }
+    scene.built_cost = get_sah_cost(boxes, root_id);
+}
+
+void set_node_matrix(MovableScene &scene, int node, const Matrix4 &matrix) {
+    scene.node_matrices[node] = matrix;
+    scene.node_moved[node] = true;
+}
+
+bool refit(ThreadPool &pool, MovableScene &scene,
+           TriangleForGLSL *triangles, const int *triangle_indices,
+           std::vector<Box> &boxes, float rebuild_threshold) {
+    // Parents are numbered before their children
+    std::vector<Matrix4> world(scene.node_matrices.size());
+    bool any_moved = false;
+    for (size_t i = 0; i < world.size(); i++) {
+        int parent = scene.node_parents[i];
+        if (parent == -1) {
+            world[i] = scene.node_matrices[i];
+        } else {
+            world[i] = mul_matrixes(world[parent], scene.node_matrices[i]);
+            if (scene.node_moved[parent]) {
+                scene.node_moved[i] = true;
+            }
+        }
+        any_moved = any_moved || scene.node_moved[i];
+    }
+    if (!any_moved || scene.levels.empty()) {
+        return false;
+    }
+
+    parallel_for(pool, 0, scene.triangle_nodes.size(), REFIT_TRIANGLE_GRAIN,
+                 [&](int start, int end) {
+                     for (int i = start; i < end; i++) {
+                         int node = scene.triangle_nodes[i];
+                         if (!scene.node_moved[node]) {
+                             continue;
+                         }
+                         TriangleForGLSL &t = triangles[i];
+                         t.v1 = transform4(world[node],
+                                           scene.local_vertices[i * 3]);
+                         t.v2 = transform4(world[node],
+                                           scene.local_vertices[i * 3 + 1]);
+                         t.v3 = transform4(world[node],
+                                           scene.local_vertices[i * 3 + 2]);
+                         t.min = v3_min(t.v1, t.v2, t.v3);
+                         t.max = v3_max(t.v1, t.v2, t.v3);
+                     }
+                 });
+    std::fill(scene.node_moved.begin(), scene.node_moved.end(), false);
+
+    for (int level = scene.levels.size() - 1; level >= 0; level--) {
+        const std::vector<int> &ids = scene.levels[level];
+        parallel_for(pool, 0, ids.size(), REFIT_GRAIN, [&](int start, int end) {
+            for (int i = start; i < end; i++) {
+                Box &box = boxes[ids[i]];
+                PaddedVec3ForGLSL min = empty_min();
+                PaddedVec3ForGLSL max = empty_max();
+                if (box.left_id == -1) {
+                    for (int j = box.start; j < box.end; j++) {
+                        const TriangleForGLSL &t =
+                            triangles[triangle_indices ? triangle_indices[j]
+                                                       : j];
+                        grow(min, max, t.min, t.max);
+                    }
+                } else {
+                    grow(min, max, boxes[box.left_id].min,
+                         boxes[box.left_id].max);
+                    grow(min, max, boxes[box.right_id].min,
+                         boxes[box.right_id].max);
+                }
+                box.min = min;
+                box.max = max;
+            }
+        });
+    }
+
+    int root_id = scene.levels[0][0];
+    return get_sah_cost(boxes, root_id) > rebuild_threshold * scene.built_cost;
+}
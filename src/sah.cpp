@@ -0,0 +1,192 @@
+#include "./sah.hpp"
+#include "./aabb.hpp"
+#include "./compact_bvh.hpp"
+#include "./cost_model.hpp"
+#include "./load_model.hpp"
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+float get_bin_scale(const SahBins &bins, int coord) {
+    float extent = get_coord(coord, bins.centroid_max) -
+                   get_coord(coord, bins.centroid_min);
+    return extent > 0 ? SAH_BIN_COUNT / extent : 0;
+}
+
+int get_bin(float centroid, float centroid_min, float scale) {
+    int bin = static_cast<int>((centroid - centroid_min) * scale);
+    return std::min(std::max(bin, 0), SAH_BIN_COUNT - 1);
+}
+
+void get_centroid_bounds(const std::vector<TriangleForGLSL *> &triangles,
+                         int start, int end, PaddedVec3ForGLSL &min,
+                         PaddedVec3ForGLSL &max) {
+    min = empty_min();
+    max = empty_max();
+    for (int i = start; i < end; i++) {
+        PaddedVec3ForGLSL centroid =
+            PaddedVec3ForGLSL{get_centroid(0, triangles[i]),
+                              get_centroid(1, triangles[i]),
+                              get_centroid(2, triangles[i]), 0};
+        grow(min, max, centroid, centroid);
+    }
+}
+
+// Same value as get_centroid gives for the triangle
+float get_centroid(int coord, const BuildRecord &record) {
+    return 0.5f * (record.min[coord] + record.max[coord]);
+}
+
+void get_centroid_bounds(const std::vector<BuildRecord> &records, int start,
+                         int end, PaddedVec3ForGLSL &min,
+                         PaddedVec3ForGLSL &max) {
+    min = empty_min();
+    max = empty_max();
+    for (int i = start; i < end; i++) {
+        PaddedVec3ForGLSL centroid = PaddedVec3ForGLSL{
+            get_centroid(0, records[i]), get_centroid(1, records[i]),
+            get_centroid(2, records[i]), 0};
+        grow(min, max, centroid, centroid);
+    }
+}
+
+void clear_bins(SahBins &bins, const PaddedVec3ForGLSL &centroid_min,
+                const PaddedVec3ForGLSL &centroid_max) {
+    bins.centroid_min = centroid_min;
+    bins.centroid_max = centroid_max;
+    for (auto &axis : bins.bins) {
+        for (auto &bin : axis) {
+            bin = Bin{empty_min(), empty_max(), 0};
+        }
+    }
+}
+
+void fill_bins(SahBins &bins, const std::vector<BuildRecord> &records,
+               int start, int end) {
+    for (int coord = 0; coord < 3; coord++) {
+        float coord_min = get_coord(coord, bins.centroid_min);
+        float scale = get_bin_scale(bins, coord);
+        for (int i = start; i < end; i++) {
+            const BuildRecord &record = records[i];
+            Bin &bin = bins.bins[coord][get_bin(get_centroid(coord, record),
+                                                coord_min, scale)];
+            grow(bin.min, bin.max,
+                 PaddedVec3ForGLSL{record.min[0], record.min[1],
+                                   record.min[2], 0},
+                 PaddedVec3ForGLSL{record.max[0], record.max[1],
+                                   record.max[2], 0});
+            bin.count++;
+        }
+    }
+}
+
+void merge_bins(SahBins &bins, const SahBins &other) {
+    for (int coord = 0; coord < 3; coord++) {
+        for (int i = 0; i < SAH_BIN_COUNT; i++) {
+            Bin &bin = bins.bins[coord][i];
+            grow(bin.min, bin.max, other.bins[coord][i].min,
+                 other.bins[coord][i].max);
+            bin.count += other.bins[coord][i].count;
+        }
+    }
+}
+
+SahSplit pick_sah_split(const SahBins &bins) {
+    float best_cost = std::numeric_limits<float>::max();
+    SahSplit best = SahSplit{-1, -1, 0, 0, best_cost};
+    for (int coord = 0; coord < 3; coord++) {
+        float scale = get_bin_scale(bins, coord);
+        if (scale == 0) {
+            continue;
+        }
+        const Bin *axis = bins.bins[coord];
+
+        // Sweep from the right to get the cost of everything above each
+        // plane, then from the left to evaluate every plane in one pass
+        float right_area[SAH_BIN_COUNT];
+        int right_count[SAH_BIN_COUNT];
+        PaddedVec3ForGLSL min = empty_min();
+        PaddedVec3ForGLSL max = empty_max();
+        int count = 0;
+        for (int i = SAH_BIN_COUNT - 1; i > 0; i--) {
+            grow(min, max, axis[i].min, axis[i].max);
+            count += axis[i].count;
+            right_area[i] = surface_area(min, max);
+            right_count[i] = count;
+        }
+        min = empty_min();
+        max = empty_max();
+        count = 0;
+        for (int i = 0; i < SAH_BIN_COUNT - 1; i++) {
+            grow(min, max, axis[i].min, axis[i].max);
+            count += axis[i].count;
+            if (count == 0 || right_count[i + 1] == 0) {
+                continue;
+            }
+            float cost = surface_area(min, max) * count +
+                         right_area[i + 1] * right_count[i + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best = SahSplit{coord, i, get_coord(coord, bins.centroid_min),
+                                scale, cost};
+            }
+        }
+    }
+    return best;
+}
+
+bool goes_left(const SahSplit &split, const BuildRecord &record) {
+    return get_bin(get_centroid(split.coord, record), split.centroid_min,
+                   split.scale) <= split.bin;
+}
+
+Box records_to_box_sah(std::vector<Box> &boxes,
+                       std::vector<BuildRecord> &records, int start, int end) {
+    int span = end - start;
+    if (span <= 1) {
+        PaddedVec3ForGLSL min;
+        PaddedVec3ForGLSL max;
+        get_record_bounds(records, start, end, min, max);
+        return Box(min, max, -1, -1, start, end);
+    }
+
+    // Bins are laid out over the centroid bounds, not the triangle bounds,
+    // so large triangles do not squash everything into a single bin
+    PaddedVec3ForGLSL centroid_min;
+    PaddedVec3ForGLSL centroid_max;
+    get_centroid_bounds(records, start, end, centroid_min, centroid_max);
+    SahBins bins;
+    clear_bins(bins, centroid_min, centroid_max);
+    fill_bins(bins, records, start, end);
+    SahSplit split = pick_sah_split(bins);
+    if (span <= get_cost_model().max_leaf_size) {
+        PaddedVec3ForGLSL min;
+        PaddedVec3ForGLSL max;
+        get_record_bounds(records, start, end, min, max);
+        if (should_make_leaf(span, min, max, split.cost)) {
+            return Box(min, max, -1, -1, start, end);
+        }
+    }
+
+    int mid;
+    if (split.coord == -1) {
+        // All centroids coincide, so any split is as good as another
+        mid = start + span / 2;
+    } else {
+        mid = std::partition(records.begin() + start, records.begin() + end,
+                             [&split](const BuildRecord &record) {
+                                 return goes_left(split, record);
+                             }) -
+              records.begin();
+    }
+
+    boxes.emplace_back(records_to_box_sah(boxes, records, start, mid));
+    int left = boxes.size() - 1;
+    boxes.emplace_back(records_to_box_sah(boxes, records, mid, end));
+    int right = boxes.size() - 1;
+
+    PaddedVec3ForGLSL min = boxes[left].min;
+    PaddedVec3ForGLSL max = boxes[left].max;
+    grow(min, max, boxes[right].min, boxes[right].max);
+    return Box(min, max, left, right, start, end);
+}
@@ -0,0 +1,407 @@
+#include "./sbvh.hpp"
+#include "./aabb.hpp"
+#include "./cost_model.hpp"
+#include "./sah.hpp"
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+// A triangle, or the part of it that fell on one side of a spatial split
+struct Reference {
+    int triangle;
+    PaddedVec3ForGLSL min;
+    PaddedVec3ForGLSL max;
+};
+
+struct SpatialBin {
+    PaddedVec3ForGLSL min;
+    PaddedVec3ForGLSL max;
+    int entries;
+    int exits;
+};
+
+struct SbvhState {
+    const std::vector<TriangleForGLSL *> &triangles;
+    std::vector<int> &triangle_indices;
+    float root_area;
+    int remaining_budget;
+};
+
+void set_coord(int coord, PaddedVec3ForGLSL &v, float value) {
+    if (coord == 0) {
+        v.x = value;
+    } else if (coord == 1) {
+        v.y = value;
+    } else {
+        v.z = value;
+    }
+}
+
+float get_centroid(int coord, const Reference &reference) {
+    return 0.5f * (get_coord(coord, reference.min) +
+                   get_coord(coord, reference.max));
+}
+
+bool is_empty(const PaddedVec3ForGLSL &min, const PaddedVec3ForGLSL &max) {
+    return min.x > max.x || min.y > max.y || min.z > max.z;
+}
+
+// Bounds of the part of the triangle between lo and hi along coord, limited
+// to the bounds the reference already had
+void clip_reference(const TriangleForGLSL *triangle, const Reference &reference,
+                    int coord, float lo, float hi, PaddedVec3ForGLSL &min,
+                    PaddedVec3ForGLSL &max) {
+    const PaddedVec3ForGLSL *vertices[3] = {&triangle->v1, &triangle->v2,
+                                            &triangle->v3};
+    min = empty_min();
+    max = empty_max();
+    for (int i = 0; i < 3; i++) {
+        const PaddedVec3ForGLSL &a = *vertices[i];
+        const PaddedVec3ForGLSL &b = *vertices[(i + 1) % 3];
+        float a_coord = get_coord(coord, a);
+        float b_coord = get_coord(coord, b);
+        if (a_coord >= lo && a_coord <= hi) {
+            grow(min, max, a, a);
+        }
+        for (float plane : {lo, hi}) {
+            if ((a_coord < plane && b_coord > plane) ||
+                (a_coord > plane && b_coord < plane)) {
+                float t = (plane - a_coord) / (b_coord - a_coord);
+                PaddedVec3ForGLSL point =
+                    PaddedVec3ForGLSL{a.x + (b.x - a.x) * t,
+                                      a.y + (b.y - a.y) * t,
+                                      a.z + (b.z - a.z) * t, 0};
+                set_coord(coord, point, plane);
+                grow(min, max, point, point);
+            }
+        }
+    }
+    min = PaddedVec3ForGLSL{std::max(min.x, reference.min.x),
+                            std::max(min.y, reference.min.y),
+                            std::max(min.z, reference.min.z), 0};
+    max = PaddedVec3ForGLSL{std::min(max.x, reference.max.x),
+                            std::min(max.y, reference.max.y),
+                            std::min(max.z, reference.max.z), 0};
+}
+
+float overlap_area(const PaddedVec3ForGLSL &min_a,
+                   const PaddedVec3ForGLSL &max_a,
+                   const PaddedVec3ForGLSL &min_b,
+                   const PaddedVec3ForGLSL &max_b) {
+    PaddedVec3ForGLSL min = PaddedVec3ForGLSL{std::max(min_a.x, min_b.x),
+                                              std::max(min_a.y, min_b.y),
+                                              std::max(min_a.z, min_b.z), 0};
+    PaddedVec3ForGLSL max = PaddedVec3ForGLSL{std::min(max_a.x, max_b.x),
+                                              std::min(max_a.y, max_b.y),
+                                              std::min(max_a.z, max_b.z), 0};
+    return surface_area(min, max);
+}
+
+struct ObjectSplit {
+    int coord;
+    float plane;
+    float cost;
+    PaddedVec3ForGLSL left_min;
+    PaddedVec3ForGLSL left_max;
+    PaddedVec3ForGLSL right_min;
+    PaddedVec3ForGLSL right_max;
+};
+
+// Binned SAH over the reference centroids; coord is -1 if nothing separates
+// them. References with a centroid below plane go left
+ObjectSplit find_object_split(const std::vector<Reference> &references) {
+    PaddedVec3ForGLSL centroid_min = empty_min();
+    PaddedVec3ForGLSL centroid_max = empty_max();
+    for (const Reference &reference : references) {
+        PaddedVec3ForGLSL centroid =
+            PaddedVec3ForGLSL{get_centroid(0, reference),
+                              get_centroid(1, reference),
+                              get_centroid(2, reference), 0};
+        grow(centroid_min, centroid_max, centroid, centroid);
+    }
+
+    ObjectSplit best;
+    best.coord = -1;
+    best.cost = std::numeric_limits<float>::max();
+    for (int coord = 0; coord < 3; coord++) {
+        float coord_min = get_coord(coord, centroid_min);
+        float extent = get_coord(coord, centroid_max) - coord_min;
+        if (extent <= 0) {
+            continue;
+        }
+        float bin_size = extent / SAH_BIN_COUNT;
+        Bin bins[SAH_BIN_COUNT];
+        for (auto &bin : bins) {
+            bin = Bin{empty_min(), empty_max(), 0};
+        }
+        for (const Reference &reference : references) {
+            int index = static_cast<int>(
+                (get_centroid(coord, reference) - coord_min) / bin_size);
+            Bin &bin = bins[std::min(std::max(index, 0), SAH_BIN_COUNT - 1)];
+            grow(bin.min, bin.max, reference.min, reference.max);
+            bin.count++;
+        }
+
+        PaddedVec3ForGLSL right_min[SAH_BIN_COUNT];
+        PaddedVec3ForGLSL right_max[SAH_BIN_COUNT];
+        int right_count[SAH_BIN_COUNT];
+        PaddedVec3ForGLSL min = empty_min();
+        PaddedVec3ForGLSL max = empty_max();
+        int count = 0;
+        for (int i = SAH_BIN_COUNT - 1; i > 0; i--) {
+            grow(min, max, bins[i].min, bins[i].max);
+            count += bins[i].count;
+            right_min[i] = min;
+            right_max[i] = max;
+            right_count[i] = count;
+        }
+        min = empty_min();
+        max = empty_max();
+        count = 0;
+        for (int i = 0; i < SAH_BIN_COUNT - 1; i++) {
+            grow(min, max, bins[i].min, bins[i].max);
+            count += bins[i].count;
+            if (count == 0 || right_count[i + 1] == 0) {
+                continue;
+            }
+            float cost = surface_area(min, max) * count +
+                         surface_area(right_min[i + 1], right_max[i + 1]) *
+                             right_count[i + 1];
+            if (cost < best.cost) {
+                best = ObjectSplit{coord,          coord_min + bin_size * (i + 1),
+                                   cost,           min,
+                                   max,            right_min[i + 1],
+                                   right_max[i + 1]};
+            }
+        }
+    }
+    return best;
+}
+
+struct SpatialSplit {
+    int coord;
+    float plane;
+    float cost;
+};
+
+SpatialSplit find_spatial_split(const SbvhState &state,
+                                const std::vector<Reference> &references,
+                                const PaddedVec3ForGLSL &node_min,
+                                const PaddedVec3ForGLSL &node_max) {
+    SpatialSplit best = SpatialSplit{-1, 0, std::numeric_limits<float>::max()};
+    for (int coord = 0; coord < 3; coord++) {
+        float coord_min = get_coord(coord, node_min);
+        float extent = get_coord(coord, node_max) - coord_min;
+        if (extent <= 0) {
+            continue;
+        }
+        float bin_size = extent / SAH_BIN_COUNT;
+        SpatialBin bins[SAH_BIN_COUNT];
+        for (auto &bin : bins) {
+            bin = SpatialBin{empty_min(), empty_max(), 0, 0};
+        }
+        for (const Reference &reference : references) {
+            int first = std::min(
+                std::max(static_cast<int>((get_coord(coord, reference.min) -
+                                           coord_min) /
+                                          bin_size),
+                         0),
+                SAH_BIN_COUNT - 1);
+            int last = std::min(
+                std::max(static_cast<int>((get_coord(coord, reference.max) -
+                                           coord_min) /
+                                          bin_size),
+                         first),
+                SAH_BIN_COUNT - 1);
+            if (first == last) {
+                grow(bins[first].min, bins[first].max, reference.min,
+                     reference.max);
+            } else {
+                for (int i = first; i <= last; i++) {
+                    PaddedVec3ForGLSL min;
+                    PaddedVec3ForGLSL max;
+                    clip_reference(state.triangles[reference.triangle],
+                                   reference, coord,
+                                   coord_min + bin_size * i,
+                                   coord_min + bin_size * (i + 1), min, max);
+                    if (!is_empty(min, max)) {
+                        grow(bins[i].min, bins[i].max, min, max);
+                    }
+                }
+            }
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        float right_area[SAH_BIN_COUNT];
+        int right_count[SAH_BIN_COUNT];
+        PaddedVec3ForGLSL min = empty_min();
+        PaddedVec3ForGLSL max = empty_max();
+        int count = 0;
+        for (int i = SAH_BIN_COUNT - 1; i > 0; i--) {
+            grow(min, max, bins[i].min, bins[i].max);
+            count += bins[i].exits;
+            right_area[i] = surface_area(min, max);
+            right_count[i] = count;
+        }
+        min = empty_min();
+        max = empty_max();
+        count = 0;
+        for (int i = 0; i < SAH_BIN_COUNT - 1; i++) {
+            grow(min, max, bins[i].min, bins[i].max);
+            count += bins[i].entries;
+            if (count == 0 || right_count[i + 1] == 0) {
+                continue;
+            }
+            float cost = surface_area(min, max) * count +
+                         right_area[i + 1] * right_count[i + 1];
+            if (cost < best.cost) {
+                best = SpatialSplit{coord, coord_min + bin_size * (i + 1), cost};
+            }
+        }
+    }
+    return best;
+}
+
+// Returns false, leaving left and right empty, if the split would leave one
+// side without references or would go over the duplication budget
+bool split_spatially(SbvhState &state, const std::vector<Reference> &references,
+                     const SpatialSplit &split, std::vector<Reference> &left,
+                     std::vector<Reference> &right) {
+    int duplicates = 0;
+    for (const Reference &reference : references) {
+        if (get_coord(split.coord, reference.max) <= split.plane) {
+            left.push_back(reference);
+        } else if (get_coord(split.coord, reference.min) >= split.plane) {
+            right.push_back(reference);
+        } else {
+            const TriangleForGLSL *triangle =
+                state.triangles[reference.triangle];
+            Reference clipped = reference;
+            clip_reference(triangle, reference, split.coord,
+                           get_coord(split.coord, reference.min), split.plane,
+                           clipped.min, clipped.max);
+            bool in_left = !is_empty(clipped.min, clipped.max);
+            if (in_left) {
+                left.push_back(clipped);
+            }
+            clip_reference(triangle, reference, split.coord, split.plane,
+                           get_coord(split.coord, reference.max), clipped.min,
+                           clipped.max);
+            bool in_right = !is_empty(clipped.min, clipped.max);
+            if (in_right) {
+                right.push_back(clipped);
+            }
+            if (!in_left && !in_right) {
+                // Numerically lost on both sides, keep it whole
+                left.push_back(reference);
+            }
+            duplicates += in_left && in_right;
+        }
+    }
+    if (left.empty() || right.empty() ||
+        duplicates > state.remaining_budget) {
+        left.clear();
+        right.clear();
+        return false;
+    }
+    state.remaining_budget -= duplicates;
+    return true;
+}
+
+Box references_to_box(std::vector<Box> &boxes, SbvhState &state,
+                      std::vector<Reference> &references) {
+    PaddedVec3ForGLSL node_min = empty_min();
+    PaddedVec3ForGLSL node_max = empty_max();
+    for (const Reference &reference : references) {
+        grow(node_min, node_max, reference.min, reference.max);
+    }
+
+    ObjectSplit object = find_object_split(references);
+    if (should_make_leaf(references.size(), node_min, node_max,
+                         object.cost)) {
+        int start = state.triangle_indices.size();
+        for (const Reference &reference : references) {
+            state.triangle_indices.push_back(reference.triangle);
+        }
+        return Box(node_min, node_max, -1, -1, start,
+                   state.triangle_indices.size());
+    }
+
+    std::vector<Reference> left;
+    std::vector<Reference> right;
+    bool split_done = false;
+    if (state.remaining_budget > 0 &&
+        (object.coord == -1 ||
+         overlap_area(object.left_min, object.left_max, object.right_min,
+                      object.right_max) >
+             SBVH_ALPHA * state.root_area)) {
+        SpatialSplit spatial =
+            find_spatial_split(state, references, node_min, node_max);
+        if (spatial.coord != -1 && spatial.cost < object.cost) {
+            split_done =
+                split_spatially(state, references, spatial, left, right);
+        }
+    }
+    if (!split_done && object.coord != -1) {
+        for (const Reference &reference : references) {
+            if (get_centroid(object.coord, reference) < object.plane) {
+                left.push_back(reference);
+            } else {
+                right.push_back(reference);
+            }
+        }
+        split_done = !left.empty() && !right.empty();
+        if (!split_done) {
+            left.clear();
+            right.clear();
+        }
+    }
+    if (!split_done) {
+        int mid = references.size() / 2;
+        left.assign(references.begin(), references.begin() + mid);
+        right.assign(references.begin() + mid, references.end());
+    }
+    // The children get their own copies, free ours before recursing
+    std::vector<Reference>().swap(references);
+
+    int start = state.triangle_indices.size();
+    boxes.emplace_back(references_to_box(boxes, state, left));
+    int left_id = boxes.size() - 1;
+    boxes.emplace_back(references_to_box(boxes, state, right));
+    int right_id = boxes.size() - 1;
+
+    // Clipping may have shrunk the children below the node's bounds
+    PaddedVec3ForGLSL min = boxes[left_id].min;
+    PaddedVec3ForGLSL max = boxes[left_id].max;
+    grow(min, max, boxes[right_id].min, boxes[right_id].max);
+    return Box(min, max, left_id, right_id, start,
+               state.triangle_indices.size());
+}
+
+Box triangles_to_box_sbvh(std::vector<Box> &boxes,
+                          const std::vector<TriangleForGLSL *> &triangles,
+                          std::vector<int> &triangle_indices, float budget) {
+    std::vector<Reference> references;
+    references.reserve(triangles.size());
+    PaddedVec3ForGLSL min = empty_min();
+    PaddedVec3ForGLSL max = empty_max();
+    for (size_t i = 0; i < triangles.size(); i++) {
+        references.push_back(
+            Reference{static_cast<int>(i), triangles[i]->min, triangles[i]->max});
+        grow(min, max, triangles[i]->min, triangles[i]->max);
+    }
+    // Also catches NaN
+    if (!(budget >= 0)) {
+        budget = 0;
+    }
+    budget = std::min(budget, SBVH_MAX_BUDGET);
+    double extra = std::min<double>(
+        static_cast<double>(budget) * triangles.size(),
+        std::numeric_limits<int>::max() - triangles.size());
+    SbvhState state{triangles, triangle_indices, surface_area(min, max),
+                    static_cast<int>(extra)};
+    triangle_indices.clear();
+    triangle_indices.reserve(triangles.size() + state.remaining_budget);
+    return references_to_box(boxes, state, references);
+}
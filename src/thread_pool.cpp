@@ -0,0 +1,127 @@
+#include "./thread_pool.hpp"
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Index of the worker running on this thread, -1 outside of the pool
+thread_local int current_worker = -1;
+
+size_t thread_count_setting = 0;
+
+ThreadPool::ThreadPool(size_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = 1;
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        workers.emplace_back(new Worker());
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        threads.emplace_back(&ThreadPool::worker_loop, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::submit(TaskGroup &group, std::function<void()> task) {
+    group.pending++;
+    size_t target = current_worker >= 0
+                        ? static_cast<size_t>(current_worker)
+                        : next_worker++ % workers.size();
+    try {
+        std::lock_guard<std::mutex> lock(workers[target]->mutex);
+        workers[target]->tasks.push_back(Task{&group, std::move(task)});
+    } catch (...) {
+        group.pending--;
+        throw;
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleep_mutex);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+bool ThreadPool::run_one(size_t self) {
+    Task task{nullptr, nullptr};
+    for (size_t i = 0; i < workers.size() && !task.group; i++) {
+        size_t victim = (self + i) % workers.size();
+        std::lock_guard<std::mutex> lock(workers[victim]->mutex);
+        if (workers[victim]->tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            task = std::move(workers[victim]->tasks.back());
+            workers[victim]->tasks.pop_back();
+        } else {
+            task = std::move(workers[victim]->tasks.front());
+            workers[victim]->tasks.pop_front();
+        }
+    }
+    if (!task.group) {
+        return false;
+    }
+    queued--;
+    try {
+        task.function();
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(task.group->mutex);
+        if (!task.group->exception) {
+            task.group->exception = std::current_exception();
+        }
+    }
+    task.group->pending--;
+    return true;
+}
+
+void ThreadPool::wait(TaskGroup &group) {
+    size_t self = current_worker >= 0 ? static_cast<size_t>(current_worker) : 0;
+    while (group.pending > 0) {
+        if (!run_one(self)) {
+            std::this_thread::yield();
+        }
+    }
+    std::exception_ptr exception;
+    {
+        std::lock_guard<std::mutex> lock(group.mutex);
+        exception.swap(group.exception);
+    }
+    if (exception) {
+        std::rethrow_exception(exception);
+    }
+}
+
+void ThreadPool::worker_loop(size_t self) {
+    current_worker = static_cast<int>(self);
+    while (true) {
+        if (run_one(self)) {
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        wake.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+void set_thread_count(size_t thread_count) {
+    thread_count_setting = thread_count;
+}
+
+ThreadPool &get_thread_pool() {
+    static ThreadPool pool(thread_count_setting != 0
+                               ? thread_count_setting
+                               : std::thread::hardware_concurrency());
+    return pool;
+}
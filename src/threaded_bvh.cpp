@@ -0,0 +1,95 @@
+#include "./threaded_bvh.hpp"
+#include "./aabb.hpp"
+#include "./ray.hpp"
+#include <limits>
+#include <utility>
+#include <vector>
+
+void set_bounds(ThreadedNode &node, const PaddedVec3ForGLSL &min,
+                const PaddedVec3ForGLSL &max) {
+    node.min[0] = min.x;
+    node.min[1] = min.y;
+    node.min[2] = min.z;
+    node.max[0] = max.x;
+    node.max[1] = max.y;
+    node.max[2] = max.z;
+}
+
+// Nodes in the subtree of every box, so a node's miss link is known before
+// its subtree is written
+int count_nodes(const std::vector<Box> &boxes, int box_id,
+                std::vector<int> &sizes) {
+    const Box &box = boxes[box_id];
+    sizes[box_id] = 1;
+    if (box.left_id != -1) {
+        sizes[box_id] += count_nodes(boxes, box.left_id, sizes) +
+                         count_nodes(boxes, box.right_id, sizes);
+    }
+    return sizes[box_id];
+}
+
+void write_threaded(std::vector<ThreadedNode> &nodes,
+                    const std::vector<Box> &boxes,
+                    const std::vector<int> &sizes, int box_id, int miss) {
+    const Box &box = boxes[box_id];
+    int node_id = nodes.size();
+    nodes.push_back(ThreadedNode{});
+    nodes[node_id].miss = miss;
+    if (box.left_id == -1) {
+        if (box.end > box.start) {
+            set_bounds(nodes[node_id], box.min, box.max);
+        } else {
+            set_bounds(nodes[node_id], empty_min(), empty_max());
+        }
+        nodes[node_id].hit = miss;
+        nodes[node_id].start = box.start;
+        nodes[node_id].count = box.end - box.start;
+        return;
+    }
+    set_bounds(nodes[node_id], box.min, box.max);
+    nodes[node_id].hit = node_id + 1;
+
+    int first = box.left_id;
+    int second = box.right_id;
+    if (surface_area(boxes[second].min, boxes[second].max) >
+        surface_area(boxes[first].min, boxes[first].max)) {
+        std::swap(first, second);
+    }
+    int second_id = node_id + 1 + sizes[first];
+    write_threaded(nodes, boxes, sizes, first, second_id);
+    write_threaded(nodes, boxes, sizes, second, miss);
+}
+
+std::vector<ThreadedNode> to_threaded(const std::vector<Box> &boxes,
+                                      int root_id) {
+    std::vector<int> sizes(boxes.size());
+    std::vector<ThreadedNode> nodes;
+    nodes.reserve(count_nodes(boxes, root_id, sizes));
+    write_threaded(nodes, boxes, sizes, root_id, -1);
+    return nodes;
+}
+
+Hit trace_threaded(const std::vector<ThreadedNode> &nodes,
+                   const TriangleForGLSL *triangles,
+                   const int *triangle_indices, const Ray &ray) {
+    Hit hit = Hit{-1, std::numeric_limits<float>::max()};
+    int node_id = 0;
+    while (node_id != -1) {
+        const ThreadedNode &node = nodes[node_id];
+        float t_near;
+        if (!intersect_box(
+                ray,
+                PaddedVec3ForGLSL{node.min[0], node.min[1], node.min[2], 0},
+                PaddedVec3ForGLSL{node.max[0], node.max[1], node.max[2], 0},
+                hit.t, t_near)) {
+            node_id = node.miss;
+            continue;
+        }
+        if (node.count > 0) {
+            intersect_leaf(ray, triangles, triangle_indices, node.start,
+                           node.start + node.count, hit);
+        }
+        node_id = node.hit;
+    }
+    return hit;
+}
@@ -0,0 +1,222 @@
+#include "./treelet.hpp"
+#include "./aabb.hpp"
+#include "./thread_pool.hpp"
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <vector>
+
+// Nodes of one level are restructured by tasks of this many treelets
+const int TREELET_GRAIN = 64;
+
+const int TREELET_SUBSETS = 1 << TREELET_LEAVES;
+
+struct Treelet {
+    int leaves[TREELET_LEAVES];
+    // inner[0] is the treelet root, whose id has to stay the same
+    int inner[TREELET_LEAVES - 1];
+    int leaf_count;
+    int next_inner;
+    // For every subset of the leaves, the first half of its best split
+    int best_split[TREELET_SUBSETS];
+};
+
+// Opens up the node's descendants with the largest boxes until the treelet
+// has TREELET_LEAVES leaves or only real leaves are left
+void form_treelet(const std::vector<Box> &boxes, int node, Treelet &treelet) {
+    treelet.inner[0] = node;
+    treelet.next_inner = 1;
+    treelet.leaves[0] = boxes[node].left_id;
+    treelet.leaves[1] = boxes[node].right_id;
+    treelet.leaf_count = 2;
+    while (treelet.leaf_count < TREELET_LEAVES) {
+        int largest = -1;
+        float largest_area = -1;
+        for (int i = 0; i < treelet.leaf_count; i++) {
+            const Box &box = boxes[treelet.leaves[i]];
+            float area = surface_area(box.min, box.max);
+            if (box.left_id != -1 && area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if (largest == -1) {
+            break;
+        }
+        const Box &box = boxes[treelet.leaves[largest]];
+        treelet.inner[treelet.next_inner++] = treelet.leaves[largest];
+        treelet.leaves[largest] = box.left_id;
+        treelet.leaves[treelet.leaf_count++] = box.right_id;
+    }
+}
+
+// Area of the inner nodes, which is the only part of the SAH cost that the
+// treelet's shape changes
+float get_treelet_cost(const std::vector<Box> &boxes, const Treelet &treelet) {
+    float cost = 0;
+    for (int i = 0; i < treelet.next_inner; i++) {
+        cost += surface_area(boxes[treelet.inner[i]].min,
+                             boxes[treelet.inner[i]].max);
+    }
+    return cost;
+}
+
+int rebuild_treelet(std::vector<Box> &boxes, Treelet &treelet, int subset,
+                    int full) {
+    if ((subset & (subset - 1)) == 0) {
+        int leaf = 0;
+        while (subset != 1 << leaf) {
+            leaf++;
+        }
+        return treelet.leaves[leaf];
+    }
+    int id = subset == full ? treelet.inner[0]
+                            : treelet.inner[treelet.next_inner++];
+    int left = rebuild_treelet(boxes, treelet, treelet.best_split[subset],
+                               full);
+    int right = rebuild_treelet(
+        boxes, treelet, subset ^ treelet.best_split[subset], full);
+    PaddedVec3ForGLSL min = boxes[left].min;
+    PaddedVec3ForGLSL max = boxes[left].max;
+    grow(min, max, boxes[right].min, boxes[right].max);
+    // Inner nodes only keep the span of their leaves' ranges
+    boxes[id] = Box(min, max, left, right,
+                    std::min(boxes[left].start, boxes[right].start),
+                    std::max(boxes[left].end, boxes[right].end));
+    return id;
+}
+
+// Returns true when a cheaper shape was found and written
+bool restructure_treelet(std::vector<Box> &boxes, int node) {
+    Treelet treelet;
+    form_treelet(boxes, node, treelet);
+    if (treelet.leaf_count < 3) {
+        return false;
+    }
+
+    int full = (1 << treelet.leaf_count) - 1;
+    PaddedVec3ForGLSL min[TREELET_SUBSETS];
+    PaddedVec3ForGLSL max[TREELET_SUBSETS];
+    float cost[TREELET_SUBSETS];
+    for (int subset = 1; subset <= full; subset++) {
+        int lowest = subset & -subset;
+        if (subset == lowest) {
+            int leaf = 0;
+            while (lowest != 1 << leaf) {
+                leaf++;
+            }
+            min[subset] = boxes[treelet.leaves[leaf]].min;
+            max[subset] = boxes[treelet.leaves[leaf]].max;
+            cost[subset] = 0;
+            continue;
+        }
+        min[subset] = min[subset ^ lowest];
+        max[subset] = max[subset ^ lowest];
+        grow(min[subset], max[subset], min[lowest], max[lowest]);
+
+        // Every split is tried once by keeping the lowest leaf on the left
+        float best = std::numeric_limits<float>::max();
+        for (int left = (subset - 1) & subset; left > 0;
+             left = (left - 1) & subset) {
+            if ((left & lowest) == 0) {
+                continue;
+            }
+            float split_cost = cost[left] + cost[subset ^ left];
+            if (split_cost < best) {
+                best = split_cost;
+                treelet.best_split[subset] = left;
+            }
+        }
+        cost[subset] = surface_area(min[subset], max[subset]) + best;
+    }
+
+    float old_cost = get_treelet_cost(boxes, treelet);
+    if (cost[full] >= old_cost * (1 - 1e-6f)) {
+        return false;
+    }
+    treelet.next_inner = 1;
+    rebuild_treelet(boxes, treelet, full, full);
+    return true;
+}
+
+void write_postorder(const std::vector<Box> &boxes, int id,
+                     std::vector<Box> &ordered) {
+    Box box = boxes[id];
+    if (box.left_id != -1) {
+        write_postorder(boxes, box.left_id, ordered);
+        box.left_id = ordered.size() - 1;
+        write_postorder(boxes, box.right_id, ordered);
+        box.right_id = ordered.size() - 1;
+    }
+    ordered.push_back(box);
+}
+
+TreeletReport optimize_treelets(ThreadPool &pool, std::vector<Box> &boxes,
+                                int &root_id, double budget_ms) {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::duration_cast<
+                                std::chrono::steady_clock::duration>(
+                                std::chrono::duration<double, std::milli>(
+                                    budget_ms));
+    TreeletReport report =
+        TreeletReport{get_sah_cost(boxes, root_id), 0, 0, true};
+    std::atomic<bool> out_of_time(false);
+
+    for (int pass = 0; pass < TREELET_PASSES && !out_of_time; pass++) {
+        // Inner nodes grouped by depth. Treelets of nodes on the same level
+        // never overlap, and a node's treelet only changes its own subtree,
+        // so the levels stay valid while the deeper ones are rewritten
+        std::vector<std::vector<int>> levels;
+        std::vector<int> current = {root_id};
+        while (!current.empty()) {
+            std::vector<int> next;
+            std::vector<int> inner;
+            for (int id : current) {
+                if (boxes[id].left_id != -1) {
+                    inner.push_back(id);
+                    next.push_back(boxes[id].left_id);
+                    next.push_back(boxes[id].right_id);
+                }
+            }
+            if (!inner.empty()) {
+                levels.push_back(inner);
+            }
+            current.swap(next);
+        }
+
+        std::atomic<int> changed(0);
+        for (int level = levels.size() - 1; level >= 0 && !out_of_time;
+             level--) {
+            const std::vector<int> &nodes = levels[level];
+            parallel_for(pool, 0, nodes.size(), TREELET_GRAIN,
+                         [&](int chunk_start, int chunk_end) {
+                             if (std::chrono::steady_clock::now() > deadline) {
+                                 out_of_time = true;
+                                 return;
+                             }
+                             int chunk_changed = 0;
+                             for (int i = chunk_start; i < chunk_end; i++) {
+                                 chunk_changed +=
+                                     restructure_treelet(boxes, nodes[i]);
+                             }
+                             changed += chunk_changed;
+                         });
+        }
+        if (!out_of_time) {
+            report.passes++;
+        }
+        if (changed == 0) {
+            break;
+        }
+    }
+
+    std::vector<Box> ordered;
+    ordered.reserve(boxes.size());
+    write_postorder(boxes, root_id, ordered);
+    boxes.swap(ordered);
+    root_id = boxes.size() - 1;
+
+    report.cost_after = get_sah_cost(boxes, root_id);
+    report.finished = !out_of_time;
+    return report;
+}
@@ -0,0 +1,272 @@
+#include "./triangle_pairs.hpp"
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./ray.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+// One edge of one triangle, with its end points sorted so both triangles
+// that share it produce the same key
+struct EdgeRecord {
+    float key[6];
+    int triangle;
+    int edge;
+};
+
+bool vertex_less(const PaddedVec3ForGLSL &a, const PaddedVec3ForGLSL &b) {
+    if (a.x != b.x) {
+        return a.x < b.x;
+    }
+    if (a.y != b.y) {
+        return a.y < b.y;
+    }
+    return a.z < b.z;
+}
+
+bool same_vertex(const PaddedVec3ForGLSL &a, const PaddedVec3ForGLSL &b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+const PaddedVec3ForGLSL &get_vertex(const TriangleForGLSL &triangle, int i) {
+    return i == 0 ? triangle.v1 : i == 1 ? triangle.v2 : triangle.v3;
+}
+
+bool same_material(const TriangleForGLSL &a, const TriangleForGLSL &b) {
+    return a.texture_id == b.texture_id &&
+           a.metallic_roughness_texture_id == b.metallic_roughness_texture_id &&
+           a.metallic_factor == b.metallic_factor &&
+           a.roughness_factor == b.roughness_factor &&
+           a.alpha_cutoff == b.alpha_cutoff &&
+           a.double_sided == b.double_sided &&
+           same_vertex(a.emissive_factor, b.emissive_factor) &&
+           a.base_color_factor.x == b.base_color_factor.x &&
+           a.base_color_factor.y == b.base_color_factor.y &&
+           a.base_color_factor.z == b.base_color_factor.z &&
+           a.base_color_factor.w == b.base_color_factor.w;
+}
+
+void copy_vertex(float *to, const PaddedVec3ForGLSL &from) {
+    to[0] = from.x;
+    to[1] = from.y;
+    to[2] = from.z;
+}
+
+std::vector<TrianglePair>
+pair_triangles(const std::vector<TriangleForGLSL *> &triangles) {
+    std::vector<EdgeRecord> edges;
+    edges.reserve(3 * triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        for (int edge = 0; edge < 3; edge++) {
+            PaddedVec3ForGLSL from = get_vertex(*triangles[i], edge);
+            PaddedVec3ForGLSL to = get_vertex(*triangles[i], (edge + 1) % 3);
+            if (vertex_less(to, from)) {
+                std::swap(from, to);
+            }
+            edges.push_back(EdgeRecord{
+                {from.x, from.y, from.z, to.x, to.y, to.z},
+                static_cast<int>(i),
+                edge});
+        }
+    }
+    std::sort(edges.begin(), edges.end(),
+              [](const EdgeRecord &a, const EdgeRecord &b) {
+                  return std::lexicographical_compare(a.key, a.key + 6, b.key,
+                                                      b.key + 6);
+              });
+
+    // Only edges shared by exactly two triangles, anything else is not
+    // part of a clean quad
+    std::vector<int> neighbours(3 * triangles.size(), -1);
+    for (size_t i = 0; i < edges.size();) {
+        size_t j = i + 1;
+        while (j < edges.size() &&
+               std::equal(edges[i].key, edges[i].key + 6, edges[j].key)) {
+            j++;
+        }
+        if (j - i == 2) {
+            neighbours[3 * edges[i].triangle + edges[i].edge] =
+                edges[i + 1].triangle;
+            neighbours[3 * edges[i + 1].triangle + edges[i + 1].edge] =
+                edges[i].triangle;
+        }
+        i = j;
+    }
+
+    std::vector<bool> paired(triangles.size(), false);
+    std::vector<TrianglePair> pairs;
+    pairs.reserve(triangles.size() / 2 + 1);
+    for (size_t i = 0; i < triangles.size(); i++) {
+        if (paired[i]) {
+            continue;
+        }
+        paired[i] = true;
+        const TriangleForGLSL &triangle = *triangles[i];
+        TrianglePair pair = TrianglePair{};
+        pair.first = i;
+        pair.second = -1;
+        copy_vertex(pair.a, triangle.v1);
+        copy_vertex(pair.b, triangle.v2);
+        copy_vertex(pair.c, triangle.v3);
+        copy_vertex(pair.d, triangle.v3);
+        for (int edge = 0; edge < 3; edge++) {
+            int neighbour = neighbours[3 * i + edge];
+            if (neighbour == -1 || paired[neighbour] ||
+                !same_material(triangle, *triangles[neighbour])) {
+                continue;
+            }
+            const PaddedVec3ForGLSL &a = get_vertex(triangle, edge);
+            const PaddedVec3ForGLSL &b = get_vertex(triangle, (edge + 1) % 3);
+            const TriangleForGLSL &other = *triangles[neighbour];
+            int opposite = 0;
+            while (same_vertex(get_vertex(other, opposite), a) ||
+                   same_vertex(get_vertex(other, opposite), b)) {
+                opposite++;
+            }
+            paired[neighbour] = true;
+            pair.second = neighbour;
+            copy_vertex(pair.a, a);
+            copy_vertex(pair.b, b);
+            copy_vertex(pair.c, get_vertex(triangle, (edge + 2) % 3));
+            copy_vertex(pair.d, get_vertex(other, opposite));
+            break;
+        }
+        pairs.push_back(pair);
+    }
+    return pairs;
+}
+
+AABB *triangle_pairs_to_aabb(std::vector<Box> &boxes,
+                             std::vector<TrianglePair> &pairs, int strategy) {
+    // The builders only look at the bounds of what they sort, so every
+    // pair stands in as a triangle with the box around both
+    std::vector<TriangleForGLSL> proxies(pairs.size());
+    std::vector<TriangleForGLSL *> pointers(pairs.size());
+    for (size_t i = 0; i < pairs.size(); i++) {
+        PaddedVec3ForGLSL min = empty_min();
+        PaddedVec3ForGLSL max = empty_max();
+        for (const float *vertex :
+             {pairs[i].a, pairs[i].b, pairs[i].c, pairs[i].d}) {
+            PaddedVec3ForGLSL point =
+                PaddedVec3ForGLSL{vertex[0], vertex[1], vertex[2], 0};
+            grow(min, max, point, point);
+        }
+        proxies[i].min = min;
+        proxies[i].max = max;
+        pointers[i] = &proxies[i];
+    }
+    AABB *aabb =
+        triangles_to_aabb(boxes, pointers, 0, pointers.size(), 0, strategy);
+
+    std::vector<TrianglePair> ordered;
+    ordered.reserve(pairs.size());
+    for (auto proxy : pointers) {
+        ordered.push_back(pairs[proxy - proxies.data()]);
+    }
+    pairs.swap(ordered);
+    return aabb;
+}
+
+PaddedVec3ForGLSL to_vec3(const float *v) {
+    return PaddedVec3ForGLSL{v[0], v[1], v[2], 0};
+}
+
+PaddedVec3ForGLSL subtract(const PaddedVec3ForGLSL &a,
+                           const PaddedVec3ForGLSL &b) {
+    return PaddedVec3ForGLSL{a.x - b.x, a.y - b.y, a.z - b.z, 0};
+}
+
+PaddedVec3ForGLSL cross_product(const PaddedVec3ForGLSL &a,
+                                const PaddedVec3ForGLSL &b) {
+    return PaddedVec3ForGLSL{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+                             a.x * b.y - a.y * b.x, 0};
+}
+
+float dot_product(const PaddedVec3ForGLSL &a, const PaddedVec3ForGLSL &b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+bool intersect_triangle_pair(const Ray &ray, const TrianglePair &pair,
+                             float &t, int &triangle) {
+    // Moller-Trumbore from a for both triangles: the shared edge, the
+    // vector to the ray origin and their cross product are computed once
+    PaddedVec3ForGLSL a = to_vec3(pair.a);
+    PaddedVec3ForGLSL shared_edge = subtract(to_vec3(pair.b), a);
+    PaddedVec3ForGLSL to_origin = subtract(ray.origin, a);
+    PaddedVec3ForGLSL q = cross_product(to_origin, shared_edge);
+    float direction_q = dot_product(ray.direction, q);
+
+    bool found = false;
+    t = std::numeric_limits<float>::max();
+    for (int side = 0; side < (pair.second == -1 ? 1 : 2); side++) {
+        PaddedVec3ForGLSL edge =
+            subtract(to_vec3(side == 0 ? pair.c : pair.d), a);
+        PaddedVec3ForGLSL p = cross_product(ray.direction, edge);
+        float determinant = dot_product(shared_edge, p);
+        if (std::abs(determinant) < 1e-12f) {
+            continue;
+        }
+        float inv_determinant = 1.0f / determinant;
+        float u = dot_product(to_origin, p) * inv_determinant;
+        float v = direction_q * inv_determinant;
+        if (u < 0 || v < 0 || u + v > 1) {
+            continue;
+        }
+        float side_t = dot_product(edge, q) * inv_determinant;
+        if (side_t > 0 && side_t < t) {
+            t = side_t;
+            triangle = side == 0 ? pair.first : pair.second;
+            found = true;
+        }
+    }
+    return found;
+}
+
+Hit trace_triangle_pairs(const std::vector<Box> &boxes, int root_id,
+                         const std::vector<TrianglePair> &pairs,
+                         const Ray &ray) {
+    Hit hit = Hit{-1, std::numeric_limits<float>::max()};
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = root_id;
+    while (stack_size > 0) {
+        const Box &box = boxes[stack[--stack_size]];
+        float t_near;
+        if (!intersect_box(ray, box.min, box.max, hit.t, t_near)) {
+            continue;
+        }
+        if (box.left_id != -1) {
+            float t_left;
+            float t_right;
+            bool left = intersect_box(ray, boxes[box.left_id].min,
+                                      boxes[box.left_id].max, hit.t, t_left);
+            bool right =
+                intersect_box(ray, boxes[box.right_id].min,
+                              boxes[box.right_id].max, hit.t, t_right);
+            if (left && right) {
+                if (t_left < t_right) {
+                    stack[stack_size++] = box.right_id;
+                    stack[stack_size++] = box.left_id;
+                } else {
+                    stack[stack_size++] = box.left_id;
+                    stack[stack_size++] = box.right_id;
+                }
+            } else if (left) {
+                stack[stack_size++] = box.left_id;
+            } else if (right) {
+                stack[stack_size++] = box.right_id;
+            }
+            continue;
+        }
+        for (int i = box.start; i < box.end; i++) {
+            float t;
+            int triangle;
+            if (intersect_triangle_pair(ray, pairs[i], t, triangle) &&
+                t < hit.t) {
+                hit = Hit{triangle, t};
+            }
+        }
+    }
+    return hit;
+}
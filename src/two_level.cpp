@@ -0,0 +1,213 @@
+#include "./two_level.hpp"
+#include "./aabb.hpp"
+#include "./load_model.hpp"
+#include "./ray.hpp"
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+Matrix4 identity_matrix() {
+    return Matrix4{Vec4{1, 0, 0, 0}, Vec4{0, 1, 0, 0}, Vec4{0, 0, 1, 0},
+                   Vec4{0, 0, 0, 1}};
+}
+
+// Inverse of an affine matrix, done on the 3x3 part and the translation
+Matrix4 invert_affine(const Matrix4 &m) {
+    double c00 = m.v2.y * m.v3.z - m.v2.z * m.v3.y;
+    double c01 = m.v1.z * m.v3.y - m.v1.y * m.v3.z;
+    double c02 = m.v1.y * m.v2.z - m.v1.z * m.v2.y;
+    double c10 = m.v2.z * m.v3.x - m.v2.x * m.v3.z;
+    double c11 = m.v1.x * m.v3.z - m.v1.z * m.v3.x;
+    double c12 = m.v1.z * m.v2.x - m.v1.x * m.v2.z;
+    double c20 = m.v2.x * m.v3.y - m.v2.y * m.v3.x;
+    double c21 = m.v1.y * m.v3.x - m.v1.x * m.v3.y;
+    double c22 = m.v1.x * m.v2.y - m.v1.y * m.v2.x;
+    double inv_determinant = 1.0 / (m.v1.x * c00 + m.v1.y * c10 + m.v1.z * c20);
+    Vec4 r1 = Vec4{c00 * inv_determinant, c01 * inv_determinant,
+                   c02 * inv_determinant, 0};
+    Vec4 r2 = Vec4{c10 * inv_determinant, c11 * inv_determinant,
+                   c12 * inv_determinant, 0};
+    Vec4 r3 = Vec4{c20 * inv_determinant, c21 * inv_determinant,
+                   c22 * inv_determinant, 0};
+    r1.w = -(r1.x * m.v1.w + r1.y * m.v2.w + r1.z * m.v3.w);
+    r2.w = -(r2.x * m.v1.w + r2.y * m.v2.w + r2.z * m.v3.w);
+    r3.w = -(r3.x * m.v1.w + r3.y * m.v2.w + r3.z * m.v3.w);
+    return Matrix4{r1, r2, r3, Vec4{0, 0, 0, 1}};
+}
+
+Vec4ForGLSL to_row(const Vec4 &v) {
+    return Vec4ForGLSL{static_cast<float>(v.x), static_cast<float>(v.y),
+                       static_cast<float>(v.z), static_cast<float>(v.w)};
+}
+
+PaddedVec3ForGLSL transform_point(const Vec4ForGLSL *rows,
+                                  const PaddedVec3ForGLSL &v) {
+    return PaddedVec3ForGLSL{
+        rows[0].x * v.x + rows[0].y * v.y + rows[0].z * v.z + rows[0].w,
+        rows[1].x * v.x + rows[1].y * v.y + rows[1].z * v.z + rows[1].w,
+        rows[2].x * v.x + rows[2].y * v.y + rows[2].z * v.z + rows[2].w, 0};
+}
+
+PaddedVec3ForGLSL transform_direction(const Vec4ForGLSL *rows,
+                                      const PaddedVec3ForGLSL &v) {
+    return PaddedVec3ForGLSL{
+        rows[0].x * v.x + rows[0].y * v.y + rows[0].z * v.z,
+        rows[1].x * v.x + rows[1].y * v.y + rows[1].z * v.z,
+        rows[2].x * v.x + rows[2].y * v.y + rows[2].z * v.z, 0};
+}
+
+// Builds the BLAS of one mesh from its primitives in mesh space and appends
+// it to the scene, returning the id of its root box
+int add_blas(TwoLevelScene &scene,
+             const std::vector<TriangleForGLSL> &primitives, int strategy) {
+    std::vector<TriangleForGLSL> mesh_triangles = primitives;
+    std::vector<TriangleForGLSL *> triangles;
+    triangles.reserve(mesh_triangles.size());
+    for (auto &triangle : mesh_triangles) {
+        triangles.emplace_back(&triangle);
+    }
+    std::vector<Box> boxes;
+    AABB *aabb =
+        triangles_to_aabb(boxes, triangles, 0, triangles.size(), 0, strategy);
+
+    int triangle_offset = scene.triangles.size();
+    int box_offset = scene.blas_boxes.size();
+    for (auto triangle : triangles) {
+        scene.triangles.push_back(*triangle);
+    }
+    for (auto box : boxes) {
+        if (box.left_id != -1) {
+            box.left_id += box_offset;
+            box.right_id += box_offset;
+        }
+        box.start += triangle_offset;
+        box.end += triangle_offset;
+        scene.blas_boxes.push_back(box);
+    }
+    int root_id = aabb->root_id + box_offset;
+    delete aabb;
+    return root_id;
+}
+
+// Builds one BLAS per mesh from the first node under node that holds its
+// primitives
+void add_two_level_meshes(TwoLevelScene &scene, const OurNode &node,
+                          std::unordered_map<int, int> &mesh_roots,
+                          int strategy) {
+    if (!node.primitives.empty() &&
+        mesh_roots.find(node.mesh) == mesh_roots.end()) {
+        mesh_roots[node.mesh] = add_blas(scene, node.primitives, strategy);
+    }
+    for (const auto &child : node.children) {
+        add_two_level_meshes(scene, child, mesh_roots, strategy);
+    }
+}
+
+// Adds an instance for every node under node that draws a mesh with a BLAS,
+// whether or not the node holds the primitives itself
+void add_two_level_node(TwoLevelScene &scene, const OurNode &node,
+                        const Matrix4 &parent_matrix,
+                        const std::unordered_map<int, int> &mesh_roots) {
+    Matrix4 matrix = mul_matrixes(parent_matrix, node.matrix);
+    auto found = mesh_roots.find(node.mesh);
+    if (node.mesh > -1 && found != mesh_roots.end()) {
+        Matrix4 inverse = invert_affine(matrix);
+        scene.instances.push_back(InstanceForGLSL{
+            {to_row(matrix.v1), to_row(matrix.v2), to_row(matrix.v3)},
+            {to_row(inverse.v1), to_row(inverse.v2), to_row(inverse.v3)},
+            found->second,
+            {0, 0, 0}});
+    }
+    for (const auto &child : node.children) {
+        add_two_level_node(scene, child, matrix, mesh_roots);
+    }
+}
+
+void add_two_level_model(TwoLevelScene &scene, const OurNode &model,
+                         int strategy) {
+    // Mesh ids are only unique within one glTF file
+    std::unordered_map<int, int> mesh_roots;
+    add_two_level_meshes(scene, model, mesh_roots, strategy);
+    add_two_level_node(scene, model, identity_matrix(), mesh_roots);
+}
+
+void build_tlas(TwoLevelScene &scene, int strategy) {
+    // The builders only look at the bounds of what they sort, so every
+    // instance stands in as a triangle with its world space box
+    std::vector<TriangleForGLSL> proxies(scene.instances.size());
+    std::vector<TriangleForGLSL *> pointers(scene.instances.size());
+    for (size_t i = 0; i < scene.instances.size(); i++) {
+        const InstanceForGLSL &instance = scene.instances[i];
+        const Box &root = scene.blas_boxes[instance.blas_root_id];
+        PaddedVec3ForGLSL min = empty_min();
+        PaddedVec3ForGLSL max = empty_max();
+        for (int corner = 0; corner < 8; corner++) {
+            PaddedVec3ForGLSL point = transform_point(
+                instance.object_to_world,
+                PaddedVec3ForGLSL{corner & 1 ? root.max.x : root.min.x,
+                                  corner & 2 ? root.max.y : root.min.y,
+                                  corner & 4 ? root.max.z : root.min.z, 0});
+            grow(min, max, point, point);
+        }
+        proxies[i].min = min;
+        proxies[i].max = max;
+        pointers[i] = &proxies[i];
+    }
+
+    scene.tlas_boxes.clear();
+    if (pointers.empty()) {
+        scene.tlas_root_id = -1;
+        return;
+    }
+    AABB *aabb = triangles_to_aabb(scene.tlas_boxes, pointers, 0,
+                                   pointers.size(), 0, strategy);
+    scene.tlas_root_id = aabb->root_id;
+    delete aabb;
+
+    // Put the instances in the order the leaves reference them
+    std::vector<InstanceForGLSL> instances;
+    instances.reserve(pointers.size());
+    for (auto proxy : pointers) {
+        instances.push_back(scene.instances[proxy - proxies.data()]);
+    }
+    scene.instances.swap(instances);
+}
+
+Hit trace_two_level(const TwoLevelScene &scene, const Ray &ray,
+                    int &instance) {
+    Hit hit = Hit{-1, std::numeric_limits<float>::max()};
+    instance = -1;
+    if (scene.tlas_root_id == -1) {
+        return hit;
+    }
+    int stack[TRAVERSAL_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = scene.tlas_root_id;
+    while (stack_size > 0) {
+        const Box &box = scene.tlas_boxes[stack[--stack_size]];
+        float t_near;
+        if (!intersect_box(ray, box.min, box.max, hit.t, t_near)) {
+            continue;
+        }
+        if (box.left_id != -1) {
+            stack[stack_size++] = box.left_id;
+            stack[stack_size++] = box.right_id;
+            continue;
+        }
+        for (int i = box.start; i < box.end; i++) {
+            const InstanceForGLSL &current = scene.instances[i];
+            // The direction is not normalized again, so t means the same
+            // thing on both sides of the transform
+            Ray local = make_ray(
+                transform_point(current.world_to_object, ray.origin),
+                transform_direction(current.world_to_object, ray.direction));
+            Hit local_hit = trace_boxes(scene.blas_boxes, current.blas_root_id,
+                                        scene.triangles.data(), nullptr, local);
+            if (local_hit.triangle != -1 && local_hit.t < hit.t) {
+                hit = local_hit;
+                instance = i;
+            }
+        }
+    }
+    return hit;
+}
@@ -0,0 +1,160 @@
+#include "./wide_bvh.hpp"
+#include "./aabb.hpp"
+#include "./ray.hpp"
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+template <int Width>
+void set_slot(WideNode<Width> &node, int slot, const PaddedVec3ForGLSL &min,
+              const PaddedVec3ForGLSL &max, int child, int count) {
+    node.min_x[slot] = min.x;
+    node.min_y[slot] = min.y;
+    node.min_z[slot] = min.z;
+    node.max_x[slot] = max.x;
+    node.max_y[slot] = max.y;
+    node.max_z[slot] = max.z;
+    node.child[slot] = child;
+    node.count[slot] = count;
+}
+
+template <int Width>
+int collapse_node(std::vector<WideNode<Width>> &nodes,
+                  const std::vector<Box> &boxes, int box_id) {
+    int node_id = nodes.size();
+    nodes.emplace_back();
+    for (int slot = 0; slot < Width; slot++) {
+        set_slot(nodes[node_id], slot, empty_min(), empty_max(), -1, 0);
+    }
+
+    const Box &box = boxes[box_id];
+    std::vector<int> children;
+    if (box.left_id == -1) {
+        children.push_back(box_id);
+    } else {
+        children.push_back(box.left_id);
+        children.push_back(box.right_id);
+    }
+    while (static_cast<int>(children.size()) < Width) {
+        int largest = -1;
+        float largest_area = -1;
+        for (size_t i = 0; i < children.size(); i++) {
+            const Box &child = boxes[children[i]];
+            float area = surface_area(child.min, child.max);
+            if (child.left_id != -1 && area > largest_area) {
+                largest = i;
+                largest_area = area;
+            }
+        }
+        if (largest == -1) {
+            break;
+        }
+        const Box &opened = boxes[children[largest]];
+        children[largest] = opened.left_id;
+        children.push_back(opened.right_id);
+    }
+
+    for (size_t slot = 0; slot < children.size(); slot++) {
+        const Box &child = boxes[children[slot]];
+        if (child.left_id == -1) {
+            if (child.end > child.start) {
+                set_slot(nodes[node_id], slot, child.min, child.max,
+                         child.start, child.end - child.start);
+            }
+            continue;
+        }
+        // Recursing may reallocate nodes, so no references across this call
+        int child_id = collapse_node(nodes, boxes, children[slot]);
+        set_slot(nodes[node_id], slot, child.min, child.max, child_id, 0);
+    }
+    return node_id;
+}
+
+template <int Width>
+std::vector<WideNode<Width>> collapse(const std::vector<Box> &boxes,
+                                      int root_id) {
+    std::vector<WideNode<Width>> nodes;
+    nodes.reserve(boxes.size() / (Width - 1) + 1);
+    collapse_node(nodes, boxes, root_id);
+    return nodes;
+}
+
+template <int Width>
+Hit trace_wide(const std::vector<WideNode<Width>> &nodes,
+               const TriangleForGLSL *triangles, const int *triangle_indices,
+               const Ray &ray) {
+    Hit hit = Hit{-1, std::numeric_limits<float>::max()};
+    int stack[TRAVERSAL_STACK_SIZE * Width];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        const WideNode<Width> &node = nodes[stack[--stack_size]];
+
+        // One slab test per slot over the SoA arrays, which the compiler
+        // (and a GPU, lane by lane) can do for all slots at once
+        float t_near[Width];
+        bool hits[Width];
+        for (int slot = 0; slot < Width; slot++) {
+            float tx1 = (node.min_x[slot] - ray.origin.x) * ray.inv_direction.x;
+            float tx2 = (node.max_x[slot] - ray.origin.x) * ray.inv_direction.x;
+            float ty1 = (node.min_y[slot] - ray.origin.y) * ray.inv_direction.y;
+            float ty2 = (node.max_y[slot] - ray.origin.y) * ray.inv_direction.y;
+            float tz1 = (node.min_z[slot] - ray.origin.z) * ray.inv_direction.z;
+            float tz2 = (node.max_z[slot] - ray.origin.z) * ray.inv_direction.z;
+            t_near[slot] =
+                std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)),
+                         std::max(std::min(tz1, tz2), 0.0f));
+            float t_far =
+                std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)),
+                         std::min(std::max(tz1, tz2), hit.t));
+            hits[slot] = t_near[slot] <= t_far;
+        }
+
+        // Leaves right away, inner nodes pushed farthest first
+        int order[Width];
+        int order_size = 0;
+        for (int slot = 0; slot < Width; slot++) {
+            if (!hits[slot] || node.child[slot] == -1) {
+                continue;
+            }
+            if (node.count[slot] > 0) {
+                intersect_leaf(ray, triangles, triangle_indices,
+                               node.child[slot],
+                               node.child[slot] + node.count[slot], hit);
+                continue;
+            }
+            int i = order_size++;
+            while (i > 0 && t_near[order[i - 1]] < t_near[slot]) {
+                order[i] = order[i - 1];
+                i--;
+            }
+            order[i] = slot;
+        }
+        for (int i = 0; i < order_size; i++) {
+            stack[stack_size++] = node.child[order[i]];
+        }
+    }
+    return hit;
+}
+
+std::vector<Bvh4Node> collapse_to_bvh4(const std::vector<Box> &boxes,
+                                       int root_id) {
+    return collapse<4>(boxes, root_id);
+}
+
+std::vector<Bvh8Node> collapse_to_bvh8(const std::vector<Box> &boxes,
+                                       int root_id) {
+    return collapse<8>(boxes, root_id);
+}
+
+Hit trace_bvh4(const std::vector<Bvh4Node> &nodes,
+               const TriangleForGLSL *triangles, const int *triangle_indices,
+               const Ray &ray) {
+    return trace_wide(nodes, triangles, triangle_indices, ray);
+}
+
+Hit trace_bvh8(const std::vector<Bvh8Node> &nodes,
+               const TriangleForGLSL *triangles, const int *triangle_indices,
+               const Ray &ray) {
+    return trace_wide(nodes, triangles, triangle_indices, ray);
+}